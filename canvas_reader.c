@@ -0,0 +1,142 @@
+/*
+ * Sample consumer of the shared memory canvas ring: follows the latest
+ * canvas, looks at it in place and prints once a second how many canvases
+ * it saw and missed with their average luma. With a file name it also
+ * writes the luma of the last canvas as a PGM when it stops.
+ *
+ * canvas_reader /mosaic [last.pgm]
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+#include <unistd.h>
+#include <signal.h>
+#include <sys/time.h>
+
+#include "canvas_ring.h"
+
+#define READER_POLL     1000                // us between looks at the ring
+
+static volatile int stop_reading = 0;
+
+static void localStop( int sig)
+{
+    stop_reading = 1;
+}
+
+static int64_t localTimeNow( void)
+{
+struct timeval now;
+
+    gettimeofday( &now, NULL);
+    return (int64_t)now.tv_sec*1000000 + now.tv_usec;
+}
+
+// Every 4th pixel of every 4th row is plenty for a level
+static int localAverageLuma( const CanvasRingView *view)
+{
+int64_t sum = 0;
+int count = 0;
+int x, y;
+
+    for( y=0; y<view->height; y+=4) {
+    const uint8_t *row = view->data[0] + y*view->linesize[0];
+
+        for( x=0; x<view->width; x+=4) {
+            sum += row[x];
+            count++;
+        }
+    }
+
+    return count ? (int)(sum/count) : 0;
+}
+
+static void localWritePgm( const char *name, CanvasRing *ring, int64_t frame)
+{
+CanvasRingView view;
+uint8_t *luma;
+FILE *f;
+int y;
+
+    if( !canvas_ring_peek( ring, frame, &view))
+        return;
+    luma = malloc( (size_t)view.width*view.height);
+    if( !luma)
+        return;
+    for( y=0; y<view.height; y++) {
+        memcpy( luma+y*view.width, view.data[0]+y*view.linesize[0], view.width);
+    }
+    if( canvas_ring_valid( ring, &view) && (f = fopen( name, "wb"))) {
+        fprintf( f, "P5\n%d %d\n255\n", view.width, view.height);
+        fwrite( luma, view.width, view.height, f);
+        fclose( f);
+        printf( "Canvas %lld written to %s\n", (long long)frame, name);
+    }
+    free( luma);
+}
+
+int main( int argc, char **argv)
+{
+CanvasRing *ring;
+int64_t next = -1, last = -1;
+int64_t report;
+int seen = 0, missed = 0, torn = 0, luma = 0;
+
+    if( argc<2) {
+        printf( "usage: %s /shm_name [last.pgm]\n", argv[0]);
+        return 1;
+    }
+    signal( SIGINT, localStop);
+    signal( SIGTERM, localStop);
+
+    while( !(ring = canvas_ring_open( argv[1]))) {
+        if( stop_reading)
+            return 1;
+        // the mosaic may not be running yet
+        usleep( 100000);
+    }
+    printf( "%s: %dx%d, %d slots, time base %d/%d\n", argv[1], ring->header->width, ring->header->height,
+        ring->header->slots, ring->header->time_base_num, ring->header->time_base_den);
+
+    report = localTimeNow() + 1000000;
+    while( !stop_reading && !canvas_ring_closed( ring)) {
+    int64_t latest = canvas_ring_latest( ring);
+    CanvasRingView view;
+
+        if( latest<0 || latest<next) {
+            usleep( READER_POLL);
+        }
+        else {
+            if( next>=0 && latest>next) {
+                missed += latest-next;
+            }
+            // zero copy, the level is worked out on the canvas in the ring
+            if( canvas_ring_peek( ring, latest, &view)) {
+            int level = localAverageLuma( &view);
+
+                if( canvas_ring_valid( ring, &view)) {
+                    luma = level;
+                    seen++;
+                    last = latest;
+                }
+                else {
+                    torn++;
+                }
+            }
+            next = latest+1;
+        }
+        if( localTimeNow()>=report) {
+            printf( "canvas %lld: %d seen, %d missed, %d written over while read, luma %d\n",
+                (long long)last, seen, missed, torn, luma);
+            seen = missed = torn = 0;
+            report += 1000000;
+        }
+    }
+    if( argc>2 && last>=0) {
+        localWritePgm( argv[2], ring, last);
+    }
+    canvas_ring_close( ring);
+
+    return 0;
+}
@@ -0,0 +1,239 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+#include "canvas_ring.h"
+
+#define CANVAS_RING_ALIGN       64          // rows start on a cache line
+#define CANVAS_RING_PAGE        4096
+#define CANVAS_RING_RETRIES     4
+
+#define ALIGN_UP(x, a)          (((x)+(a)-1)/(a)*(a))
+
+static void localPlaneCopy( uint8_t *dst, int dst_linesize, const uint8_t *src, int src_linesize, int w, int h)
+{
+int y;
+
+    for( y=0; y<h; y++) {
+        memcpy( dst+y*dst_linesize, src+y*src_linesize, w);
+    }
+}
+
+/*
+ * The ring is created with the whole layout in the header and every slot
+ * already described, so readers only ever look at sequence, frame and pts
+ * to follow it.
+ */
+CanvasRing *canvas_ring_create( const char *name, int width, int height, int slots, int time_base_num, int time_base_den)
+{
+CanvasRing *ring = calloc( 1, sizeof( CanvasRing));
+int luma   = ALIGN_UP( width, CANVAS_RING_ALIGN);
+int chroma = ALIGN_UP( width/2, CANVAS_RING_ALIGN);
+size_t header, slot_size;
+int fd, s;
+
+    if( !ring)
+        return NULL;
+    if( slots<2 || slots>CANVAS_RING_MAX_SLOTS)
+        slots = CANVAS_RING_SLOTS;
+
+    header     = ALIGN_UP( sizeof( CanvasRingHeader) + slots*sizeof( CanvasRingSlot), CANVAS_RING_PAGE);
+    slot_size  = ALIGN_UP( (size_t)luma*height + 2*(size_t)chroma*(height/2), CANVAS_RING_PAGE);
+    ring->size = header + slots*slot_size;
+    snprintf( ring->name, sizeof( ring->name), "%s", name);
+
+    // a ring left over from a writer that died is replaced, its readers keep the old mapping
+    shm_unlink( ring->name);
+    fd = shm_open( ring->name, O_RDWR | O_CREAT | O_EXCL, 0644);
+    if( fd<0) {
+        fprintf( stderr, "Could not create shared memory '%s'\n", ring->name);
+        free( ring);
+        return NULL;
+    }
+    if( ftruncate( fd, ring->size)) {
+        fprintf( stderr, "Could not size shared memory '%s' to %zu bytes\n", ring->name, ring->size);
+        close( fd);
+        shm_unlink( ring->name);
+        free( ring);
+        return NULL;
+    }
+    ring->header = mmap( NULL, ring->size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+    close( fd);
+    if( ring->header==MAP_FAILED) {
+        fprintf( stderr, "Could not map shared memory '%s'\n", ring->name);
+        shm_unlink( ring->name);
+        free( ring);
+        return NULL;
+    }
+
+    ring->header->version       = CANVAS_RING_VERSION;
+    ring->header->slots         = slots;
+    ring->header->slot_size     = slot_size;
+    ring->header->width         = width;
+    ring->header->height        = height;
+    ring->header->time_base_num = time_base_num;
+    ring->header->time_base_den = time_base_den;
+    ring->header->latest        = -1;
+    for( s=0; s<slots; s++) {
+    CanvasRingSlot *slot = &ring->header->slot[s];
+    uint32_t base = header + s*slot_size;
+
+        slot->frame       = -1;
+        slot->width       = width;
+        slot->height      = height;
+        slot->linesize[0] = luma;
+        slot->linesize[1] = chroma;
+        slot->linesize[2] = chroma;
+        slot->offset[0]   = base;
+        slot->offset[1]   = base + luma*height;
+        slot->offset[2]   = base + luma*height + chroma*(height/2);
+    }
+    // readers check the magic last, it says the rest is filled in
+    __atomic_store_n( &ring->header->magic, CANVAS_RING_MAGIC, __ATOMIC_RELEASE);
+
+    return ring;
+}
+
+/*
+ * Canvas n goes into slot n%slots, so a reader of the latest canvas has
+ * slots-1 more canvases of time before it is written over.
+ */
+void canvas_ring_publish( CanvasRing *ring, const uint8_t *const data[3], const int linesize[3], int64_t pts)
+{
+CanvasRingHeader *header = ring->header;
+int64_t frame = header->latest+1;
+CanvasRingSlot *slot = &header->slot[ frame%header->slots];
+uint8_t *base = (uint8_t *)header;
+uint32_t sequence = slot->sequence;
+
+    __atomic_store_n( &slot->sequence, sequence+1, __ATOMIC_RELAXED);
+    __atomic_thread_fence( __ATOMIC_RELEASE);
+
+    localPlaneCopy( base+slot->offset[0], slot->linesize[0], data[0], linesize[0], header->width, header->height);
+    localPlaneCopy( base+slot->offset[1], slot->linesize[1], data[1], linesize[1], header->width/2, header->height/2);
+    localPlaneCopy( base+slot->offset[2], slot->linesize[2], data[2], linesize[2], header->width/2, header->height/2);
+    slot->frame = frame;
+    slot->pts   = pts;
+
+    __atomic_store_n( &slot->sequence, sequence+2, __ATOMIC_RELEASE);
+    __atomic_store_n( &header->latest, frame, __ATOMIC_RELEASE);
+}
+
+void canvas_ring_destroy( CanvasRing *ring)
+{
+    if( !ring)
+        return;
+    __atomic_store_n( &ring->header->closed, 1, __ATOMIC_RELEASE);
+    munmap( ring->header, ring->size);
+    shm_unlink( ring->name);
+    free( ring);
+}
+
+CanvasRing *canvas_ring_open( const char *name)
+{
+CanvasRing *ring = calloc( 1, sizeof( CanvasRing));
+struct stat st;
+int fd;
+
+    if( !ring)
+        return NULL;
+    snprintf( ring->name, sizeof( ring->name), "%s", name);
+    fd = shm_open( ring->name, O_RDONLY, 0);
+    if( fd<0 || fstat( fd, &st) || st.st_size<(off_t)sizeof( CanvasRingHeader)) {
+        if( fd>=0)
+            close( fd);
+        free( ring);
+        return NULL;
+    }
+    ring->size   = st.st_size;
+    ring->header = mmap( NULL, ring->size, PROT_READ, MAP_SHARED, fd, 0);
+    close( fd);
+    if( ring->header==MAP_FAILED) {
+        free( ring);
+        return NULL;
+    }
+    if( __atomic_load_n( &ring->header->magic, __ATOMIC_ACQUIRE)!=CANVAS_RING_MAGIC || ring->header->version!=CANVAS_RING_VERSION ||
+        ring->header->slots<1 || ring->header->slots>CANVAS_RING_MAX_SLOTS || ring->size<(size_t)ring->header->slot[ ring->header->slots-1].offset[0]+ring->header->slot_size) {
+        munmap( ring->header, ring->size);
+        free( ring);
+        return NULL;
+    }
+
+    return ring;
+}
+
+int64_t canvas_ring_latest( CanvasRing *ring)
+{
+    return __atomic_load_n( &ring->header->latest, __ATOMIC_ACQUIRE);
+}
+
+int canvas_ring_closed( CanvasRing *ring)
+{
+    return __atomic_load_n( &ring->header->closed, __ATOMIC_ACQUIRE);
+}
+
+int canvas_ring_peek( CanvasRing *ring, int64_t frame, CanvasRingView *view)
+{
+const uint8_t *base = (const uint8_t *)ring->header;
+const CanvasRingSlot *slot;
+int p;
+
+    if( frame<0)
+        return 0;
+    view->slot     = frame%ring->header->slots;
+    slot           = &ring->header->slot[ view->slot];
+    view->sequence = __atomic_load_n( &slot->sequence, __ATOMIC_ACQUIRE);
+    if( view->sequence&1)
+        return 0;
+
+    view->frame  = slot->frame;
+    view->pts    = slot->pts;
+    view->width  = slot->width;
+    view->height = slot->height;
+    for( p=0; p<3; p++) {
+        view->data[p]     = base+slot->offset[p];
+        view->linesize[p] = slot->linesize[p];
+    }
+
+    return view->frame==frame && canvas_ring_valid( ring, view);
+}
+
+int canvas_ring_valid( CanvasRing *ring, const CanvasRingView *view)
+{
+    __atomic_thread_fence( __ATOMIC_ACQUIRE);
+
+    return __atomic_load_n( &ring->header->slot[ view->slot].sequence, __ATOMIC_RELAXED)==view->sequence;
+}
+
+int canvas_ring_read( CanvasRing *ring, int64_t frame, uint8_t *const dst[3], const int dst_linesize[3], CanvasRingView *view)
+{
+int tries;
+
+    for( tries=0; tries<CANVAS_RING_RETRIES; tries++) {
+        if( !canvas_ring_peek( ring, frame, view)) {
+            // being written, or already written over by a later canvas
+            if( canvas_ring_latest( ring)>=frame+ring->header->slots-1)
+                return 0;
+            continue;
+        }
+        localPlaneCopy( dst[0], dst_linesize[0], view->data[0], view->linesize[0], view->width, view->height);
+        localPlaneCopy( dst[1], dst_linesize[1], view->data[1], view->linesize[1], view->width/2, view->height/2);
+        localPlaneCopy( dst[2], dst_linesize[2], view->data[2], view->linesize[2], view->width/2, view->height/2);
+        if( canvas_ring_valid( ring, view))
+            return 1;
+    }
+
+    return 0;
+}
+
+void canvas_ring_close( CanvasRing *ring)
+{
+    if( !ring)
+        return;
+    munmap( ring->header, ring->size);
+    free( ring);
+}
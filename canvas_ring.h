@@ -0,0 +1,81 @@
+// Raw YUV420P canvases published through a POSIX shared memory ring
+#ifndef CANVAS_RING_H
+#define CANVAS_RING_H
+
+#include <stdint.h>
+#include <stddef.h>
+
+#define CANVAS_RING_MAGIC       0x43524e47      // "CRNG"
+#define CANVAS_RING_VERSION     1
+#define CANVAS_RING_SLOTS       4
+#define CANVAS_RING_MAX_SLOTS   64
+
+/*
+ * Every slot has its own seqlock: sequence is odd while the writer fills
+ * the slot and goes up by two for every canvas put in it. A reader takes
+ * the sequence before and after looking at the slot, the picture is whole
+ * if both are the same and even. Offsets are from the start of the mapping.
+ */
+typedef struct _CanvasRingSlot {
+    uint32_t sequence;
+    uint32_t reserved;
+    int64_t  frame;                 // number of the canvas, from 0
+    int64_t  pts;                   // in the time base of the header
+    int32_t  width;
+    int32_t  height;
+    int32_t  linesize[3];
+    uint32_t offset[3];
+} CanvasRingSlot;
+
+typedef struct _CanvasRingHeader {
+    uint32_t magic;
+    uint32_t version;
+    uint32_t slots;
+    uint32_t slot_size;
+    int32_t  width;
+    int32_t  height;
+    int32_t  time_base_num;
+    int32_t  time_base_den;
+    int64_t  latest;                // last canvas made whole, -1 before the first
+    uint32_t closed;                // the writer went away
+    uint32_t reserved;
+    CanvasRingSlot slot[];
+} CanvasRingHeader;
+
+typedef struct _CanvasRing {
+    CanvasRingHeader *header;
+    size_t            size;
+    char              name[256];
+} CanvasRing;
+
+// A canvas in place in the ring, only good while canvas_ring_valid() says so
+typedef struct _CanvasRingView {
+    int64_t        frame;
+    int64_t        pts;
+    int            width;
+    int            height;
+    const uint8_t *data[3];
+    int            linesize[3];
+    uint32_t       sequence;
+    int            slot;
+} CanvasRingView;
+
+// Writer, name as for shm_open() ("/mosaic")
+CanvasRing *canvas_ring_create( const char *name, int width, int height, int slots, int time_base_num, int time_base_den);
+void        canvas_ring_publish( CanvasRing *ring, const uint8_t *const data[3], const int linesize[3], int64_t pts);
+void        canvas_ring_destroy( CanvasRing *ring);
+
+// Reader
+CanvasRing *canvas_ring_open( const char *name);
+int64_t     canvas_ring_latest( CanvasRing *ring);
+int         canvas_ring_closed( CanvasRing *ring);
+
+// Zero copy: 1 with view pointing at the canvas if it is in the ring and not being written
+int         canvas_ring_peek( CanvasRing *ring, int64_t frame, CanvasRingView *view);
+// 1 if the canvas of view was not overwritten since canvas_ring_peek(), what was read from it is good
+int         canvas_ring_valid( CanvasRing *ring, const CanvasRingView *view);
+// Copies the canvas out, 0 if it is no longer in the ring
+int         canvas_ring_read( CanvasRing *ring, int64_t frame, uint8_t *const dst[3], const int dst_linesize[3], CanvasRingView *view);
+void        canvas_ring_close( CanvasRing *ring);
+
+#endif
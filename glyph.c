@@ -0,0 +1,232 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "font.h"
+#include "simd.h"
+#include "glyph.h"
+
+#define GLYPH_SPACING   2           // pixels between characters at the font size
+
+typedef struct _Glyph {
+    const uint8_t *mask;
+    int            w;
+    int            advance;
+} Glyph;
+
+typedef struct _GlyphSize {
+    const char *name;
+    int         num;                // glyphs are num/den of the font size
+    int         den;
+    int         height;
+    int         glyphs;
+    Glyph      *glyph;
+    uint8_t    *buffer;
+} GlyphSize;
+
+/*
+ * Anti-aliased sizes are drawn num times bigger and box filtered down by
+ * den, so every mask pixel is the coverage of den*den sub pixels.
+ */
+static GlyphSize atlas[GLYPH_SIZES] = {
+    { "small",  3, 4 },
+    { "normal", 1, 1 },
+    { "large",  3, 2 },
+    { "double", 2, 1 },
+};
+
+static int localFontRows( void)
+{
+    // '!' is one byte wide, so the distance to the next glyph is its height
+    return anonymousPro_9ptDescriptors[1].offset - anonymousPro_9ptDescriptors[0].offset;
+}
+
+static const Glyph *localGlyph( const GlyphSize *size, int c)
+{
+    if( c<anonymousPro_9ptFontInfo.start_character || c>anonymousPro_9ptFontInfo.end_character)
+        return NULL;
+
+    return &size->glyph[ c-anonymousPro_9ptFontInfo.start_character];
+}
+
+static int localAdvance( const GlyphSize *size, int c)
+{
+const Glyph *glyph = localGlyph( size, c);
+
+    if( glyph)
+        return glyph->advance;
+
+    return ((anonymousPro_9ptFontInfo.space_width+GLYPH_SPACING)*size->num + size->den/2)/size->den;
+}
+
+static int localBuildSize( GlyphSize *size)
+{
+int rows   = localFontRows();
+int glyphs = anonymousPro_9ptFontInfo.end_character - anonymousPro_9ptFontInfo.start_character + 1;
+int uh     = ((rows*size->num + size->den-1)/size->den)*size->den;
+int total  = 0;
+uint8_t *up, *out;
+int g;
+
+    size->height = uh/size->den;
+    size->glyphs = glyphs;
+    size->glyph  = calloc( glyphs, sizeof( Glyph));
+    if( !size->glyph)
+        return 0;
+
+    for( g=0; g<glyphs; g++) {
+    int w = anonymousPro_9ptDescriptors[g].width;
+
+        size->glyph[g].w       = (w*size->num + size->den-1)/size->den;
+        size->glyph[g].advance = ((w+GLYPH_SPACING)*size->num + size->den/2)/size->den;
+        total += size->glyph[g].w*size->height;
+    }
+
+    size->buffer = malloc( total+1);
+    // the widest glyph drawn num times bigger, padded to whole boxes
+    up = malloc( (8*size->num + size->den)*uh);
+    if( !size->buffer || !up) {
+        free( up);
+        return 0;
+    }
+
+    out = size->buffer;
+    for( g=0; g<glyphs; g++) {
+    const uint8_t *bits = anonymousPro_9ptBitmaps + anonymousPro_9ptDescriptors[g].offset;
+    int fw    = anonymousPro_9ptDescriptors[g].width;
+    int bytes = (fw+7)/8;
+    int uw    = size->glyph[g].w*size->den;
+    int x, y;
+
+        for( y=0; y<uh; y++) {
+        const uint8_t *row = bits + (y/size->num)*bytes;
+
+            for( x=0; x<uw; x++) {
+            int fx = x/size->num;
+
+                up[ y*uw+x] = (fx<fw && y/size->num<rows && (row[fx>>3] & (0x80>>(fx&7)))) ? 255 : 0;
+            }
+        }
+        if( uw) {
+            simd.box_downscale( out, size->glyph[g].w, up, uw, size->glyph[g].w, size->height, size->den, size->den);
+        }
+        size->glyph[g].mask = out;
+        out += size->glyph[g].w*size->height;
+    }
+    free( up);
+
+    return 1;
+}
+
+/* Must run after simd_init(), the anti-aliased sizes use the box filter */
+int glyph_atlas_init( void)
+{
+int s;
+
+    for( s=0; s<GLYPH_SIZES; s++) {
+        if( !atlas[s].glyph && !localBuildSize( &atlas[s])) {
+            fprintf( stderr, "Could not build the %s glyphs\n", atlas[s].name);
+            glyph_atlas_free();
+            return 0;
+        }
+    }
+
+    return 1;
+}
+
+void glyph_atlas_free( void)
+{
+int s;
+
+    for( s=0; s<GLYPH_SIZES; s++) {
+        free( atlas[s].glyph);
+        free( atlas[s].buffer);
+        atlas[s].glyph  = NULL;
+        atlas[s].buffer = NULL;
+    }
+}
+
+int glyph_size_from_name( const char *name)
+{
+int s;
+
+    for( s=0; name && s<GLYPH_SIZES; s++) {
+        if( !strcmp( name, atlas[s].name))
+            return s;
+    }
+
+    return GLYPH_SIZE_NORMAL;
+}
+
+int glyph_height( int size)
+{
+    return atlas[size].height;
+}
+
+int glyph_label_set( GlyphLabel *label, const char *text, int size)
+{
+const GlyphSize *atlasSize;
+const char *s;
+int w, h, x, need;
+
+    if( size<0 || size>=GLYPH_SIZES)
+        size = GLYPH_SIZE_NORMAL;
+    if( !text)
+        text = "";
+
+    if( label->size==size && (label->w || !text[0]) && !strncmp( label->text, text, GLYPH_LABEL_TEXT-1))
+        return 0;
+
+    atlasSize = &atlas[size];
+    strncpy( label->text, text, GLYPH_LABEL_TEXT-1);
+    label->text[ GLYPH_LABEL_TEXT-1] = 0;
+    label->size = size;
+    label->w    = 0;
+    label->h    = 0;
+    if( !atlasSize->glyph || !label->text[0])
+        return 1;
+
+    w = 0;
+    for( s=label->text; *s; s++) {
+        w += localAdvance( atlasSize, (unsigned char)*s);
+    }
+    w = (w+1)&~1;
+    h = (atlasSize->height+1)&~1;
+
+    need = (w*h) + ((w/2)*(h/2));
+    if( need>label->allocated) {
+    uint8_t *buffer = realloc( label->mask[0], need);
+
+        if( !buffer)
+            return 1;
+        label->mask[0]   = buffer;
+        label->allocated = need;
+    }
+    label->mask[1]     = label->mask[0] + (w*h);
+    label->linesize[0] = w;
+    label->linesize[1] = w/2;
+
+    simd.fill( label->mask[0], w, w, h, 0);
+    x = 0;
+    for( s=label->text; *s; s++) {
+    const Glyph *glyph = localGlyph( atlasSize, (unsigned char)*s);
+
+        if( glyph && glyph->w) {
+            simd.blit( label->mask[0]+x, w, glyph->mask, glyph->w, glyph->w, atlasSize->height);
+        }
+        x += localAdvance( atlasSize, (unsigned char)*s);
+    }
+    simd.box_downscale( label->mask[1], w/2, label->mask[0], w, w/2, h/2, 2, 2);
+
+    label->w = w;
+    label->h = h;
+    label->renders++;
+
+    return 1;
+}
+
+void glyph_label_free( GlyphLabel *label)
+{
+    free( label->mask[0]);
+    memset( label, 0, sizeof( GlyphLabel));
+}
@@ -0,0 +1,42 @@
+// Glyph atlas for the built in font and text labels cached from it
+#ifndef GLYPH_H
+#define GLYPH_H
+
+#include <stdint.h>
+
+enum {
+    GLYPH_SIZE_SMALL,           // 3/4 of the font, anti-aliased
+    GLYPH_SIZE_NORMAL,          // the font as drawn
+    GLYPH_SIZE_LARGE,           // 3/2, anti-aliased
+    GLYPH_SIZE_DOUBLE,          // 2x, pixel doubled
+    GLYPH_SIZES
+};
+
+#define GLYPH_LABEL_TEXT        64
+
+/*
+ * A string rasterised once into coverage masks, at luma resolution and at
+ * 4:2:0 chroma resolution. Both sizes are even so it can be blended at any
+ * even position of a YUV420P picture.
+ */
+typedef struct _GlyphLabel {
+    char     text[GLYPH_LABEL_TEXT];
+    int      size;
+    int      w;
+    int      h;
+    uint8_t *mask[2];
+    int      linesize[2];
+    int      allocated;
+    int      renders;           // times the text had to be rasterised
+} GlyphLabel;
+
+int  glyph_atlas_init( void);
+void glyph_atlas_free( void);
+int  glyph_size_from_name( const char *name);
+int  glyph_height( int size);
+
+// Returns 1 when the text or size changed and the masks were redrawn
+int  glyph_label_set( GlyphLabel *label, const char *text, int size);
+void glyph_label_free( GlyphLabel *label);
+
+#endif
@@ -0,0 +1,1127 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#include "simd.h"
+
+#if defined( __x86_64__) || defined( __i386__)
+#define HAVE_X86        1
+#include <immintrin.h>
+#define TARGET_SSE2     __attribute__((target("sse2")))
+#define TARGET_AVX2     __attribute__((target("avx2")))
+#else
+#define HAVE_X86        0
+#endif
+
+#define BOX_BLOCK       1024        // source columns summed per pass, keeps the row sums on the stack
+
+SimdKernels simd;
+
+static const char *levelNames[] = { "C", "SSE2", "AVX2" };
+static int detectedLevel;
+
+typedef void (*accumulateRow)( uint16_t *acc, const uint8_t *src, int count);
+
+/*
+ * (sum + n/2) / n done as a multiply by ceil(2^32/n). The error term stays
+ * below one for sum < 256*n and n <= 4096 (64x64), which covers every box
+ * the downscaler accepts, so this is exactly the division the C version does.
+ */
+static inline uint64_t localReciprocal( int n)
+{
+    return ((((uint64_t)1<<32) + n - 1) / n);
+}
+
+static void localAccumulateC( uint16_t *acc, const uint8_t *src, int count)
+{
+int x;
+
+    for( x=0; x<count; x++) {
+        acc[x] += src[x];
+    }
+}
+
+#if HAVE_X86
+TARGET_SSE2 static void localAccumulateSSE2( uint16_t *acc, const uint8_t *src, int count)
+{
+__m128i zero = _mm_setzero_si128();
+int x;
+
+    for( x=0; x+16<=count; x+=16) {
+    __m128i p  = _mm_loadu_si128( (const __m128i *)(src+x));
+    __m128i lo = _mm_loadu_si128( (const __m128i *)(acc+x));
+    __m128i hi = _mm_loadu_si128( (const __m128i *)(acc+x+8));
+
+        _mm_storeu_si128( (__m128i *)(acc+x),   _mm_add_epi16( lo, _mm_unpacklo_epi8( p, zero)));
+        _mm_storeu_si128( (__m128i *)(acc+x+8), _mm_add_epi16( hi, _mm_unpackhi_epi8( p, zero)));
+    }
+    for( ; x<count; x++) {
+        acc[x] += src[x];
+    }
+}
+
+TARGET_AVX2 static void localAccumulateAVX2( uint16_t *acc, const uint8_t *src, int count)
+{
+int x;
+
+    for( x=0; x+32<=count; x+=32) {
+    __m256i lo = _mm256_cvtepu8_epi16( _mm_loadu_si128( (const __m128i *)(src+x)));
+    __m256i hi = _mm256_cvtepu8_epi16( _mm_loadu_si128( (const __m128i *)(src+x+16)));
+
+        _mm256_storeu_si256( (__m256i *)(acc+x),    _mm256_add_epi16( lo, _mm256_loadu_si256( (const __m256i *)(acc+x))));
+        _mm256_storeu_si256( (__m256i *)(acc+x+16), _mm256_add_epi16( hi, _mm256_loadu_si256( (const __m256i *)(acc+x+16))));
+    }
+    for( ; x<count; x++) {
+        acc[x] += src[x];
+    }
+}
+#endif
+
+/*
+ * Shared driver: the SIMD variants only differ in how the fy source rows are
+ * summed into 16 bit column totals, which is where nearly all the loads are.
+ */
+static void localBoxDownscale( accumulateRow addRow, uint8_t *dst, int dst_linesize, const uint8_t *src, int src_linesize,
+                               int dst_w, int dst_h, int fx, int fy)
+{
+uint16_t acc[BOX_BLOCK];
+int n = fx*fy;
+uint64_t m = localReciprocal( n);
+int block = (BOX_BLOCK/fx)*fx;
+int y;
+
+    for( y=0; y<dst_h; y++) {
+    const uint8_t *row = src + (y*fy*src_linesize);
+    int x0;
+
+        for( x0=0; x0<dst_w*fx; x0+=block) {
+        int count = dst_w*fx - x0;
+        const uint16_t *a = acc;
+        uint8_t *d = dst + x0/fx;
+        int i, x;
+
+            if( count>block)
+                count = block;
+            memset( acc, 0, count*sizeof( uint16_t));
+            for( i=0; i<fy; i++) {
+                addRow( acc, row + (i*src_linesize) + x0, count);
+            }
+            for( x=0; x<count/fx; x++) {
+            uint32_t s = n/2;
+
+                for( i=0; i<fx; i++) {
+                    s += *a++;
+                }
+                d[x] = (s * m)>>32;
+            }
+        }
+        dst += dst_linesize;
+    }
+}
+
+void simd_c_box_downscale( uint8_t *dst, int dst_linesize, const uint8_t *src, int src_linesize,
+                           int dst_w, int dst_h, int fx, int fy)
+{
+int n = fx*fy;
+int x, y, i, j;
+
+    for( y=0; y<dst_h; y++) {
+        for( x=0; x<dst_w; x++) {
+        const uint8_t *s = src + (y*fy*src_linesize) + (x*fx);
+        int sum = 0;
+
+            for( j=0; j<fy; j++) {
+                for( i=0; i<fx; i++) {
+                    sum += s[i];
+                }
+                s += src_linesize;
+            }
+            dst[x] = (sum + n/2)/n;
+        }
+        dst += dst_linesize;
+    }
+}
+
+#if HAVE_X86
+static void localBoxDownscaleSSE2( uint8_t *dst, int dst_linesize, const uint8_t *src, int src_linesize,
+                                   int dst_w, int dst_h, int fx, int fy)
+{
+    localBoxDownscale( localAccumulateSSE2, dst, dst_linesize, src, src_linesize, dst_w, dst_h, fx, fy);
+}
+
+static void localBoxDownscaleAVX2( uint8_t *dst, int dst_linesize, const uint8_t *src, int src_linesize,
+                                   int dst_w, int dst_h, int fx, int fy)
+{
+    localBoxDownscale( localAccumulateAVX2, dst, dst_linesize, src, src_linesize, dst_w, dst_h, fx, fy);
+}
+#endif
+
+static void localBoxDownscaleC( uint8_t *dst, int dst_linesize, const uint8_t *src, int src_linesize,
+                                int dst_w, int dst_h, int fx, int fy)
+{
+    localBoxDownscale( localAccumulateC, dst, dst_linesize, src, src_linesize, dst_w, dst_h, fx, fy);
+}
+
+void simd_c_fill( uint8_t *dst, int linesize, int w, int h, int value)
+{
+int y;
+
+    for( y=0; y<h; y++) {
+        memset( dst, value, w);
+        dst += linesize;
+    }
+}
+
+void simd_c_blit( uint8_t *dst, int dst_linesize, const uint8_t *src, int src_linesize, int w, int h)
+{
+int y;
+
+    for( y=0; y<h; y++) {
+        memcpy( dst, src, w);
+        dst += dst_linesize;
+        src += src_linesize;
+    }
+}
+
+void simd_c_border( uint8_t *dst, int linesize, int w, int h, int thickness, int value)
+{
+int x, y;
+
+    for( y=0; y<h; y++) {
+        for( x=0; x<w; x++) {
+            if( x<thickness || x>=w-thickness || y<thickness || y>=h-thickness)
+                dst[x] = value;
+        }
+        dst += linesize;
+    }
+}
+
+void simd_c_pattern( uint8_t *dst, int linesize, int x0, int y0, int w, int h, int base, int kx, int ky)
+{
+int x, y;
+
+    for( y=0; y<h; y++) {
+        for( x=0; x<w; x++) {
+            dst[x] = base + kx*(x0+x) + ky*(y0+y);
+        }
+        dst += linesize;
+    }
+}
+
+/*
+ * (value*a + dst*(255-a)) / 255 rounded, the division done as
+ * (t + (t>>8))>>8 with t biased by 128 so the SIMD code can use the
+ * same 16 bit arithmetic.
+ */
+void simd_c_mask_blend( uint8_t *dst, int dst_linesize, const uint8_t *mask, int mask_linesize, int w, int h, int value)
+{
+int x, y;
+
+    value &= 0xff;
+    for( y=0; y<h; y++) {
+        for( x=0; x<w; x++) {
+        int a = mask[x];
+        int t = (value*a) + (dst[x]*(255-a)) + 128;
+
+            dst[x] = (t + (t>>8))>>8;
+        }
+        dst  += dst_linesize;
+        mask += mask_linesize;
+    }
+}
+
+/*
+ * Same rounded division as mask_blend. Pixels with no alpha are left alone
+ * and the sum saturates, in case src was not premultiplied.
+ */
+void simd_c_alpha_blend( uint8_t *dst, int dst_linesize, const uint8_t *src, int src_linesize,
+                         const uint8_t *alpha, int alpha_linesize, int w, int h)
+{
+int x, y;
+
+    for( y=0; y<h; y++) {
+        for( x=0; x<w; x++) {
+        int t = (dst[x]*(255-alpha[x])) + 128;
+        int v = src[x] + ((t + (t>>8))>>8);
+
+            if( alpha[x])
+                dst[x] = v>255 ? 255 : v;
+        }
+        dst   += dst_linesize;
+        src   += src_linesize;
+        alpha += alpha_linesize;
+    }
+}
+
+/*
+ * Float sums depend on their order, so the squares go into eight running
+ * sums, sample i into sum i&7, which is what one AVX or two SSE registers
+ * hold. The eight are added up the same way at every level.
+ */
+#define AUDIO_LANES     8
+
+static float localLaneSum( const float *lane)
+{
+    return ((lane[0]+lane[4]) + (lane[1]+lane[5])) + ((lane[2]+lane[6]) + (lane[3]+lane[7]));
+}
+
+static void localAudioTail( const float *src, int from, int count, float *lane, float *peak)
+{
+int i;
+
+    for( i=from; i<count; i++) {
+    float a = src[i]<0 ? -src[i] : src[i];
+
+        lane[i&(AUDIO_LANES-1)] += src[i]*src[i];
+        if( a>*peak)
+            *peak = a;
+    }
+}
+
+void simd_c_audio_level( const float *src, int count, float *sum_squares, float *peak)
+{
+float lane[AUDIO_LANES] = { 0 };
+
+    localAudioTail( src, 0, count, lane, peak);
+    *sum_squares += localLaneSum( lane);
+}
+
+/*
+ * (above + 2*row + below + 2)>>2, the first and last rows use themselves
+ * for the missing neighbour. Every SIMD level works a row at a time and
+ * finishes the row with the level below.
+ */
+static void localLineBlendRowC( uint8_t *dst, const uint8_t *above, const uint8_t *row, const uint8_t *below, int from, int w)
+{
+int x;
+
+    for( x=from; x<w; x++) {
+        dst[x] = (above[x] + (2*row[x]) + below[x] + 2)>>2;
+    }
+}
+
+static void localLineBlend( void (*blendRow)( uint8_t *, const uint8_t *, const uint8_t *, const uint8_t *, int, int),
+                            uint8_t *dst, int dst_linesize, const uint8_t *src, int src_linesize, int w, int h)
+{
+int y;
+
+    for( y=0; y<h; y++) {
+    const uint8_t *row = src + (y*src_linesize);
+
+        blendRow( dst, y ? row-src_linesize : row, row, y<h-1 ? row+src_linesize : row, 0, w);
+        dst += dst_linesize;
+    }
+}
+
+void simd_c_line_blend( uint8_t *dst, int dst_linesize, const uint8_t *src, int src_linesize, int w, int h)
+{
+    localLineBlend( localLineBlendRowC, dst, dst_linesize, src, src_linesize, w, h);
+}
+
+/* SSE2 has no gather, so the C loop is used at that level as well */
+void simd_c_tone_lut( uint8_t *dst, int dst_linesize, const uint16_t *src, int src_linesize, int w, int h, const uint8_t *lut)
+{
+int x, y;
+
+    for( y=0; y<h; y++) {
+        for( x=0; x<w; x++) {
+            dst[x] = lut[ src[x]>>6];
+        }
+        dst += dst_linesize;
+        src  = (const uint16_t *)((const uint8_t *)src + src_linesize);
+    }
+}
+
+/* A border is four fills, so every level gets it from its own fill */
+static void localBorder( void (*fill)( uint8_t *, int, int, int, int), uint8_t *dst, int linesize, int w, int h, int t, int value)
+{
+    if( t<=0 || w<=0 || h<=0)
+        return;
+
+    if( 2*t>=w || 2*t>=h) {
+        fill( dst, linesize, w, h, value);
+        return;
+    }
+    fill( dst,                          linesize, w, t,     value);
+    fill( dst + ((h-t)*linesize),       linesize, w, t,     value);
+    fill( dst + (t*linesize),           linesize, t, h-2*t, value);
+    fill( dst + (t*linesize) + w - t,   linesize, t, h-2*t, value);
+}
+
+static void localBorderC( uint8_t *dst, int linesize, int w, int h, int thickness, int value)
+{
+    localBorder( simd_c_fill, dst, linesize, w, h, thickness, value);
+}
+
+#if HAVE_X86
+/*
+ * Rows of 16 bytes or more finish with one store that overlaps the
+ * previous one instead of a byte loop, shorter rows go to the C code.
+ */
+TARGET_SSE2 static void localFillSSE2( uint8_t *dst, int linesize, int w, int h, int value)
+{
+__m128i v = _mm_set1_epi8( (char)value);
+int x, y;
+
+    if( w<16) {
+        simd_c_fill( dst, linesize, w, h, value);
+        return;
+    }
+    for( y=0; y<h; y++) {
+        for( x=0; x+16<w; x+=16) {
+            _mm_storeu_si128( (__m128i *)(dst+x), v);
+        }
+        _mm_storeu_si128( (__m128i *)(dst+w-16), v);
+        dst += linesize;
+    }
+}
+
+TARGET_SSE2 static void localBlitSSE2( uint8_t *dst, int dst_linesize, const uint8_t *src, int src_linesize, int w, int h)
+{
+int x, y;
+
+    if( w<16) {
+        simd_c_blit( dst, dst_linesize, src, src_linesize, w, h);
+        return;
+    }
+    for( y=0; y<h; y++) {
+        for( x=0; x+16<w; x+=16) {
+            _mm_storeu_si128( (__m128i *)(dst+x), _mm_loadu_si128( (const __m128i *)(src+x)));
+        }
+        _mm_storeu_si128( (__m128i *)(dst+w-16), _mm_loadu_si128( (const __m128i *)(src+w-16)));
+        dst += dst_linesize;
+        src += src_linesize;
+    }
+}
+
+static void localBorderSSE2( uint8_t *dst, int linesize, int w, int h, int thickness, int value)
+{
+    localBorder( localFillSSE2, dst, linesize, w, h, thickness, value);
+}
+
+TARGET_SSE2 static void localPatternSSE2( uint8_t *dst, int linesize, int x0, int y0, int w, int h, int base, int kx, int ky)
+{
+uint8_t r[16];
+__m128i ramp, step = _mm_set1_epi8( (char)(kx*16));
+int x, y;
+
+    for( x=0; x<16; x++) {
+        r[x] = kx*x;
+    }
+    ramp = _mm_loadu_si128( (const __m128i *)r);
+    for( y=0; y<h; y++) {
+    int v0 = base + kx*x0 + ky*(y0+y);
+    __m128i v = _mm_add_epi8( _mm_set1_epi8( (char)v0), ramp);
+
+        for( x=0; x+16<=w; x+=16) {
+            _mm_storeu_si128( (__m128i *)(dst+x), v);
+            v = _mm_add_epi8( v, step);
+        }
+        for( ; x<w; x++) {
+            dst[x] = v0 + kx*x;
+        }
+        dst += linesize;
+    }
+}
+
+TARGET_SSE2 static void localMaskBlendSSE2( uint8_t *dst, int dst_linesize, const uint8_t *mask, int mask_linesize, int w, int h, int value)
+{
+__m128i zero = _mm_setzero_si128();
+__m128i v    = _mm_set1_epi16( value&0xff);
+__m128i full = _mm_set1_epi16( 255);
+__m128i bias = _mm_set1_epi16( 128);
+int x, y;
+
+    for( y=0; y<h; y++) {
+        for( x=0; x+16<=w; x+=16) {
+        __m128i m = _mm_loadu_si128( (const __m128i *)(mask+x));
+        __m128i d, lo, hi;
+
+            if( _mm_movemask_epi8( _mm_cmpeq_epi8( m, zero))==0xffff)
+                continue;
+            d  = _mm_loadu_si128( (const __m128i *)(dst+x));
+            lo = _mm_add_epi16( _mm_add_epi16( _mm_mullo_epi16( v, _mm_unpacklo_epi8( m, zero)),
+                                               _mm_mullo_epi16( _mm_unpacklo_epi8( d, zero), _mm_sub_epi16( full, _mm_unpacklo_epi8( m, zero)))), bias);
+            hi = _mm_add_epi16( _mm_add_epi16( _mm_mullo_epi16( v, _mm_unpackhi_epi8( m, zero)),
+                                               _mm_mullo_epi16( _mm_unpackhi_epi8( d, zero), _mm_sub_epi16( full, _mm_unpackhi_epi8( m, zero)))), bias);
+            lo = _mm_srli_epi16( _mm_add_epi16( lo, _mm_srli_epi16( lo, 8)), 8);
+            hi = _mm_srli_epi16( _mm_add_epi16( hi, _mm_srli_epi16( hi, 8)), 8);
+            _mm_storeu_si128( (__m128i *)(dst+x), _mm_packus_epi16( lo, hi));
+        }
+        if( x<w) {
+            simd_c_mask_blend( dst+x, dst_linesize, mask+x, mask_linesize, w-x, 1, value);
+        }
+        dst  += dst_linesize;
+        mask += mask_linesize;
+    }
+}
+
+TARGET_SSE2 static void localAlphaBlendSSE2( uint8_t *dst, int dst_linesize, const uint8_t *src, int src_linesize,
+                                             const uint8_t *alpha, int alpha_linesize, int w, int h)
+{
+__m128i zero = _mm_setzero_si128();
+__m128i full = _mm_set1_epi16( 255);
+__m128i bias = _mm_set1_epi16( 128);
+int x, y;
+
+    for( y=0; y<h; y++) {
+        for( x=0; x+16<=w; x+=16) {
+        __m128i a = _mm_loadu_si128( (const __m128i *)(alpha+x));
+        __m128i clear = _mm_cmpeq_epi8( a, zero);
+        __m128i d, lo, hi, v;
+
+            if( _mm_movemask_epi8( clear)==0xffff)
+                continue;
+            d  = _mm_loadu_si128( (const __m128i *)(dst+x));
+            lo = _mm_add_epi16( _mm_mullo_epi16( _mm_unpacklo_epi8( d, zero), _mm_sub_epi16( full, _mm_unpacklo_epi8( a, zero))), bias);
+            hi = _mm_add_epi16( _mm_mullo_epi16( _mm_unpackhi_epi8( d, zero), _mm_sub_epi16( full, _mm_unpackhi_epi8( a, zero))), bias);
+            lo = _mm_srli_epi16( _mm_add_epi16( lo, _mm_srli_epi16( lo, 8)), 8);
+            hi = _mm_srli_epi16( _mm_add_epi16( hi, _mm_srli_epi16( hi, 8)), 8);
+            v  = _mm_adds_epu8( _mm_packus_epi16( lo, hi), _mm_loadu_si128( (const __m128i *)(src+x)));
+            _mm_storeu_si128( (__m128i *)(dst+x), _mm_or_si128( _mm_and_si128( clear, d), _mm_andnot_si128( clear, v)));
+        }
+        if( x<w) {
+            simd_c_alpha_blend( dst+x, dst_linesize, src+x, src_linesize, alpha+x, alpha_linesize, w-x, 1);
+        }
+        dst   += dst_linesize;
+        src   += src_linesize;
+        alpha += alpha_linesize;
+    }
+}
+
+TARGET_SSE2 static void localLineBlendRowSSE2( uint8_t *dst, const uint8_t *above, const uint8_t *row, const uint8_t *below, int from, int w)
+{
+__m128i zero = _mm_setzero_si128();
+__m128i two  = _mm_set1_epi16( 2);
+int x;
+
+    for( x=from; x+16<=w; x+=16) {
+    __m128i a = _mm_loadu_si128( (const __m128i *)(above+x));
+    __m128i r = _mm_loadu_si128( (const __m128i *)(row+x));
+    __m128i b = _mm_loadu_si128( (const __m128i *)(below+x));
+    __m128i lo, hi;
+
+        lo = _mm_add_epi16( _mm_add_epi16( _mm_unpacklo_epi8( a, zero), _mm_unpacklo_epi8( b, zero)),
+                            _mm_add_epi16( _mm_slli_epi16( _mm_unpacklo_epi8( r, zero), 1), two));
+        hi = _mm_add_epi16( _mm_add_epi16( _mm_unpackhi_epi8( a, zero), _mm_unpackhi_epi8( b, zero)),
+                            _mm_add_epi16( _mm_slli_epi16( _mm_unpackhi_epi8( r, zero), 1), two));
+        _mm_storeu_si128( (__m128i *)(dst+x), _mm_packus_epi16( _mm_srli_epi16( lo, 2), _mm_srli_epi16( hi, 2)));
+    }
+    localLineBlendRowC( dst, above, row, below, x, w);
+}
+
+TARGET_SSE2 static void localLineBlendSSE2( uint8_t *dst, int dst_linesize, const uint8_t *src, int src_linesize, int w, int h)
+{
+    localLineBlend( localLineBlendRowSSE2, dst, dst_linesize, src, src_linesize, w, h);
+}
+
+TARGET_AVX2 static void localAlphaBlendAVX2( uint8_t *dst, int dst_linesize, const uint8_t *src, int src_linesize,
+                                             const uint8_t *alpha, int alpha_linesize, int w, int h)
+{
+__m256i zero = _mm256_setzero_si256();
+__m256i full = _mm256_set1_epi16( 255);
+__m256i bias = _mm256_set1_epi16( 128);
+int x, y;
+
+    for( y=0; y<h; y++) {
+        for( x=0; x+32<=w; x+=32) {
+        __m256i a = _mm256_loadu_si256( (const __m256i *)(alpha+x));
+        __m256i clear = _mm256_cmpeq_epi8( a, zero);
+        __m256i d, lo, hi, v;
+
+            if( _mm256_movemask_epi8( clear)==-1)
+                continue;
+            d  = _mm256_loadu_si256( (const __m256i *)(dst+x));
+            lo = _mm256_add_epi16( _mm256_mullo_epi16( _mm256_unpacklo_epi8( d, zero), _mm256_sub_epi16( full, _mm256_unpacklo_epi8( a, zero))), bias);
+            hi = _mm256_add_epi16( _mm256_mullo_epi16( _mm256_unpackhi_epi8( d, zero), _mm256_sub_epi16( full, _mm256_unpackhi_epi8( a, zero))), bias);
+            lo = _mm256_srli_epi16( _mm256_add_epi16( lo, _mm256_srli_epi16( lo, 8)), 8);
+            hi = _mm256_srli_epi16( _mm256_add_epi16( hi, _mm256_srli_epi16( hi, 8)), 8);
+            v  = _mm256_adds_epu8( _mm256_packus_epi16( lo, hi), _mm256_loadu_si256( (const __m256i *)(src+x)));
+            _mm256_storeu_si256( (__m256i *)(dst+x), _mm256_blendv_epi8( v, d, clear));
+        }
+        if( x<w) {
+            localAlphaBlendSSE2( dst+x, dst_linesize, src+x, src_linesize, alpha+x, alpha_linesize, w-x, 1);
+        }
+        dst   += dst_linesize;
+        src   += src_linesize;
+        alpha += alpha_linesize;
+    }
+}
+
+TARGET_SSE2 static void localAudioLevelSSE2( const float *src, int count, float *sum_squares, float *peak)
+{
+__m128 lo   = _mm_setzero_ps();
+__m128 hi   = _mm_setzero_ps();
+__m128 top  = _mm_set1_ps( *peak);
+__m128 mask = _mm_castsi128_ps( _mm_set1_epi32( 0x7fffffff));
+float lane[AUDIO_LANES], high[4];
+int i;
+
+    for( i=0; i+AUDIO_LANES<=count; i+=AUDIO_LANES) {
+    __m128 a = _mm_loadu_ps( src+i);
+    __m128 b = _mm_loadu_ps( src+i+4);
+
+        lo  = _mm_add_ps( lo, _mm_mul_ps( a, a));
+        hi  = _mm_add_ps( hi, _mm_mul_ps( b, b));
+        top = _mm_max_ps( top, _mm_max_ps( _mm_and_ps( a, mask), _mm_and_ps( b, mask)));
+    }
+    _mm_storeu_ps( lane,   lo);
+    _mm_storeu_ps( lane+4, hi);
+    _mm_storeu_ps( high,   top);
+    for( *peak=high[0], i=1; i<4; i++) {
+        if( high[i]>*peak)
+            *peak = high[i];
+    }
+    localAudioTail( src, count&~(AUDIO_LANES-1), count, lane, peak);
+    *sum_squares += localLaneSum( lane);
+}
+
+TARGET_AVX2 static void localAudioLevelAVX2( const float *src, int count, float *sum_squares, float *peak)
+{
+__m256 sum  = _mm256_setzero_ps();
+__m256 top  = _mm256_set1_ps( *peak);
+__m256 mask = _mm256_castsi256_ps( _mm256_set1_epi32( 0x7fffffff));
+float lane[AUDIO_LANES], high[AUDIO_LANES];
+int i;
+
+    for( i=0; i+AUDIO_LANES<=count; i+=AUDIO_LANES) {
+    __m256 a = _mm256_loadu_ps( src+i);
+
+        sum = _mm256_add_ps( sum, _mm256_mul_ps( a, a));
+        top = _mm256_max_ps( top, _mm256_and_ps( a, mask));
+    }
+    _mm256_storeu_ps( lane, sum);
+    _mm256_storeu_ps( high, top);
+    for( *peak=high[0], i=1; i<AUDIO_LANES; i++) {
+        if( high[i]>*peak)
+            *peak = high[i];
+    }
+    localAudioTail( src, count&~(AUDIO_LANES-1), count, lane, peak);
+    *sum_squares += localLaneSum( lane);
+}
+
+TARGET_AVX2 static void localMaskBlendAVX2( uint8_t *dst, int dst_linesize, const uint8_t *mask, int mask_linesize, int w, int h, int value)
+{
+__m256i zero = _mm256_setzero_si256();
+__m256i v    = _mm256_set1_epi16( value&0xff);
+__m256i full = _mm256_set1_epi16( 255);
+__m256i bias = _mm256_set1_epi16( 128);
+int x, y;
+
+    for( y=0; y<h; y++) {
+        for( x=0; x+32<=w; x+=32) {
+        __m256i m = _mm256_loadu_si256( (const __m256i *)(mask+x));
+        __m256i d, lo, hi;
+
+            if( _mm256_movemask_epi8( _mm256_cmpeq_epi8( m, zero))==-1)
+                continue;
+            // unpack and pack both work per 128 bit lane, so the order comes back as it was
+            d  = _mm256_loadu_si256( (const __m256i *)(dst+x));
+            lo = _mm256_add_epi16( _mm256_add_epi16( _mm256_mullo_epi16( v, _mm256_unpacklo_epi8( m, zero)),
+                                                     _mm256_mullo_epi16( _mm256_unpacklo_epi8( d, zero), _mm256_sub_epi16( full, _mm256_unpacklo_epi8( m, zero)))), bias);
+            hi = _mm256_add_epi16( _mm256_add_epi16( _mm256_mullo_epi16( v, _mm256_unpackhi_epi8( m, zero)),
+                                                     _mm256_mullo_epi16( _mm256_unpackhi_epi8( d, zero), _mm256_sub_epi16( full, _mm256_unpackhi_epi8( m, zero)))), bias);
+            lo = _mm256_srli_epi16( _mm256_add_epi16( lo, _mm256_srli_epi16( lo, 8)), 8);
+            hi = _mm256_srli_epi16( _mm256_add_epi16( hi, _mm256_srli_epi16( hi, 8)), 8);
+            _mm256_storeu_si256( (__m256i *)(dst+x), _mm256_packus_epi16( lo, hi));
+        }
+        if( x<w) {
+            localMaskBlendSSE2( dst+x, dst_linesize, mask+x, mask_linesize, w-x, 1, value);
+        }
+        dst  += dst_linesize;
+        mask += mask_linesize;
+    }
+}
+
+TARGET_AVX2 static void localFillAVX2( uint8_t *dst, int linesize, int w, int h, int value)
+{
+__m256i v = _mm256_set1_epi8( (char)value);
+int x, y;
+
+    if( w<32) {
+        localFillSSE2( dst, linesize, w, h, value);
+        return;
+    }
+    for( y=0; y<h; y++) {
+        for( x=0; x+32<w; x+=32) {
+            _mm256_storeu_si256( (__m256i *)(dst+x), v);
+        }
+        _mm256_storeu_si256( (__m256i *)(dst+w-32), v);
+        dst += linesize;
+    }
+}
+
+TARGET_AVX2 static void localBlitAVX2( uint8_t *dst, int dst_linesize, const uint8_t *src, int src_linesize, int w, int h)
+{
+int x, y;
+
+    if( w<32) {
+        localBlitSSE2( dst, dst_linesize, src, src_linesize, w, h);
+        return;
+    }
+    for( y=0; y<h; y++) {
+        for( x=0; x+32<w; x+=32) {
+            _mm256_storeu_si256( (__m256i *)(dst+x), _mm256_loadu_si256( (const __m256i *)(src+x)));
+        }
+        _mm256_storeu_si256( (__m256i *)(dst+w-32), _mm256_loadu_si256( (const __m256i *)(src+w-32)));
+        dst += dst_linesize;
+        src += src_linesize;
+    }
+}
+
+static void localBorderAVX2( uint8_t *dst, int linesize, int w, int h, int thickness, int value)
+{
+    localBorder( localFillAVX2, dst, linesize, w, h, thickness, value);
+}
+
+TARGET_AVX2 static void localPatternAVX2( uint8_t *dst, int linesize, int x0, int y0, int w, int h, int base, int kx, int ky)
+{
+uint8_t r[32];
+__m256i ramp, step = _mm256_set1_epi8( (char)(kx*32));
+int x, y;
+
+    for( x=0; x<32; x++) {
+        r[x] = kx*x;
+    }
+    ramp = _mm256_loadu_si256( (const __m256i *)r);
+    for( y=0; y<h; y++) {
+    int v0 = base + kx*x0 + ky*(y0+y);
+    __m256i v = _mm256_add_epi8( _mm256_set1_epi8( (char)v0), ramp);
+
+        for( x=0; x+32<=w; x+=32) {
+            _mm256_storeu_si256( (__m256i *)(dst+x), v);
+            v = _mm256_add_epi8( v, step);
+        }
+        for( ; x<w; x++) {
+            dst[x] = v0 + kx*x;
+        }
+        dst += linesize;
+    }
+}
+TARGET_AVX2 static void localLineBlendRowAVX2( uint8_t *dst, const uint8_t *above, const uint8_t *row, const uint8_t *below, int from, int w)
+{
+__m256i zero = _mm256_setzero_si256();
+__m256i two  = _mm256_set1_epi16( 2);
+int x;
+
+    for( x=from; x+32<=w; x+=32) {
+    __m256i a = _mm256_loadu_si256( (const __m256i *)(above+x));
+    __m256i r = _mm256_loadu_si256( (const __m256i *)(row+x));
+    __m256i b = _mm256_loadu_si256( (const __m256i *)(below+x));
+    __m256i lo, hi;
+
+        lo = _mm256_add_epi16( _mm256_add_epi16( _mm256_unpacklo_epi8( a, zero), _mm256_unpacklo_epi8( b, zero)),
+                               _mm256_add_epi16( _mm256_slli_epi16( _mm256_unpacklo_epi8( r, zero), 1), two));
+        hi = _mm256_add_epi16( _mm256_add_epi16( _mm256_unpackhi_epi8( a, zero), _mm256_unpackhi_epi8( b, zero)),
+                               _mm256_add_epi16( _mm256_slli_epi16( _mm256_unpackhi_epi8( r, zero), 1), two));
+        _mm256_storeu_si256( (__m256i *)(dst+x), _mm256_packus_epi16( _mm256_srli_epi16( lo, 2), _mm256_srli_epi16( hi, 2)));
+    }
+    localLineBlendRowSSE2( dst, above, row, below, x, w);
+}
+
+TARGET_AVX2 static void localToneLutAVX2( uint8_t *dst, int dst_linesize, const uint16_t *src, int src_linesize, int w, int h, const uint8_t *lut)
+{
+__m256i low = _mm256_set1_epi32( 0xff);
+int x, y;
+
+    for( y=0; y<h; y++) {
+        for( x=0; x+16<=w; x+=16) {
+        __m256i v  = _mm256_loadu_si256( (const __m256i *)(src+x));
+        __m256i lo = _mm256_srli_epi32( _mm256_cvtepu16_epi32( _mm256_castsi256_si128( v)), 6);
+        __m256i hi = _mm256_srli_epi32( _mm256_cvtepu16_epi32( _mm256_extracti128_si256( v, 1)), 6);
+        __m256i p;
+
+            // 4 bytes are read from every index, the table is padded for it
+            lo = _mm256_and_si256( _mm256_i32gather_epi32( (const int *)lut, lo, 1), low);
+            hi = _mm256_and_si256( _mm256_i32gather_epi32( (const int *)lut, hi, 1), low);
+            p  = _mm256_permute4x64_epi64( _mm256_packus_epi32( lo, hi), 0xd8);
+            _mm_storeu_si128( (__m128i *)(dst+x), _mm_packus_epi16( _mm256_castsi256_si128( p), _mm256_extracti128_si256( p, 1)));
+        }
+        for( ; x<w; x++) {
+            dst[x] = lut[ src[x]>>6];
+        }
+        dst += dst_linesize;
+        src  = (const uint16_t *)((const uint8_t *)src + src_linesize);
+    }
+}
+
+TARGET_AVX2 static void localLineBlendAVX2( uint8_t *dst, int dst_linesize, const uint8_t *src, int src_linesize, int w, int h)
+{
+    localLineBlend( localLineBlendRowAVX2, dst, dst_linesize, src, src_linesize, w, h);
+}
+
+#endif
+
+static void localSetLevel( int level)
+{
+    simd.level         = level;
+    simd.box_downscale = localBoxDownscaleC;
+    simd.fill          = simd_c_fill;
+    simd.blit          = simd_c_blit;
+    simd.border        = localBorderC;
+    simd.pattern       = simd_c_pattern;
+    simd.mask_blend    = simd_c_mask_blend;
+    simd.alpha_blend   = simd_c_alpha_blend;
+    simd.audio_level   = simd_c_audio_level;
+    simd.line_blend    = simd_c_line_blend;
+    simd.tone_lut      = simd_c_tone_lut;
+#if HAVE_X86
+    if( level>=SIMD_LEVEL_SSE2) {
+        simd.box_downscale = localBoxDownscaleSSE2;
+        simd.fill          = localFillSSE2;
+        simd.blit          = localBlitSSE2;
+        simd.border        = localBorderSSE2;
+        simd.pattern       = localPatternSSE2;
+        simd.mask_blend    = localMaskBlendSSE2;
+        simd.alpha_blend   = localAlphaBlendSSE2;
+        simd.audio_level   = localAudioLevelSSE2;
+        simd.line_blend    = localLineBlendSSE2;
+    }
+    if( level>=SIMD_LEVEL_AVX2) {
+        simd.box_downscale = localBoxDownscaleAVX2;
+        simd.fill          = localFillAVX2;
+        simd.blit          = localBlitAVX2;
+        simd.border        = localBorderAVX2;
+        simd.pattern       = localPatternAVX2;
+        simd.mask_blend    = localMaskBlendAVX2;
+        simd.alpha_blend   = localAlphaBlendAVX2;
+        simd.audio_level   = localAudioLevelAVX2;
+        simd.line_blend    = localLineBlendAVX2;
+        simd.tone_lut      = localToneLutAVX2;
+    }
+#endif
+}
+
+static int localDetectLevel( void)
+{
+int level = SIMD_LEVEL_C;
+
+#if HAVE_X86
+    __builtin_cpu_init();
+    if( __builtin_cpu_supports( "sse2"))
+        level = SIMD_LEVEL_SSE2;
+    if( __builtin_cpu_supports( "avx2"))
+        level = SIMD_LEVEL_AVX2;
+#endif
+
+    return level;
+}
+
+static void localRandom( uint8_t *buffer, int size, uint32_t seed)
+{
+int i;
+
+    for( i=0; i<size; i++) {
+        seed = seed*1664525 + 1013904223;
+        buffer[i] = seed>>24;
+    }
+}
+
+static int localCompare( const char *kernel, const uint8_t *ref, const uint8_t *out, int size, int a, int b)
+{
+    if( !memcmp( ref, out, size))
+        return 1;
+
+    printf( "simd: %s %s %d,%d differs from C\n", levelNames[simd.level], kernel, a, b);
+    return 0;
+}
+
+/*
+ * Run the selected kernels over awkward sizes (odd widths, block tails,
+ * non power of two boxes) and compare with the C reference. The whole
+ * destination is compared so that writes past the block are caught too.
+ */
+static int localCheckKernels( void)
+{
+static const int factors[][2] = { { 1, 1 }, { 2, 2 }, { 3, 2 }, { 8, 8 }, { 5, 7 }, { 64, 3 }, { 1, 64 } };
+static const int widths[] = { 0, 1, 15, 16, 17, 31, 32, 33, 63, 100 };
+enum { dw = 37, dh = 5, sl = 64*dw + 13, pl = 128, ph = 9 };
+uint8_t *src = malloc( sl*64*dh);
+uint8_t ref[pl*ph], out[pl*ph];
+int f, ok = 1;
+
+    if( !src)
+        return 1;
+    localRandom( src, sl*64*dh, 0x12345678);
+    for( f=0; f<(int)(sizeof( factors)/sizeof( factors[0])); f++) {
+        simd_c_box_downscale( ref, dw, src, sl, dw, dh, factors[f][0], factors[f][1]);
+        simd.box_downscale(   out, dw, src, sl, dw, dh, factors[f][0], factors[f][1]);
+        ok &= localCompare( "box_downscale", ref, out, dw*dh, factors[f][0], factors[f][1]);
+    }
+
+    for( f=0; f<(int)(sizeof( widths)/sizeof( widths[0])); f++) {
+    int w = widths[f];
+
+        localRandom( ref, sizeof( ref), w);
+        memcpy( out, ref, sizeof( ref));
+        simd_c_fill( ref+pl+3, pl, w, ph-2, 0xa5);
+        simd.fill(   out+pl+3, pl, w, ph-2, 0xa5);
+        ok &= localCompare( "fill", ref, out, sizeof( ref), w, ph-2);
+
+        localRandom( ref, sizeof( ref), w);
+        memcpy( out, ref, sizeof( ref));
+        simd_c_blit( ref+pl+1, pl, src+7, sl, w, ph-2);
+        simd.blit(   out+pl+1, pl, src+7, sl, w, ph-2);
+        ok &= localCompare( "blit", ref, out, sizeof( ref), w, ph-2);
+
+        localRandom( ref, sizeof( ref), w);
+        memcpy( out, ref, sizeof( ref));
+        simd_c_border( ref+pl+1, pl, w, ph-1, 1+(w&3), 0x10);
+        simd.border(   out+pl+1, pl, w, ph-1, 1+(w&3), 0x10);
+        ok &= localCompare( "border", ref, out, sizeof( ref), w, 1+(w&3));
+
+        localRandom( ref, sizeof( ref), w);
+        memcpy( out, ref, sizeof( ref));
+        simd_c_pattern( ref+2, pl, 5, 7, w, ph, 200, f, 3);
+        simd.pattern(   out+2, pl, 5, 7, w, ph, 200, f, 3);
+        ok &= localCompare( "pattern", ref, out, sizeof( ref), w, f);
+
+        localRandom( ref, sizeof( ref), w);
+        memcpy( out, ref, sizeof( ref));
+        simd_c_mask_blend( ref+pl+1, pl, src+f, sl, w, ph-1, 0xeb);
+        simd.mask_blend(   out+pl+1, pl, src+f, sl, w, ph-1, 0xeb);
+        ok &= localCompare( "mask_blend", ref, out, sizeof( ref), w, f);
+
+        localRandom( ref, sizeof( ref), w);
+        memcpy( out, ref, sizeof( ref));
+        simd_c_alpha_blend( ref+pl+1, pl, src+3, sl, src+f, sl, w, ph-1);
+        simd.alpha_blend(   out+pl+1, pl, src+3, sl, src+f, sl, w, ph-1);
+        ok &= localCompare( "alpha_blend", ref, out, sizeof( ref), w, f);
+
+        localRandom( ref, sizeof( ref), w);
+        memcpy( out, ref, sizeof( ref));
+        simd_c_line_blend( ref+pl+1, pl, src+f, sl, w, ph-1-(f&1));
+        simd.line_blend(   out+pl+1, pl, src+f, sl, w, ph-1-(f&1));
+        ok &= localCompare( "line_blend", ref, out, sizeof( ref), w, f);
+
+        // the source rows as 16 bit samples, the table padded like the real ones
+        localRandom( ref, sizeof( ref), w);
+        memcpy( out, ref, sizeof( ref));
+        simd_c_tone_lut( ref+pl+1, pl, (const uint16_t *)(src+2*f), sl-1, w, ph-1, src+sl*2);
+        simd.tone_lut(   out+pl+1, pl, (const uint16_t *)(src+2*f), sl-1, w, ph-1, src+sl*2);
+        ok &= localCompare( "tone_lut", ref, out, sizeof( ref), w, f);
+    }
+
+    for( f=0; f<(int)(sizeof( widths)/sizeof( widths[0])); f++) {
+    float samples[100];
+    float sum[2]  = { 1, 1 };
+    float peak[2] = { 0.25f, 0.25f };
+    int i;
+
+        for( i=0; i<widths[f]; i++) {
+            samples[i] = (src[i+f]-128)/128.0f;
+        }
+        simd_c_audio_level( samples, widths[f], &sum[0], &peak[0]);
+        simd.audio_level(   samples, widths[f], &sum[1], &peak[1]);
+        ok &= localCompare( "audio_level", (uint8_t *)sum, (uint8_t *)sum+sizeof( float), sizeof( float), widths[f], 0);
+        ok &= localCompare( "audio_level", (uint8_t *)peak, (uint8_t *)peak+sizeof( float), sizeof( float), widths[f], 1);
+    }
+    free( src);
+
+    return ok;
+}
+
+const char *simd_level_name( int level)
+{
+    if( level<SIMD_LEVEL_C || level>SIMD_LEVEL_AVX2)
+        return "?";
+
+    return levelNames[level];
+}
+
+int simd_init( int level)
+{
+    detectedLevel = localDetectLevel();
+    if( level==SIMD_LEVEL_AUTO || level>detectedLevel)
+        level = detectedLevel;
+    localSetLevel( level);
+    if( !localCheckKernels()) {
+        localSetLevel( SIMD_LEVEL_C);
+    }
+
+    return simd.level;
+}
+
+int simd_cpu_level( void)
+{
+    detectedLevel = localDetectLevel();
+
+    return detectedLevel;
+}
+
+int simd_use_level( int level)
+{
+    if( level>simd_cpu_level())
+        level = detectedLevel;
+    localSetLevel( level);
+
+    return simd.level;
+}
+
+/*
+ * Microbenchmark, each kernel is run on 1080p planes for about a fifth
+ * of a second per level and reported in megapixels (of output) a second.
+ */
+#define BENCH_WIDTH     1920
+#define BENCH_HEIGHT    1080
+
+typedef struct _BenchPlanes {
+    uint8_t *src;
+    uint8_t *dst;
+    int      w;
+    int      h;
+    float   *samples;           // as many floats as fit in a plane
+} BenchPlanes;
+
+static int localBenchBox( BenchPlanes *b)
+{
+    simd.box_downscale( b->dst, b->w/8, b->src, b->w, b->w/8, b->h/8, 8, 8);
+    return (b->w/8)*(b->h/8);
+}
+
+static int localBenchFill( BenchPlanes *b)
+{
+    simd.fill( b->dst, b->w, b->w, b->h, 0x80);
+    return b->w*b->h;
+}
+
+static int localBenchBlit( BenchPlanes *b)
+{
+    simd.blit( b->dst, b->w, b->src, b->w, b->w, b->h);
+    return b->w*b->h;
+}
+
+static int localBenchBorder( BenchPlanes *b)
+{
+int n = 0;
+int x, y;
+
+    // a 6x6 wall of tiles with a 4 pixel frame each
+    for( y=0; y<6; y++) {
+        for( x=0; x<6; x++) {
+            simd.border( b->dst + (y*(b->h/6)*b->w) + (x*(b->w/6)), b->w, b->w/6, b->h/6, 4, 0xea);
+            n += ((b->w/6)*(b->h/6)) - (((b->w/6)-8)*((b->h/6)-8));
+        }
+    }
+
+    return n;
+}
+
+static int localBenchPattern( BenchPlanes *b)
+{
+    simd.pattern( b->dst, b->w, 0, 0, b->w, b->h, 3, 1, 1);
+    return b->w*b->h;
+}
+
+static int localBenchMaskBlend( BenchPlanes *b)
+{
+    simd.mask_blend( b->dst, b->w, b->src, b->w, b->w, b->h, 0xeb);
+    return b->w*b->h;
+}
+
+static int localBenchAlphaBlend( BenchPlanes *b)
+{
+    // random alpha, so nothing can be skipped
+    simd.alpha_blend( b->dst, b->w, b->src, b->w, b->src, b->w, b->w, b->h);
+    return b->w*b->h;
+}
+
+static int localBenchAudioLevel( BenchPlanes *b)
+{
+float sum = 0, peak = 0;
+
+    // about five seconds of 48kHz stereo, counted in samples
+    simd.audio_level( b->samples, (b->w*b->h)/sizeof( float), &sum, &peak);
+    return (b->w*b->h)/sizeof( float);
+}
+
+static int localBenchLineBlend( BenchPlanes *b)
+{
+    simd.line_blend( b->dst, b->w, b->src, b->w, b->w, b->h);
+    return b->w*b->h;
+}
+
+static int localBenchToneLut( BenchPlanes *b)
+{
+    // random 16 bit samples over half the plane, the other half as the table
+    simd.tone_lut( b->dst, b->w/2, (const uint16_t *)b->src, b->w, b->w/2, b->h/2, b->src+(b->w*b->h/2));
+    return (b->w/2)*(b->h/2);
+}
+
+static const struct {
+    const char *name;
+    int (*run)( BenchPlanes *b);
+} benchmarks[] = {
+    { "box_downscale",  localBenchBox },
+    { "fill",           localBenchFill },
+    { "blit",           localBenchBlit },
+    { "border",         localBenchBorder },
+    { "pattern",        localBenchPattern },
+    { "mask_blend",     localBenchMaskBlend },
+    { "alpha_blend",    localBenchAlphaBlend },
+    { "audio_level",    localBenchAudioLevel },
+    { "line_blend",     localBenchLineBlend },
+    { "tone_lut",       localBenchToneLut },
+};
+
+static double localSeconds( void)
+{
+struct timespec ts;
+
+    clock_gettime( CLOCK_MONOTONIC, &ts);
+
+    return ts.tv_sec + (ts.tv_nsec/1e9);
+}
+
+void simd_benchmark( void)
+{
+BenchPlanes b = { malloc( BENCH_WIDTH*BENCH_HEIGHT), malloc( BENCH_WIDTH*BENCH_HEIGHT), BENCH_WIDTH, BENCH_HEIGHT,
+                  malloc( BENCH_WIDTH*BENCH_HEIGHT) };
+int selected = simd.level;
+int k, level;
+
+    if( !b.src || !b.dst || !b.samples) {
+        free( b.src);
+        free( b.dst);
+        free( b.samples);
+        return;
+    }
+    localRandom( b.src, BENCH_WIDTH*BENCH_HEIGHT, 1);
+    localRandom( b.dst, BENCH_WIDTH*BENCH_HEIGHT, 2);
+    for( k=0; k<(int)((BENCH_WIDTH*BENCH_HEIGHT)/sizeof( float)); k++) {
+        b.samples[k] = (b.src[k]-128)/128.0f;
+    }
+
+    printf( "%-16s", "kernel");
+    for( level=SIMD_LEVEL_C; level<=detectedLevel; level++) {
+        printf( "%10s", levelNames[level]);
+    }
+    printf( "%10s   (Mpixel/s per level, then us per Mpixel at %s)\n", "us/Mpixel", levelNames[selected]);
+    for( k=0; k<(int)(sizeof( benchmarks)/sizeof( benchmarks[0])); k++) {
+    double cost = 0;
+
+        printf( "%-16s", benchmarks[k].name);
+        for( level=SIMD_LEVEL_C; level<=detectedLevel; level++) {
+        double start, elapsed;
+        double pixels = 0;
+
+            localSetLevel( level);
+            start = localSeconds();
+            do {
+                pixels += benchmarks[k].run( &b);
+                elapsed = localSeconds() - start;
+            } while( elapsed<0.2);
+            printf( "%10.1f", pixels/elapsed/1e6);
+            if( level==selected) {
+                cost = elapsed/pixels*1e12;
+            }
+        }
+        printf( "%10.1f\n", cost);
+    }
+    localSetLevel( selected);
+
+    free( b.src);
+    free( b.dst);
+    free( b.samples);
+}
@@ -0,0 +1,80 @@
+// Pixel kernels with SSE2/AVX2 variants selected at startup
+#ifndef SIMD_H
+#define SIMD_H
+
+#include <stdint.h>
+
+enum {
+    SIMD_LEVEL_AUTO = -1,
+    SIMD_LEVEL_C,
+    SIMD_LEVEL_SSE2,
+    SIMD_LEVEL_AVX2,
+};
+
+// Largest integer factors the box downscaler accepts
+#define SIMD_BOX_MAX_FACTOR     64
+
+typedef struct _SimdKernels {
+    int level;
+
+    // Area-average dst_w x dst_h from (dst_w*fx) x (dst_h*fy) source pixels
+    void (*box_downscale)( uint8_t *dst, int dst_linesize, const uint8_t *src, int src_linesize,
+                           int dst_w, int dst_h, int fx, int fy);
+
+    // Set a w x h block of one plane to value
+    void (*fill)( uint8_t *dst, int linesize, int w, int h, int value);
+
+    // Copy a w x h block of one plane
+    void (*blit)( uint8_t *dst, int dst_linesize, const uint8_t *src, int src_linesize, int w, int h);
+
+    // Frame thickness pixels wide just inside a w x h block
+    void (*border)( uint8_t *dst, int linesize, int w, int h, int thickness, int value);
+
+    // dst[y][x] = base + kx*(x0+x) + ky*(y0+y), wrapping at 8 bits
+    void (*pattern)( uint8_t *dst, int linesize, int x0, int y0, int w, int h, int base, int kx, int ky);
+
+    // Blend value over dst with the 0-255 coverage in mask, all zero runs are skipped
+    void (*mask_blend)( uint8_t *dst, int dst_linesize, const uint8_t *mask, int mask_linesize, int w, int h, int value);
+
+    // dst = src + dst*(255-alpha)/255 for premultiplied src, all transparent runs are skipped
+    void (*alpha_blend)( uint8_t *dst, int dst_linesize, const uint8_t *src, int src_linesize,
+                         const uint8_t *alpha, int alpha_linesize, int w, int h);
+
+    // Add the squares of count samples to *sum_squares and raise *peak to the largest magnitude
+    void (*audio_level)( const float *src, int count, float *sum_squares, float *peak);
+
+    // Vertical 1-2-1 filter of a plane, blends the two fields of an interlaced picture
+    void (*line_blend)( uint8_t *dst, int dst_linesize, const uint8_t *src, int src_linesize, int w, int h);
+
+    // dst = lut[src>>6] for 16 bit samples, linesizes in bytes, lut 1024 entries plus 3 bytes
+    void (*tone_lut)( uint8_t *dst, int dst_linesize, const uint16_t *src, int src_linesize, int w, int h, const uint8_t *lut);
+} SimdKernels;
+
+extern SimdKernels simd;
+
+// Reference implementations, every SIMD variant must match these bit for bit
+void simd_c_box_downscale( uint8_t *dst, int dst_linesize, const uint8_t *src, int src_linesize,
+                           int dst_w, int dst_h, int fx, int fy);
+void simd_c_fill( uint8_t *dst, int linesize, int w, int h, int value);
+void simd_c_blit( uint8_t *dst, int dst_linesize, const uint8_t *src, int src_linesize, int w, int h);
+void simd_c_border( uint8_t *dst, int linesize, int w, int h, int thickness, int value);
+void simd_c_pattern( uint8_t *dst, int linesize, int x0, int y0, int w, int h, int base, int kx, int ky);
+void simd_c_mask_blend( uint8_t *dst, int dst_linesize, const uint8_t *mask, int mask_linesize, int w, int h, int value);
+void simd_c_alpha_blend( uint8_t *dst, int dst_linesize, const uint8_t *src, int src_linesize,
+                         const uint8_t *alpha, int alpha_linesize, int w, int h);
+void simd_c_audio_level( const float *src, int count, float *sum_squares, float *peak);
+void simd_c_line_blend( uint8_t *dst, int dst_linesize, const uint8_t *src, int src_linesize, int w, int h);
+void simd_c_tone_lut( uint8_t *dst, int dst_linesize, const uint16_t *src, int src_linesize, int w, int h, const uint8_t *lut);
+
+int         simd_init( int level);
+const char *simd_level_name( int level);
+
+// For simd_test: the best level of this CPU, and the kernels of a level put in place unchecked
+int         simd_cpu_level( void);
+int         simd_use_level( int level);
+
+// Time every kernel at every level this CPU has and print the figures,
+// with the cost per megapixel at the level in use
+void        simd_benchmark( void);
+
+#endif
@@ -0,0 +1,207 @@
+/*
+ * Checks every pixel kernel at every level this CPU has against the C
+ * reference, over each width up to a few vectors and a half, odd heights,
+ * unaligned starts and the tails of the blocks. The whole destination,
+ * with the bytes around the block, is compared so that writes past the
+ * end are caught too. With -b the kernels are benchmarked afterwards.
+ *
+ * simd_test [-b]
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+
+#include "simd.h"
+
+#define TEST_WIDTHS         130         // every width from 0 up to this
+#define TEST_LINESIZE       192
+#define TEST_ROWS           12
+#define TEST_SRC_LINESIZE   (SIMD_BOX_MAX_FACTOR*40 + 13)
+#define TEST_SRC_ROWS       (SIMD_BOX_MAX_FACTOR*3)
+#define TEST_REPORTS        10          // differences printed per kernel and level
+
+static uint8_t *src;
+static uint8_t *mask;                   // src with runs of 0 and 255, for the kernels that skip them
+static uint8_t lut[1024+3];
+static uint8_t ref[TEST_LINESIZE*TEST_ROWS];
+static uint8_t out[TEST_LINESIZE*TEST_ROWS];
+static int checked, failed, reported;
+
+static void localRandom( uint8_t *buffer, int size, uint32_t seed)
+{
+int i;
+
+    for( i=0; i<size; i++) {
+        seed = seed*1664525 + 1013904223;
+        buffer[i] = seed>>24;
+    }
+}
+
+// ref and out start the same, with something other than what the kernels write
+static void localReset( int seed)
+{
+    localRandom( ref, sizeof( ref), seed);
+    memcpy( out, ref, sizeof( ref));
+}
+
+static void localCompare( const char *kernel, const void *a, const void *b, size_t size, int w, int h, int extra)
+{
+    checked++;
+    if( !memcmp( a, b, size))
+        return;
+
+    failed++;
+    if( reported++<TEST_REPORTS) {
+        printf( "  %s w:%d h:%d (%d) differs from C\n", kernel, w, h, extra);
+    }
+}
+
+static void localTestBox( void)
+{
+static const int fxs[] = { 1, 2, 3, 4, 5, 7, 8, 16, 33, SIMD_BOX_MAX_FACTOR };
+static const int fys[] = { 1, 2, 3, 5, SIMD_BOX_MAX_FACTOR };
+static const int dws[] = { 1, 2, 3, 7, 15, 16, 17, 31, 32, 33, 40 };
+int x, y, w, h;
+
+    for( x=0; x<(int)(sizeof( fxs)/sizeof( fxs[0])); x++) {
+        for( y=0; y<(int)(sizeof( fys)/sizeof( fys[0])); y++) {
+            for( w=0; w<(int)(sizeof( dws)/sizeof( dws[0])); w++) {
+                for( h=1; h<=3; h++) {
+                    localReset( w+h);
+                    simd_c_box_downscale( ref+TEST_LINESIZE+1, TEST_LINESIZE, src+x, TEST_SRC_LINESIZE, dws[w], h, fxs[x], fys[y]);
+                    simd.box_downscale(   out+TEST_LINESIZE+1, TEST_LINESIZE, src+x, TEST_SRC_LINESIZE, dws[w], h, fxs[x], fys[y]);
+                    localCompare( "box_downscale", ref, out, sizeof( ref), dws[w], h, fxs[x]*100+fys[y]);
+                }
+            }
+        }
+    }
+}
+
+static void localTestPlanes( void)
+{
+static const int heights[] = { 1, 2, 3, 7, TEST_ROWS-2 };
+int w, h, a;
+
+    for( w=0; w<=TEST_WIDTHS; w++) {
+        for( h=0; h<(int)(sizeof( heights)/sizeof( heights[0])); h++) {
+        int rows = heights[h];
+
+            // a is the misalignment of the destination
+            for( a=0; a<4; a++) {
+            uint8_t *r = ref + TEST_LINESIZE + 1 + a;
+            uint8_t *o = out + TEST_LINESIZE + 1 + a;
+            const uint8_t *s = src + w + a;
+            int t = (w+a)%5;
+
+                localReset( w*7+a);
+                simd_c_fill( r, TEST_LINESIZE, w, rows, 0xa5);
+                simd.fill(   o, TEST_LINESIZE, w, rows, 0xa5);
+                localCompare( "fill", ref, out, sizeof( ref), w, rows, a);
+
+                localReset( w*7+a);
+                simd_c_blit( r, TEST_LINESIZE, s, TEST_SRC_LINESIZE, w, rows);
+                simd.blit(   o, TEST_LINESIZE, s, TEST_SRC_LINESIZE, w, rows);
+                localCompare( "blit", ref, out, sizeof( ref), w, rows, a);
+
+                // thickness 0 up to more than half the block
+                localReset( w*7+a);
+                simd_c_border( r, TEST_LINESIZE, w, rows, t ? t : w, 0x10);
+                simd.border(   o, TEST_LINESIZE, w, rows, t ? t : w, 0x10);
+                localCompare( "border", ref, out, sizeof( ref), w, rows, t ? t : w);
+
+                localReset( w*7+a);
+                simd_c_pattern( r, TEST_LINESIZE, 5+a, 7, w, rows, 200, w, 3);
+                simd.pattern(   o, TEST_LINESIZE, 5+a, 7, w, rows, 200, w, 3);
+                localCompare( "pattern", ref, out, sizeof( ref), w, rows, a);
+
+                localReset( w*7+a);
+                simd_c_mask_blend( r, TEST_LINESIZE, mask+w+a, TEST_SRC_LINESIZE, w, rows, a ? 0xeb : 0xff);
+                simd.mask_blend(   o, TEST_LINESIZE, mask+w+a, TEST_SRC_LINESIZE, w, rows, a ? 0xeb : 0xff);
+                localCompare( "mask_blend", ref, out, sizeof( ref), w, rows, a);
+
+                localReset( w*7+a);
+                simd_c_alpha_blend( r, TEST_LINESIZE, s, TEST_SRC_LINESIZE, mask+a, TEST_SRC_LINESIZE, w, rows);
+                simd.alpha_blend(   o, TEST_LINESIZE, s, TEST_SRC_LINESIZE, mask+a, TEST_SRC_LINESIZE, w, rows);
+                localCompare( "alpha_blend", ref, out, sizeof( ref), w, rows, a);
+
+                localReset( w*7+a);
+                simd_c_line_blend( r, TEST_LINESIZE, s, TEST_SRC_LINESIZE, w, rows);
+                simd.line_blend(   o, TEST_LINESIZE, s, TEST_SRC_LINESIZE, w, rows);
+                localCompare( "line_blend", ref, out, sizeof( ref), w, rows, a);
+
+                // the source rows read as 16 bit samples
+                localReset( w*7+a);
+                simd_c_tone_lut( r, TEST_LINESIZE, (const uint16_t *)(src+2*(w+a)), TEST_SRC_LINESIZE-1, w, rows, lut);
+                simd.tone_lut(   o, TEST_LINESIZE, (const uint16_t *)(src+2*(w+a)), TEST_SRC_LINESIZE-1, w, rows, lut);
+                localCompare( "tone_lut", ref, out, sizeof( ref), w, rows, a);
+            }
+        }
+    }
+}
+
+static void localTestAudio( void)
+{
+float samples[TEST_WIDTHS+4];
+int count, a, i;
+
+    for( count=0; count<=TEST_WIDTHS; count++) {
+        for( a=0; a<4; a++) {
+        float sum[2]  = { 1, 1 };
+        float peak[2] = { 0.25f, 0.25f };
+
+            for( i=0; i<count; i++) {
+                samples[a+i] = (src[count+i]-128)/128.0f;
+            }
+            simd_c_audio_level( samples+a, count, &sum[0], &peak[0]);
+            simd.audio_level(   samples+a, count, &sum[1], &peak[1]);
+            localCompare( "audio_level sum", &sum[0], &sum[1], sizeof( float), count, 1, a);
+            localCompare( "audio_level peak", &peak[0], &peak[1], sizeof( float), count, 1, a);
+        }
+    }
+}
+
+int main( int argc, char **argv)
+{
+int top = simd_cpu_level();
+int level, i;
+
+    src  = malloc( TEST_SRC_LINESIZE*TEST_SRC_ROWS);
+    mask = malloc( TEST_SRC_LINESIZE*TEST_SRC_ROWS);
+    if( !src || !mask) {
+        printf( "out of memory\n");
+        return 1;
+    }
+    localRandom( src, TEST_SRC_LINESIZE*TEST_SRC_ROWS, 0x12345678);
+    localRandom( lut, sizeof( lut), 0x9e3779b9);
+    for( i=0; i<TEST_SRC_LINESIZE*TEST_SRC_ROWS; i++) {
+        // runs of 38 transparent and 19 opaque pixels between 38 random ones
+        switch( (i/19)%5) {
+            case 0:
+            case 1:  mask[i] = 0;      break;
+            case 2:  mask[i] = 255;    break;
+            default: mask[i] = src[i]; break;
+        }
+    }
+
+    for( level=SIMD_LEVEL_C; level<=top; level++) {
+    int before = failed;
+
+        simd_use_level( level);
+        reported = 0;
+        localTestBox();
+        localTestPlanes();
+        localTestAudio();
+        printf( "%-5s %s\n", simd_level_name( level), failed==before ? "ok" : "FAILED");
+    }
+    printf( "%d checks, %d failed\n", checked, failed);
+
+    if( argc>1 && !strcmp( argv[1], "-b")) {
+        simd_use_level( top);
+        simd_benchmark();
+    }
+    free( src);
+    free( mask);
+
+    return failed ? 1 : 0;
+}
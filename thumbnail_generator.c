@@ -31,10 +31,12 @@
 
 #include <stdio.h>
 #include <ctype.h>
+#include <math.h>
 #include <unistd.h>
 #include <signal.h>
 
 #include <libavutil/imgutils.h>
+#include <libavutil/pixdesc.h>
 #include <libavutil/samplefmt.h>
 #include <libavutil/timestamp.h>
 //#include "libavfilter/lavfutils.h"
@@ -49,12 +51,18 @@ int ff_load_image(uint8_t *data[4], int linesize[4], int *w, int *h, enum AVPixe
 #include <pthread.h>
 #include <libxml/xmlreader.h>
 #include <sys/time.h>
+#include <fcntl.h>
 
 #if _POSIX_C_SOURCE >= 199309L
 #include <time.h>
 #endif
 
 #include "font.h"
+#include "glyph.h"
+#include "canvas_ring.h"
+#include "tonemap.h"
+#include "simd.h"
+#include "worker.h"
 
 #define USE_XML                 1
 #define FULL_TASK_RUN           (!inputSource->quit && !stop_all_tasks)
@@ -64,6 +72,12 @@ int ff_load_image(uint8_t *data[4], int linesize[4], int *w, int *h, enum AVPixe
 #define STREAM_PIX_FMT          AV_PIX_FMT_YUV420P /* default pix_fmt */
 #define SCALE_FLAGS             SWS_BICUBIC
 
+#if LIBAVUTIL_VERSION_INT>=AV_VERSION_INT( 56, 29, 100)
+#define HAVE_REGIONS            1                 // AVRegionOfInterest, FFmpeg 4.2 and up
+#else
+#define HAVE_REGIONS            0
+#endif
+
 #define USE_PACKETS_LIST        1
 
 #define YCrCb_BLACK             0x108080
@@ -93,6 +107,7 @@ typedef struct _videoFrames {
     void *next;
     AVFrame *frame;
     double pts;
+    int64_t at;                 // microseconds from the first picture of the input, orders offline output
 } videoFrames;
 
 // a wrapper around a single output AVStream
@@ -102,20 +117,25 @@ typedef struct OutputStream {
     AVFrame *video_frame;
     AVFrame *tmp_video_frame;
 
-    AVFrame *final_video_frame;
-    int final_width;
-    int final_height;
-
     /* pts of the next frame that will be generated */
     int64_t next_pts;
+    int64_t pictures;           // handed to the encoder
+    int hold;                   // frames the next picture is shown for
+    int reuse;                  // send the last picture again without compositing it
     int samples_count;
 
     float t, tincr, tincr2;
 
     struct SwsContext *out_sws_ctx;
-    struct SwsContext *final_sws_ctx;
 } OutputStream;
 
+typedef struct _TileRect {
+    int x;
+    int y;
+    int w;
+    int h;
+} TileRect;
+
 typedef struct _Tiles {
     int x;
     int y;
@@ -128,12 +148,149 @@ typedef struct _Tiles {
 
     uint8_t *video_dst_data[4];
     int      video_dst_linesize[4];
+    uint8_t *back_data[4];      // mode M scales here without buffer_mutex, then swaps it with video_dst_data
     int      video_dst_bufsize;
     int      video_dst_dirty;
+    int      changed;           // pictures since the last output frame
+    int      roi_state;         // shown and slate last frame, a change of either changes the tile
 
     int updates_per_second;
+    int scale_time;             // last scale into the tile, in microseconds
+    int scale_time_sum;         // reset with updates_per_second
+
+    const char *source_name;    // input last scaled into the tile
+    double      source_pts;
+    GlyphLabel  caption;
+
+    // Overlay widgets from the tile attributes
+    int   clock;
+    int   analog;
+    int   vu_meter;
+    char *named;
+#define VU_CHANNELS         2
+    int   vu_level[VU_CHANNELS];    // 0-100 of the meter height, RMS over an output frame
+    int   vu_peak[VU_CHANNELS];     // same scale, peak over the same window
+
+    // Diagnostics overlay
+    int         updates_last;       // updates_per_second of the last whole second
+    int         queue_depth;        // decoded frames waiting when the tile was last updated
+    int64_t     updated_at;         // TIMEOFDAY of the last update
+    int64_t     diagnostics_at;     // when the label was last redrawn
+    GlyphLabel  diagnostics;
+
+    // Stacking, higher z is drawn later, popups only while they are up
+    int       z;
+    int       popup;
+    int       pop_start;            // seconds of output
+    int       pop_length;           // 0 stays up
+    int       hidden;               // completely covered, never scaled or drawn
+    int       visible_count;        // canvas rectangles not covered by tiles above
+    TileRect *visible;
+
+    struct _inputMosaic *input;     // mode M, the input feeding this tile
+    int       fresh;                // mode M, new picture since the last output frame
+
+    // Shown instead of the picture while the input feeding the tile is stalled
+    struct _inputMosaic *source;    // input the picture last came from
+    uint8_t  *slate_data[4];
+    int       slate_linesize[4];
 } Tiles;
 
+enum {
+    WIDGET_NAMED,
+    WIDGET_CLOCK,
+    WIDGET_ANALOG,
+    WIDGET_VU_METER,
+};
+
+#define WIDGET_LAYERS       3
+
+/*
+ * Something drawn over a tile that changes far less often than the video
+ * under it. Text widgets keep their text in a GlyphLabel, the others draw
+ * coverage masks, one per colour, and only when key changes. Compositing
+ * either is a mask blend of what is already there.
+ */
+typedef struct _Widget {
+    int         type;
+    Tiles      *tile;
+    int         key;
+
+    int         x;              // tile relative, even
+    int         y;
+    int         w;
+    int         h;
+    int         layers;
+    int         colour[WIDGET_LAYERS];
+    uint8_t    *mask[WIDGET_LAYERS][2];
+    int         linesize[2];
+    uint8_t    *buffer;
+    int         allocated;
+    uint8_t    *scratch;        // double size drawing for anti-aliasing
+
+    GlyphLabel  label;
+} Widget;
+
+enum {
+    RENDER_FILL,
+    RENDER_COPY,
+    RENDER_PATTERN,
+    RENDER_MASK,
+    RENDER_BLEND,
+};
+
+typedef struct _RenderOp {
+    int type;
+    int x;
+    int y;
+    int w;
+    int h;
+    int colour;
+
+    // COPY: the picture planes, MASK: luma and chroma coverage, BLEND: premultiplied YUVA
+    const uint8_t *data[4];
+    int            linesize[4];
+    const uint8_t *chroma_alpha;
+    int            chroma_alpha_linesize;
+} RenderOp;
+
+typedef struct _RenderList {
+    AVFrame  *pict;
+    int       frame_index;
+    int       width;
+    int       height;
+    int       band_height;
+
+    int       count;
+    int       allocated;
+    RenderOp *ops;
+
+    int       timed_first;      // ops from here to timed_last are timed, the diagnostics lines
+    int       timed_last;
+    int64_t   timed_time;       // microseconds they took, summed over the bands
+} RenderList;
+
+/*
+ * A logo or watermark. The picture is converted once to premultiplied
+ * YUVA420P at its size on the canvas and cut down to the pixels that have
+ * any alpha, so only those are blended each frame.
+ */
+typedef struct _Overlay {
+    char    *filename;
+    int      x;                 // canvas position and size, 0 width/height keeps the image size
+    int      y;
+    int      w;
+    int      h;
+
+    AVFrame *frame;
+    uint8_t *chroma_alpha;      // alpha at 4:2:0 chroma resolution
+    int      chroma_alpha_linesize;
+    int      bx;                // bounding box of the visible pixels inside frame
+    int      by;
+    int      bw;
+    int      bh;
+} Overlay;
+
 typedef struct _inputMosaic {
     pthread_t pulledThread;
 
@@ -152,8 +309,12 @@ typedef struct _inputMosaic {
     int video_frame_count;
 
 #define MAX_TILES_PER_INPUT 1
+#define SCALE_MAX_SLICES    8
     // Rescalers
     struct SwsContext *scale_sws_ctx[MAX_TILES_PER_INPUT];
+    struct SwsContext *slice_sws_ctx[MAX_TILES_PER_INPUT][SCALE_MAX_SLICES];
+    uint8_t *slice_data[MAX_TILES_PER_INPUT][SCALE_MAX_SLICES][4];          // a slice with its overlap rows
+    int      slice_linesize[MAX_TILES_PER_INPUT][SCALE_MAX_SLICES][4];
     struct SwrContext *scale_swr_ctx[MAX_TILES_PER_INPUT];
     int tile_number[MAX_TILES_PER_INPUT];
     int tx[MAX_TILES_PER_INPUT], ty[MAX_TILES_PER_INPUT], tw[MAX_TILES_PER_INPUT], th[MAX_TILES_PER_INPUT];
@@ -176,6 +337,62 @@ typedef struct _inputMosaic {
     char *album;
     int year;
 
+    // Source rectangle shown in the tiles, 0 width/height means the whole frame
+    int crop_x;
+    int crop_y;
+    int crop_w;
+    int crop_h;
+
+    // crop="auto", the black bars are found in the luma of a few frames
+    int     crop_auto;
+    int     auto_x, auto_y, auto_w, auto_h;                 // in use, 0 wide until found
+    int     detect_x0, detect_y0, detect_x1, detect_y1;     // picture seen in this round
+    int     detect_samples;
+    int     detect_wait;                                    // frames to the next sample
+    int64_t detect_at;                                      // next round, 0 while one runs
+
+    // Interlaced pictures: one field read (field) or the fields blended (blend)
+    int      deinterlace;       // DEINTERLACE_xxx asked for
+    int      interlaced;        // what the last picture got
+    uint8_t *blend_data[4];
+    int      blend_linesize[4];
+    int      blend_w;
+    int      blend_h;
+    int      blend_format;
+
+    // More than 8 bits: scaled at 16 bits to the tile size, then through the tone tables
+    struct SwsContext *deep_sws_ctx[MAX_TILES_PER_INPUT];
+    uint8_t *deep_data[MAX_TILES_PER_INPUT][4];
+    int      deep_linesize[MAX_TILES_PER_INPUT][4];
+    int      tone_curve;        // curve of the last deep picture plus one, 0 before any
+
+    Tiles          *mapped_tile;    // tile given to this input by the layout
+
+    // Watchdog, an input with no new picture for WATCHDOG_STALL is reopened
+    volatile int64_t last_frame_at;     // TIMEOFDAY, 0 until it is first opened
+    volatile int     stalled;           // set until a session puts a picture in a tile
+    volatile int     probing;           // opening and probing, timed from probe_at
+    volatile int64_t probe_at;          // TIMEOFDAY the current attempt started
+    int              video_busy;        // under list_mutex, the video thread has a picture out of the list
+    volatile int     reconnect;         // makes blocking reads give up
+    int              session_frames;    // decoded since it was last opened
+    int              reconnects;
+
+    // pacing="offline", pictures are applied in the order of their time
+    int64_t          offline_origin;    // timestamp of the first picture, AV_NOPTS_VALUE before it
+    int64_t          offline_last;      // time of the last picture decoded
+    volatile int64_t offline_next;      // time of the picture waiting to be applied, OFFLINE_DONE at the end
+
+    // Audio is only decoded when the tile this input maps to has a meter
+    Tiles          *meter_tile;
+    AVCodecContext *audio_dec_ctx;
+    int             audio_stream_idx;
+    uint8_t        *meter_data[VU_CHANNELS];    // planar float when the decoder gives something else
+    int             meter_allocated;            // samples per channel in meter_data
+    int             meter_count;                // samples in the current window
+    float           meter_sum[VU_CHANNELS];
+    float           meter_peak[VU_CHANNELS];
+
 } inputMosaic;
 
 typedef struct _OutputInfo {
@@ -198,6 +415,8 @@ typedef struct _OutputInfo {
 
     int screen_width;
     int screen_height;
+    int layout_width;           // size attribute, what tile and overlay positions are given in
+    int layout_height;
     int final_width;
     int final_height;
     int border_width;
@@ -211,6 +430,16 @@ typedef struct _OutputInfo {
     int need_audio;
 
     int frames_count;
+    int frame_hold;             // HOLD_, how the frame_count repeats of a mosaic are made
+    int pacing;                 // PACING_, what decides when a frame goes out
+    int roi_offset;             // QP added where nothing changed, 0 for no region hints
+    int profile;                // PROFILE_, encoder threading and latency
+    int slice_rows;             // slices="rows", then the number of slices, one per row of the grid
+    int grid_down;              // rows of the automatic grid, 0 when the tiles are given
+    int ring_slots;             // canvases in the ring of a shm: url
+    CanvasRing *canvas_ring;    // raw canvases in place of the encoder, for a shm: url
+    TileRect *roi;              // tiles that changed in the frame being made
+    int       roi_count;
     int thumbnail_count;
 
     char *filename;
@@ -220,12 +449,118 @@ typedef struct _OutputInfo {
     int tiles_count;
     Tiles **tiles;
     TILE_MAP *tile_map;
+    int *draw_order;            // tile indexes by z
     int tiles_across;
     int tiles_down;
 
     pthread_mutex_t buffer_mutex;
+
+    int caption;                // CAPTION_ bits
+    int caption_size;           // GLYPH_SIZE_
+
+    int     widgets_count;
+    Widget *widgets;
+
+    int      overlays_count;
+    Overlay *overlays;
+
+    int diagnostics;
+    int diagnostics_next;       // tile the next refresh starts at
+    int diagnostics_time_sum;   // microseconds spent on the layer, reset every second
+    int diagnostics_blend;      // blending the lines took last frame, comes off the budget
+    int diagnostics_frames;
+
+    // Live pacing, reset every second
+    int pace_frames;
+    int pace_missed;            // frame times that went by with no frame
+    int pace_jitter_sum;        // microseconds from the deadline to the frame being written
+    int pace_jitter_max;
+
+    RenderList  render;
+    WorkerPool *composite_pool;
+
+    struct _Rendition *renditions;      // lower rungs made from this canvas
+    int                renditions_count;
+    struct _Sink      *sinks;           // more muxers for the packets of the encoder
+    int                sinks_count;
 } OutputInfo;
 
+/*
+ * A lower rung of the ladder. The finished canvas is scaled to it and it is
+ * encoded on a thread of its own; settings is a copy of the mosaic with the
+ * size, bitrate and url of the rung, so it opens like any other output.
+ */
+typedef struct _Rendition {
+    int                width;
+    int                height;
+    int                video_bitrate;
+    char              *filename;
+    char              *x264_preset;     // NULL for the one of the mosaic
+
+    OutputInfo         settings;
+    struct SwsContext *sws_ctx;         // canvas to rung
+    int                started;
+    int                stop;
+    int                full;            // video_frame waits for the encoder
+    pthread_mutex_t    mutex;
+    pthread_cond_t     cond;
+    pthread_t          thread;
+
+    int                encoded_frames;  // reset every second, as encoded_frames
+    int                encoded_bytes;
+} Rendition;
+
+#define SINK_QUEUE          100             // packets, about 4s of 25fps
+#define SINK_BACKOFF_MAX    TIMEOFDAY_S     // longest pause after a failed write
+#define SEGMENT_GRACE       2               // segments kept after they left the playlist
+
+typedef struct _SinkSegment {
+    unsigned         sequence;
+    double           duration;          // seconds
+} SinkSegment;
+
+/*
+ * Another muxer for the packets of the encoder. Every packet is queued as a
+ * new reference to the same buffer, and written by a thread of the sink, so
+ * a slow or failing sink only loses its own packets.
+ */
+typedef struct _Sink {
+    char            *url;
+    char            *format;            // NULL to go by the url, as the output
+    int              queue_size;
+
+    AVFormatContext *oc;
+    AVStream        *st;
+    AVCodecContext  *codec;             // copy of the encoder, for opening it again
+    AVRational       time_base;         // of the packets queued
+    AVPacket       **queue;
+    int              head;
+    int              count;
+    int              key_wait;          // dropped one, skip to the next key frame
+    int64_t          backoff;
+    int64_t          retry_at;          // monotonic, when a sink that is down is opened again
+    int              down;              // a write failed, dropping until it is reopened
+    int              dead;              // a file that failed, never opened over again
+    int              started;
+    int              stop;
+    pthread_mutex_t  mutex;
+    pthread_cond_t   cond;
+    pthread_t        thread;
+
+    int              segment;           // seconds, 0 writes one file
+    int              keep;              // segments listed in the playlist
+    int64_t          frame_ticks;       // one picture in time_base
+    int64_t          segment_ticks;     // whole gops closest to segment seconds
+    int64_t          segment_start;     // pts of the key frame that opened it
+    int64_t          last_pts;
+    unsigned         sequence;          // number of the segment being written
+    SinkSegment     *segments;          // closed ones, oldest first
+    int              segments_count;
+
+    int              written;           // reset every second, as encoded_frames
+    int              dropped;
+} Sink;
+
 static OutputInfo  **outputMosaics;
 static int          outputMosaicsCnt;
 
@@ -233,9 +568,21 @@ static int         inputs_count;
 static inputMosaic **inputs;
 
 static int         verbose;
+static int         benchmark;
+static WorkerPool  *scale_pool;
 static int         encoded_frames;
+static int         shown_frames;
+static int         encoded_bytes;
+static int         encode_time_sum;   // microseconds in the encoder
 static volatile int frame_ready;
 
+#define OFFLINE_DONE        INT64_MAX
+
+// pacing="offline", the inputs and the output take turns under this
+static pthread_mutex_t offline_mutex = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t  offline_cond  = PTHREAD_COND_INITIALIZER;
+static int64_t         offline_time;    // time of the output frame being made
+
 /* The different ways of decoding and managing data memory. You are not
  * supposed to support all the modes in your application but pick the one most
  * appropriate to your needs. Look for the use of api_mode in this example to
@@ -279,16 +626,32 @@ static codecList audioFormats[] = {
     { NULL, AV_SAMPLE_FMT_S16 }
 };
 
-static const char *controlStrings[] = { "verbose", "save_input", "save_output", NULL };
+static const char *controlStrings[] = { "verbose", "save_input", "save_output", "benchmark", NULL };
 #define NUMBER_OF_CONTROLS  (sizeof(controlStrings)/sizeof(char *))
 
 enum { MODE_THUMBNAIL };
-static const char *mosaicsStrings[] = { "size", "url", "frame_count", "video_bitrate", "video_framerate", "gop_size", "x264_preset", "audio_bitrate", "x264_threads", "border", "video_encoding", "audio_encoding", "fill_colour", "mode", "final_size", "tiles_across", "tiles_down", NULL };
+#define MODE_MAPPED         (-3)    // "M", every input feeds its own tile
+enum { CAPTION_NAME = 1, CAPTION_TIME = 2 };
+static const char *mosaicsStrings[] = { "size", "url", "frame_count", "video_bitrate", "video_framerate", "gop_size", "x264_preset", "audio_bitrate", "x264_threads", "border", "video_encoding", "audio_encoding", "fill_colour", "mode", "final_size", "tiles_across", "tiles_down", "caption", "caption_size", "diagnostics", "frame_hold", "pacing", "roi_offset", "profile", "slices", "ring_slots", NULL };
 #define NUMBER_OF_MOSAICS   (sizeof(mosaicsStrings)/sizeof(char *))
-static const char *tileStrings[]    = { "position", "fixed", "map", "audio", "frames", "vu_meter", "index", "clock", "analog", "named", "popup", NULL };
+static const char *tileStrings[]    = { "position", "fixed", "map", "audio", "frames", "vu_meter", "index", "clock", "analog", "named", "popup", "z", NULL };
 #define NUMBER_OF_TILES     (sizeof(tileStrings)/sizeof(char *))
-static const char *streamStrings[]  = { "name", "url", "adult", "skip", "artist", "album", "year", "fps", NULL };
+static const char *overlayStrings[] = { "file", "position", NULL };
+#define NUMBER_OF_OVERLAYS  (sizeof(overlayStrings)/sizeof(char *))
+static const char *renditionStrings[] = { "size", "url", "video_bitrate", "x264_preset", NULL };
+#define NUMBER_OF_RENDITIONS    (sizeof(renditionStrings)/sizeof(char *))
+static const char *sinkStrings[] = { "url", "format", "queue", "segment", "keep", NULL };
+#define NUMBER_OF_SINKS     (sizeof(sinkStrings)/sizeof(char *))
+static const char *streamStrings[]  = { "name", "url", "adult", "skip", "artist", "album", "year", "fps", "crop", "deinterlace", NULL };
 #define NUMBER_OF_STREAMS   (sizeof(streamStrings)/sizeof(char *))
+enum { DEINTERLACE_OFF, DEINTERLACE_AUTO, DEINTERLACE_FIELD, DEINTERLACE_BLEND };
+static const char *deinterlaceStrings[] = { "off", "auto", "field", "blend", NULL };
+enum { HOLD_ENCODE, HOLD_REPEAT, HOLD_VFR };
+static const char *holdStrings[] = { "encode", "repeat", "vfr", NULL };
+enum { PACING_FRAMES, PACING_LIVE, PACING_OFFLINE };
+static const char *pacingStrings[] = { "frames", "live", "offline", NULL };
+enum { PROFILE_DEFAULT, PROFILE_THROUGHPUT, PROFILE_LOW_LATENCY, PROFILE_ARCHIVE, PROFILES };
+static const char *profileStrings[] = { "default", "throughput", "low_latency", "archive", NULL };
 
 static void signal_handler( int no )
 {
@@ -395,6 +758,10 @@ static void print_element_names(xmlNode * a_node, char *xmlUrl, int level)
 //                                outputSettings.save_output = atoi( values);
                                     break;
 
+                                case 3:
+                                    benchmark = atoi( (char *)values->content);
+                                    break;
+
                                 default:
                                     printf( "Control->%s\n", attr->name);
                                     break;
@@ -436,7 +803,7 @@ static void print_element_names(xmlNode * a_node, char *xmlUrl, int level)
                 case LEVEL_OUTPUT:
                     if( !strcmp( (char *)cur_node->name, "mosaic")) {
                     xmlAttr *attr;
-                    char *vals[NUMBER_OF_MOSAICS] = { NULL, NULL, "1", NULL, NULL, NULL, NULL, NULL, "auto", "0", "H264", "AAC", "#" YCrCb_BLACK_S, "A", NULL, "3", "3"};
+                    char *vals[NUMBER_OF_MOSAICS] = { NULL, NULL, "1", NULL, NULL, NULL, NULL, NULL, "auto", "0", "H264", "AAC", "#" YCrCb_BLACK_S, "A", NULL, "3", "3", "", "normal", "0", "encode", "frames", "0", "default", "0", "4"};
                     int mask = 0;
 
                         // defaults
@@ -470,6 +837,9 @@ static void print_element_names(xmlNode * a_node, char *xmlUrl, int level)
                             if( sscanf( vals[0], "%d,%d", &outputSettings->screen_width, &outputSettings->screen_height)==2) {
                             char codecFormat[64];
 
+                                outputSettings->layout_width  = outputSettings->screen_width;
+                                outputSettings->layout_height = outputSettings->screen_height;
+
                                 outputSettings->filename               = strdup( vals[1]);
                                 outputSettings->frames_count           = atoi( vals[2]);    if( !outputSettings->frames_count) outputSettings->frames_count++;
                                 outputSettings->video_bitrate          = atoi( vals[3]);
@@ -502,6 +872,9 @@ static void print_element_names(xmlNode * a_node, char *xmlUrl, int level)
                                     else if( vals[13][0]=='K') {
                                         outputSettings->mode = -2;
                                     }
+                                    else if( vals[13][0]=='M') {
+                                        outputSettings->mode = MODE_MAPPED;
+                                    }
                                     else if( isdigit( vals[13][0])) {
                                         outputSettings->mode = atoi( vals[13]);
                                         if( !outputSettings->mode)
@@ -531,6 +904,16 @@ static void print_element_names(xmlNode * a_node, char *xmlUrl, int level)
                                     }
                                     outputSettings->tiles_across = atoi( vals[15]);
                                     outputSettings->tiles_down = atoi( vals[16]);
+                                    outputSettings->caption  = strstr( vals[17], "name") ? CAPTION_NAME : 0;
+                                    outputSettings->caption |= strstr( vals[17], "time") ? CAPTION_TIME : 0;
+                                    outputSettings->caption_size = glyph_size_from_name( vals[18]);
+                                    outputSettings->diagnostics  = atoi( vals[19]);
+                                    outputSettings->frame_hold   = FFMAX( localFindString( vals[20], holdStrings), HOLD_ENCODE);
+                                    outputSettings->pacing       = FFMAX( localFindString( vals[21], pacingStrings), PACING_FRAMES);
+                                    outputSettings->roi_offset   = av_clip( atoi( vals[22]), 0, 51);
+                                    outputSettings->profile      = FFMAX( localFindString( vals[23], profileStrings), PROFILE_DEFAULT);
+                                    outputSettings->slice_rows   = !strcmp( vals[24], "rows");
+                                    outputSettings->ring_slots   = av_clip( atoi( vals[25]), 2, CANVAS_RING_MAX_SLOTS);
                                     if( verbose) {
                                         printf( "%4d,%4d '%s' %5d %5d %2d %2d '%s' %5d %5d %s\n", outputSettings->screen_width, outputSettings->screen_height,
                                             outputSettings->filename, outputSettings->frames_count, outputSettings->video_bitrate,
@@ -618,7 +1001,7 @@ static void print_element_names(xmlNode * a_node, char *xmlUrl, int level)
 #endif
                     else if( !strcmp( (char *)cur_node->name, "tile")) {
                     xmlAttr *attr;
-                    char *vals[NUMBER_OF_TILES] = { NULL, "0", NULL, "0", "K", "0", "0", "0", "0", NULL, NULL };
+                    char *vals[NUMBER_OF_TILES] = { NULL, "0", NULL, "0", "K", "0", "0", "0", "0", NULL, NULL, NULL };
                     int mask = 0;
 
                         attr = cur_node->properties;
@@ -657,6 +1040,16 @@ static void print_element_names(xmlNode * a_node, char *xmlUrl, int level)
                                         outputSettings->tile_map[ outputSettings->tiles_count]          = atoi( vals[2]);
                                         outputSettings->tiles[ outputSettings->tiles_count]->want_audio = atoi( vals[3]);
                                         outputSettings->tiles[ outputSettings->tiles_count]->frames     =       vals[4][0];
+                                        outputSettings->tiles[ outputSettings->tiles_count]->vu_meter   = atoi( vals[5]);
+                                        outputSettings->tiles[ outputSettings->tiles_count]->clock      = atoi( vals[7]);
+                                        outputSettings->tiles[ outputSettings->tiles_count]->analog     = atoi( vals[8]);
+                                        outputSettings->tiles[ outputSettings->tiles_count]->named      = vals[9] ? strdup( vals[9]) : NULL;
+                                        outputSettings->tiles[ outputSettings->tiles_count]->popup      = vals[10]!=NULL;
+                                        outputSettings->tiles[ outputSettings->tiles_count]->pop_start  = popstart;
+                                        outputSettings->tiles[ outputSettings->tiles_count]->pop_length = poplength;
+                                        // popups go over everything else unless told otherwise
+                                        outputSettings->tiles[ outputSettings->tiles_count]->z          = vals[11] ? atoi( vals[11]) : (vals[10] ? 1000 : 0);
+                                        outputSettings->tiles[ outputSettings->tiles_count]->index      = outputSettings->tiles_count;
                                         outputSettings->tiles_count++;
                                     }
                                 }
@@ -669,6 +1062,132 @@ static void print_element_names(xmlNode * a_node, char *xmlUrl, int level)
                             printf( "tile:%d '%s' '%s' '%s'\n", mask, vals[0], vals[1], vals[2]);
                         }
                     }
+                    else if( !strcmp( (char *)cur_node->name, "overlay")) {
+                    xmlAttr *attr;
+                    char *vals[NUMBER_OF_OVERLAYS] = { NULL, NULL };
+                    int mask = 0;
+
+                        attr = cur_node->properties;
+                        while( attr) {
+                        xmlNode *values = attr->children;
+                        int index = localFindString( (char *)attr->name, overlayStrings);
+
+                            if( index>-1) {
+                                vals[index] = (char *)values->content;
+                                mask |= (1<<index);
+                            }
+                            else {
+                                printf( "overlay->%s\n", attr->name);
+                            }
+                            attr = attr->next;
+                        }
+                        if( mask==1+2 && outputMosaicsCnt) {
+                        OutputInfo *outputSettings = outputMosaics[outputMosaicsCnt-1];
+                        Overlay overlay;
+
+                            memset( &overlay, 0, sizeof( overlay));
+                            if( sscanf( vals[1], "%d,%d,%d,%d", &overlay.x, &overlay.y, &overlay.w, &overlay.h)>=2 && overlay.x>=0 && overlay.y>=0) {
+                            Overlay *overlays = realloc( outputSettings->overlays, (outputSettings->overlays_count+1)*sizeof( Overlay));
+
+                                if( overlays) {
+                                    overlay.filename = strdup( vals[0]);
+                                    outputSettings->overlays = overlays;
+                                    outputSettings->overlays[ outputSettings->overlays_count++] = overlay;
+                                }
+                            }
+                            else {
+                                printf( "-->error %s\n", vals[1]);
+                            }
+                        }
+                        else {
+                            printf( "overlay:%d '%s' '%s'\n", mask, vals[0], vals[1]);
+                        }
+                    }
+                    else if( !strcmp( (char *)cur_node->name, "rendition")) {
+                    xmlAttr *attr;
+                    char *vals[NUMBER_OF_RENDITIONS] = { NULL, NULL, NULL, NULL };
+                    int mask = 0;
+
+                        attr = cur_node->properties;
+                        while( attr) {
+                        xmlNode *values = attr->children;
+                        int index = localFindString( (char *)attr->name, renditionStrings);
+
+                            if( index>-1) {
+                                vals[index] = (char *)values->content;
+                                mask |= (1<<index);
+                            }
+                            else {
+                                printf( "rendition->%s\n", attr->name);
+                            }
+                            attr = attr->next;
+                        }
+                        if( (mask&(1+2+4))==1+2+4 && outputMosaicsCnt) {
+                        OutputInfo *outputSettings = outputMosaics[outputMosaicsCnt-1];
+                        Rendition rung;
+
+                            memset( &rung, 0, sizeof( rung));
+                            if( sscanf( vals[0], "%d,%d", &rung.width, &rung.height)==2 && rung.width>=16 && rung.height>=16) {
+                            Rendition *renditions = realloc( outputSettings->renditions, (outputSettings->renditions_count+1)*sizeof( Rendition));
+
+                                if( renditions) {
+                                    rung.width         &= ~1;
+                                    rung.height        &= ~1;
+                                    rung.filename       = strdup( vals[1]);
+                                    rung.video_bitrate  = atoi( vals[2]);
+                                    rung.x264_preset    = vals[3] ? strdup( vals[3]) : NULL;
+                                    outputSettings->renditions = renditions;
+                                    outputSettings->renditions[ outputSettings->renditions_count++] = rung;
+                                }
+                            }
+                            else {
+                                printf( "-->error %s\n", vals[0]);
+                            }
+                        }
+                        else {
+                            printf( "rendition:%d '%s' '%s' '%s'\n", mask, vals[0], vals[1], vals[2]);
+                        }
+                    }
+                    else if( !strcmp( (char *)cur_node->name, "sink")) {
+                    xmlAttr *attr;
+                    char *vals[NUMBER_OF_SINKS] = { NULL, NULL, NULL, "0", "10" };
+                    int mask = 0;
+
+                        attr = cur_node->properties;
+                        while( attr) {
+                        xmlNode *values = attr->children;
+                        int index = localFindString( (char *)attr->name, sinkStrings);
+
+                            if( index>-1) {
+                                vals[index] = (char *)values->content;
+                                mask |= (1<<index);
+                            }
+                            else {
+                                printf( "sink->%s\n", attr->name);
+                            }
+                            attr = attr->next;
+                        }
+                        if( (mask&1) && outputMosaicsCnt) {
+                        OutputInfo *outputSettings = outputMosaics[outputMosaicsCnt-1];
+                        Sink *sinks = realloc( outputSettings->sinks, (outputSettings->sinks_count+1)*sizeof( Sink));
+
+                            if( sinks) {
+                            Sink *sink = &sinks[ outputSettings->sinks_count];
+
+                                memset( sink, 0, sizeof( Sink));
+                                sink->url        = strdup( vals[0]);
+                                sink->format     = vals[1] ? strdup( vals[1]) : NULL;
+                                sink->queue_size = vals[2] ? FFMAX( atoi( vals[2]), 2) : 0;
+                                sink->segment    = FFMAX( atoi( vals[3]), 0);
+                                sink->keep       = FFMAX( atoi( vals[4]), 1);
+                                outputSettings->sinks = sinks;
+                                outputSettings->sinks_count++;
+                            }
+                        }
+                        else {
+                            printf( "sink:%d '%s'\n", mask, vals[0]);
+                        }
+                    }
                     else {
                         printf( "output:%s\n", cur_node->name);
                     }
@@ -677,7 +1196,7 @@ static void print_element_names(xmlNode * a_node, char *xmlUrl, int level)
                 case LEVEL_INPUTS:
                     if( !strcmp( (char *)cur_node->name, "stream")) {
                     xmlAttr *attr;
-                    char *vals[NUMBER_OF_STREAMS] = { NULL, NULL, "0", "0", "", "", "", "25.00" };
+                    char *vals[NUMBER_OF_STREAMS] = { NULL, NULL, "0", "0", "", "", "", "25.00", NULL, "auto" };
                     int mask = 0;
 
                         attr = cur_node->properties;
@@ -729,6 +1248,19 @@ static void print_element_names(xmlNode * a_node, char *xmlUrl, int level)
                             inputs[ inputs_count]->album        = NULL;
                             inputs[ inputs_count]->year         = 2015;
                             inputs[ inputs_count]->fps          = atof( vals[7]);
+                            inputs[ inputs_count]->deinterlace  = FFMAX( localFindString( vals[9], deinterlaceStrings), DEINTERLACE_OFF);
+                            if( vals[8] && !strcmp( vals[8], "auto")) {
+                                inputs[ inputs_count]->crop_auto = 1;
+                            }
+                            else if( vals[8] && (sscanf( vals[8], "%d,%d,%d,%d", &inputs[ inputs_count]->crop_x, &inputs[ inputs_count]->crop_y,
+                                                     &inputs[ inputs_count]->crop_w, &inputs[ inputs_count]->crop_h)!=4 ||
+                                                 (inputs[ inputs_count]->crop_x|inputs[ inputs_count]->crop_y|
+                                                  inputs[ inputs_count]->crop_w|inputs[ inputs_count]->crop_h)<0)) {
+                                // a negative crop would have the scaler read outside the picture
+                                printf( "-->error %s\n", vals[8]);
+                                inputs[ inputs_count]->crop_x = inputs[ inputs_count]->crop_y = 0;
+                                inputs[ inputs_count]->crop_w = inputs[ inputs_count]->crop_h = 0;
+                            }
                             if( verbose) {
                                 printf( "%d. '%s' '%s A:%d\n", inputs_count, inputs[ inputs_count]->name,
                                     inputs[ inputs_count]->src_filename, inputs[ inputs_count]->adult);
@@ -753,181 +1285,25 @@ static void print_element_names(xmlNode * a_node, char *xmlUrl, int level)
 }
 #endif
 
-static void localClearTile( Tiles *tile, int colour, AVFrame *pict)
-{
-int y;
-uint8_t *Y  = pict->data[0] + tile->x     + (tile->y*pict->linesize[0]);
-uint8_t *Cr = pict->data[1] + (tile->x/2) + ((tile->y/2)*pict->linesize[1]);
-uint8_t *Cb = pict->data[2] + (tile->x/2) + ((tile->y/2)*pict->linesize[2]);
-
-    for( y=0; y<tile->h; ) {
-        memset( Y, colour>>16, tile->w);
-        memset( Cr, colour>>8, tile->w/2);
-        memset( Cb, colour,    tile->w/2);
-        Y  += pict->linesize[0];
-        y++;
-        if( !(y&1)) {
-            Cr += pict->linesize[1];
-            Cb += pict->linesize[2];
-        }
-    }
-}
-
-static void localClearArea( Tiles *tile, int x0, int y0, int w0, int h0, int colour, AVFrame *pict)
+/* Fill a rectangle of a 4:2:0 picture, colour is packed as Y Cb Cr */
+static void localFillRect( AVFrame *pict, int x, int y, int w, int h, int colour)
 {
-int y;
-//uint8_t *Y  = pict->data[0] + x0 + tile->x + ((tile->y+y0)*pict->linesize[0]);
-//uint8_t *Cr = pict->data[1] + (x0+tile->x)/2 + (((tile->y+y0)/2)*pict->linesize[1]);
-//uint8_t *Cb = pict->data[2] + (x0+tile->x)/2 + (((tile->y+y0)/2)*pict->linesize[2]);
-uint8_t *Y  = pict->data[0] + x0 + tile->x + ((tile->y+y0)*pict->linesize[0]);
-uint8_t *Cr = pict->data[1] + (x0+tile->x)/2 + (((tile->y+y0)/2)*pict->linesize[1]);
-uint8_t *Cb = pict->data[2] + (x0+tile->x)/2 + (((tile->y+y0)/2)*pict->linesize[2]);
+int cy = y>>1;
+int ch = ((y+h+1)>>1) - cy;
 
-    for( y=0; y<h0; ) {
-        memset( Y, colour>>16, w0);
-        memset( Cr, colour>>8, w0/2);
-        memset( Cb, colour,    w0/2);
-        y++;
-        Y += pict->linesize[0];
-        if( !(y&1)) {
-            Cr += pict->linesize[1];
-            Cb += pict->linesize[2];
-        }
-    }
+    simd.fill( pict->data[0] + x   + (y*pict->linesize[0]),  pict->linesize[0], w,   h,  colour>>16);
+    simd.fill( pict->data[1] + x/2 + (cy*pict->linesize[1]), pict->linesize[1], w/2, ch, colour>>8);
+    simd.fill( pict->data[2] + x/2 + (cy*pict->linesize[2]), pict->linesize[2], w/2, ch, colour);
 }
 
-static void localDrawString( Tiles *tile, int x0, int y0, const char *string, int colour, AVFrame *pict)
+static void localClearTile( Tiles *tile, int colour, AVFrame *pict)
 {
-uint8_t *Y, *Cr, *Cb;
-int  height = (anonymousPro_9ptDescriptors[1].offset - anonymousPro_9ptDescriptors[0].offset)+1;
-int bw = 0;
-int bh = 0;
-
-    if( !string)
-        return;
-
-    if( x0<0) {
-    const char *s = string;
-    int w = 0;
-
-        while( *s) {
-        int off = *s;
-        int width = 0;
-
-            if(off>=anonymousPro_9ptFontInfo.start_character && off<=anonymousPro_9ptFontInfo.end_character) {
-                off -= anonymousPro_9ptFontInfo.start_character;
-                width = anonymousPro_9ptDescriptors[off].width;
-            }
-            w += width+2;
-            s++;
-        }
-        if( x0==-1) {
-            x0 = (tile->w-w)/2;
-        }
-        else if( x0==-2) {
-            x0 = 0;
-            bw = w;
-        }
-    }
-    if( y0==-1) {
-        y0 = (tile->h-height)/2;
-    }
-    else if( y0==-2) {
-        y0 = 0;
-        bh = height;
-    }
-    if( bh && bw) {
-        localClearArea( tile, x0, y0, bw, bh, YCrCb_GREY /*YCrCb_BLACK*/, pict);
-    }
-    Y  = pict->data[0] + ((y0+tile->y)/1*pict->linesize[0]);
-    Cr = pict->data[1] + ((y0+tile->y)/2*pict->linesize[1]);
-    Cb = pict->data[2] + ((y0+tile->y)/2*pict->linesize[2]);
-    while( *string) {
-    int off = *string++;
-    int width = 0;
-    uint8_t *_Y  = Y;
-    uint8_t *_Cr = Cr;
-    uint8_t *_Cb = Cb;
-
-        if(off>=anonymousPro_9ptFontInfo.start_character && off<=anonymousPro_9ptFontInfo.end_character) {
-        const uint8_t *data = anonymousPro_9ptBitmaps+anonymousPro_9ptDescriptors[off-anonymousPro_9ptFontInfo.start_character].offset;
-        int h = height;
-        int yy = 0;
-
-            width = anonymousPro_9ptDescriptors[off-anonymousPro_9ptFontInfo.start_character].width;
-            while( h--) {
-            int w = width;
-            short mask = *data++<<8;
-            int pos = tile->x+x0;
-
-                if(w>7) {
-                     mask |= *data++;
-                }
-                while( w) {
-                    if( mask & 0x8000) {
-                        _Y[pos]    = colour>>16;
-                        _Cr[pos/2] = colour>>8;
-                        _Cb[pos/2] = colour;
-                    }
-                    mask <<= 1;
-                    pos++;
-                    w--;
-                }
-                _Y   += pict->linesize[0];
-                yy++;
-                if( !(yy&1)) {
-                    _Cr  += pict->linesize[1];
-                    _Cb  += pict->linesize[2];
-                }
-            }
-        }
-        x0  += width+2;
-    }
+    localFillRect( pict, tile->x, tile->y, tile->w, tile->h, colour);
 }
 
-static void localBlockFill( Tiles *tile, int width, int colour)
+static void localClearArea( Tiles *tile, int x0, int y0, int w0, int h0, int colour, AVFrame *pict)
 {
-int y;
-uint8_t *Y   = tile->video_dst_data[0];
-uint8_t *Y1  = tile->video_dst_data[0] + ((tile->h-width)*tile->video_dst_linesize[0]);
-uint8_t *Cr  = tile->video_dst_data[1];
-uint8_t *Cr1 = tile->video_dst_data[1] + ((tile->h-width)/2*tile->video_dst_linesize[1]);
-uint8_t *Cb  = tile->video_dst_data[2];
-uint8_t *Cb1 = tile->video_dst_data[2] + ((tile->h-width)/2*tile->video_dst_linesize[2]);
-
-    for( y=0; y<width; y++) {
-        memset( Y, colour>>16, tile->w);
-        Y += tile->video_dst_linesize[0];
-        memset( Y1, colour>>16, tile->w);
-        Y1 += tile->video_dst_linesize[0];
-    }
-    for( y=0; y<width/2; y++) {
-        memset( Cr, colour>>8, tile->w/2);
-        Cr += tile->video_dst_linesize[1];
-        memset( Cr1, colour>>8, tile->w/2);
-        Cr1 += tile->video_dst_linesize[1];
-        memset( Cb, colour, tile->w/2);
-        Cb += tile->video_dst_linesize[2];
-        memset( Cb1, colour, tile->w/2);
-        Cb1 += tile->video_dst_linesize[2];
-    }
-
-    Y = tile->video_dst_data[0];
-    Cr = tile->video_dst_data[1];
-    Cb = tile->video_dst_data[2];
-    for( y=0; y<tile->h; y++) {
-        memset( Y, colour>>16, width);
-//        memset( Y + tile->w - width, colour>>16, width);
-        Y += tile->video_dst_linesize[0];
-    }
-    for( y=0; y<tile->h/2; y++) {
-        memset( Cr, colour>>8, width/2);
-//        memset( Cr + (tile->w - width)/2, colour>>8, width);
-        Cr += tile->video_dst_linesize[1];
-        memset( Cb, colour, width/2);
-//        memset( Cb + (tile->w - width)/2, colour, width);
-        Cb += tile->video_dst_linesize[2];
-    }
+    localFillRect( pict, tile->x+x0, tile->y+y0, w0, h0, colour);
 }
 
 static int localNumberOfPackets( inputMosaic *inputSource, const int index)
@@ -946,12 +1322,12 @@ int cnt = 0;
     return cnt;
 }
 
-static int localClearPackets( inputMosaic *inputSource, const int index)
+static int localClearPackets( inputMosaic *inputSource, const int index, int most)
 {
 int cnt = 0;
 
     pthread_mutex_lock( &inputSource->list_mutex);
-    while( inputSource->packets_list[index]) {
+    while( inputSource->packets_list[index] && cnt<most) {
     videoFrames *here = inputSource->packets_list[index];
 
         inputSource->packets_list[index] = here->next;
@@ -971,989 +1347,4255 @@ int cnt = 0;
 #define TIMEOFDAY(X)    ((X.tv_sec * 1000000) + X.tv_usec)
 #define TIMEOFDAY_S     (1000000)
 
-static void *inputThreadVideo( void *_whichSource)
+static int64_t localTimeNow( void)
 {
-GET_OUTPUT_SETTINGS;
-inputMosaic *inputSource = _whichSource;
-int skip = inputSource->skip_frames;
-int sw = -1, sh = -1;
+struct timeval now;
 
-    while( FULL_TASK_RUN) {
-    int cnt = localNumberOfPackets( inputSource, VIDEO_INDEX);
+    gettimeofday( &now, NULL);
 
-        if( frame_ready) {
-            usleep(100);
-        } 
-        else if( cnt) { // >inputSource->video_dec_ctx->delay) {
-            if( skip) {
-            int ret = localClearPackets( inputSource, VIDEO_INDEX);
+    return TIMEOFDAY( now);
+}
 
-                skip -= FFMIN( skip, ret);
-            }
-            else {
-            videoFrames *here;
-            AVFrame *frame;
-            int t;
+// Waits are woken by every change, the timeout is only there to notice stop_all_tasks
+static void localCondWait( pthread_cond_t *cond, pthread_mutex_t *mutex)
+{
+struct timespec until;
 
-                pthread_mutex_lock( &inputSource->list_mutex);
-                here  = inputSource->packets_list[VIDEO_INDEX];
-                inputSource->packets_list[VIDEO_INDEX] = here->next;
-                frame = here->frame;
-                pthread_mutex_unlock( &inputSource->list_mutex);
+    clock_gettime( CLOCK_REALTIME, &until);
+    until.tv_nsec += 100000000;
+    if( until.tv_nsec>=1000000000) {
+        until.tv_sec++;
+        until.tv_nsec -= 1000000000;
+    }
+    pthread_cond_timedwait( cond, mutex, &until);
+}
 
-                if (frame->key_frame) {
-                    if (verbose) {
-                        printf("%s video_frame n:%d coded_n:%d pts:%s %f %c\n",
-                               inputSource->name, inputSource->video_frame_count, frame->display_picture_number,
-                                av_ts2timestr(frame->pts, &inputSource->video_dec_ctx->time_base), here->pts,
-                                frame->key_frame ? 'K':' ');
-                    }
-                }
+// Same units as localTimeNow, but never steps when the wall clock is set
+static int64_t localMonotonicNow( void)
+{
+struct timespec now;
 
-                pthread_mutex_lock( &outputSettings->buffer_mutex);
-                for(t=0; t<MAX_TILES_PER_INPUT; t++) {
-                Tiles *tile = outputSettings->tiles[outputSettings->thumbnail_count];
-		        static int frame_counter = 0;
-                int add;
-
-                    add  = (outputSettings->mode==-1);
-                    add |= (outputSettings->mode==-2 && frame->key_frame);
-                    add |= (outputSettings->mode>0 && ++frame_counter>=outputSettings->mode);
-                    if( add) {
-                        frame_counter = 0;
-                        if( inputSource->running) {
-                            if( sw!=tile->w || sh!=tile->h) {
-                                sw = tile->w;
-                                sh = tile->h;
-                                sws_freeContext(inputSource->scale_sws_ctx[t]);
-                                inputSource->scale_sws_ctx[t] = NULL;
-                            }
-                            if( !inputSource->scale_sws_ctx[t]) {
-                                if( verbose) {
-                                    printf( "%d:%d '%s' needed scale from %dx%d to %dx%d, type %d\n", t, inputSource->tile_number[t], inputSource->name, 
-                                        inputSource->video_dec_ctx->width, inputSource->video_dec_ctx->height, tile->w, tile->h, inputSource->video_dec_ctx->pix_fmt);
-                                    fflush( stdout);
-                                }
+    clock_gettime( CLOCK_MONOTONIC, &now);
 
-                                /* create scaling context */
-                                inputSource->scale_sws_ctx[t] = sws_getContext(inputSource->video_dec_ctx->width, inputSource->video_dec_ctx->height, inputSource->video_dec_ctx->pix_fmt,
-                                                     tile->w, tile->h, STREAM_PIX_FMT, SCALE_FLAGS, NULL, NULL, NULL);
-                                if (!inputSource->scale_sws_ctx[t]) {
-                                    fprintf(stderr,
-                                            "Impossible to create scale context for the conversion "
-                                            "fmt:%s s:%dx%d -> fmt:%s s:%dx%d\n",
-                                            av_get_pix_fmt_name(inputSource->video_dec_ctx->pix_fmt), inputSource->video_dec_ctx->width, inputSource->video_dec_ctx->height,
-                                            av_get_pix_fmt_name(STREAM_PIX_FMT), tile->w, tile->h);
-                                    goto end;
-                                }
-                            }
+    return (int64_t)now.tv_sec*TIMEOFDAY_S + now.tv_nsec/1000;
+}
 
-                            sws_scale(inputSource->scale_sws_ctx[t],
-                                (const uint8_t * const*)frame->data, frame->linesize, 0,
-                                inputSource->video_dec_ctx->height, tile->video_dst_data, tile->video_dst_linesize);
+/*
+ * What an interlaced picture gets: "auto" reads one field of every picture
+ * flagged interlaced, "blend" blends the fields of those, "field" reads one
+ * field of everything (for sources that do not flag it).
+ */
+static int localDeinterlaceMode( inputMosaic *inputSource, AVFrame *frame)
+{
+static const char *said[] = { "progressive", NULL, "interlaced, reading one field", "interlaced, blending the fields" };
+int mode = inputSource->deinterlace;
+
+    if( mode!=DEINTERLACE_FIELD) {
+        if( !frame->interlaced_frame || mode==DEINTERLACE_OFF)
+            mode = DEINTERLACE_OFF;
+        else if( mode==DEINTERLACE_AUTO)
+            mode = DEINTERLACE_FIELD;
+    }
+    if( mode!=inputSource->interlaced) {
+        printf( "%s: %s\n", inputSource->name, said[mode]);
+        inputSource->interlaced = mode;
+    }
 
-                            tile->video_dst_dirty++;
-                            tile->updates_per_second++;
-                            if( ++outputSettings->thumbnail_count==outputSettings->tiles_count) {
-                                outputSettings->thumbnail_count = 0;
-                                frame_ready = outputSettings->frames_count;
-                            }
-                        }
-                        else {
-                            localBlockFill( tile, 4, YCrCb_WHITE);
-                        }
-                    }
-            	}
-end:;
-                pthread_mutex_unlock( &outputSettings->buffer_mutex);
-#if !API_MODE
-                avcodec_free_frame(&here->frame);
-#else
-                av_frame_free(&here->frame);
-#endif
-                free( here);
-            }
-        }
-        else {
-            usleep(1000);
-        }
+    return mode;
+}
+
+/*
+ * One field, the top one, is every other line: the planes stay where they
+ * are and the scaler is given twice the line size and half the height.
+ */
+static void localFieldPlanes( int linesize[4], int *ch)
+{
+int p;
+
+    for( p=0; p<4; p++) {
+        linesize[p] *= 2;
     }
+    *ch = (*ch/2)&~1;
+}
 
-    return NULL;
+/*
+ * Full height deinterlace for comparison with reading one field, each
+ * plane is run through the 1-2-1 line filter into a buffer kept by the
+ * input. Only 8 bit planar YUV, returns 0 (nothing done) for the rest.
+ */
+static int localBlendFields( inputMosaic *inputSource, int format, const uint8_t *data[4], int linesize[4], int cw, int ch)
+{
+const AVPixFmtDescriptor *desc = av_pix_fmt_desc_get( format);
+int p;
+
+    if( !desc || !(desc->flags & AV_PIX_FMT_FLAG_PLANAR) || (desc->flags & AV_PIX_FMT_FLAG_RGB) || desc->comp[0].depth!=8)
+        return 0;
+    if( cw!=inputSource->blend_w || ch!=inputSource->blend_h || format!=inputSource->blend_format) {
+        av_freep( &inputSource->blend_data[0]);
+        inputSource->blend_w = 0;
+        if( av_image_alloc( inputSource->blend_data, inputSource->blend_linesize, cw, ch, format, 32)<0)
+            return 0;
+        inputSource->blend_w      = cw;
+        inputSource->blend_h      = ch;
+        inputSource->blend_format = format;
+    }
+    for( p=0; p<4 && data[p]; p++) {
+    int chroma = (p==1 || p==2);
+    int w = chroma ? (cw+(1<<desc->log2_chroma_w)-1)>>desc->log2_chroma_w : cw;
+    int h = chroma ? (ch+(1<<desc->log2_chroma_h)-1)>>desc->log2_chroma_h : ch;
+
+        simd.line_blend( inputSource->blend_data[p], inputSource->blend_linesize[p], data[p], linesize[p], w, h);
+        data[p]     = inputSource->blend_data[p];
+        linesize[p] = inputSource->blend_linesize[p];
+    }
+
+    return 1;
 }
 
-static int decode_packet(int *got_frame, int cached, inputMosaic *inputSource)
+/*
+ * The part of the decoded frame that goes into the tiles. The crop is
+ * clipped to the frame and kept on even coordinates so that it lines
+ * up with the 4:2:0 chroma.
+ */
+static void localGetCrop( inputMosaic *inputSource, AVFrame *frame, int *x, int *y, int *w, int *h)
 {
-    int decoded = inputSource->pkt.size;
-    AVFrame *frame;
-    int index = MAX_INDEX;
+int cx = inputSource->crop_x;
+int cy = inputSource->crop_y;
+int cw = inputSource->crop_w;
+int ch = inputSource->crop_h;
+
+    if( inputSource->auto_w>0 && inputSource->auto_h>0) {
+        cx = inputSource->auto_x;
+        cy = inputSource->auto_y;
+        cw = inputSource->auto_w;
+        ch = inputSource->auto_h;
+    }
+    *x = FFMAX( FFMIN( cx&~1, frame->width-2), 0);
+    // reading one field of 4:2:0 the crop has to start on a top field chroma line too
+    *y = FFMAX( FFMIN( cy&(localDeinterlaceMode( inputSource, frame)==DEINTERLACE_FIELD ? ~3 : ~1), frame->height-2), 0);
+    *w = frame->width  - *x;
+    *h = frame->height - *y;
+    if( cw>0 && ch>0) {
+        *w = FFMIN( cw&~1, *w);
+        *h = FFMIN( ch&~1, *h);
+    }
+}
 
-    *got_frame = 0;
+#define CROP_BLACK          32                  // mean luma of a bar line, video black is 16
+#define CROP_SAMPLES        5                   // frames looked at in a round
+#define CROP_SPACING        12                  // frames between them
+#define CROP_REVALIDATE     (10*TIMEOFDAY_S)    // between rounds
 
-#if !API_MODE
-    frame = avcodec_alloc_frame();
-#else
-    frame = av_frame_alloc();
-#endif
+/* Every 4th pixel along a line of count pixels, step bytes apart, is black on average */
+static int localDarkLine( const uint8_t *line, int step, int count)
+{
+int sum = 0;
+int n = 0;
+int i;
 
-    if (inputSource->pkt.stream_index == inputSource->video_stream_idx) {
-    int ret = avcodec_decode_video2(inputSource->video_dec_ctx, frame, got_frame, &inputSource->pkt);
+    for( i=0; i<count; i+=4) {
+        sum += line[i*step];
+        n++;
+    }
 
-        /* decode video frame */
-        if (ret < 0) {
-            fprintf(stderr, "Error decoding video frame (%s)\n", av_err2str(ret));
-            return ret;
-        }
-        index = VIDEO_INDEX;
-    } 
-    if( *got_frame && index<MAX_INDEX) {
-    videoFrames *here;
-    videoFrames *current = calloc( 1, sizeof( videoFrames));
-    double pts;
+    return sum<=CROP_BLACK*n;
+}
 
-        if( (pts = av_frame_get_best_effort_timestamp( frame))==AV_NOPTS_VALUE) {
-            pts = 0;
-        }
-        if( index==VIDEO_INDEX) {
-            pts *= av_q2d(inputSource->video_dec_ctx->time_base);
-        }
-        inputSource->pts[index] = pts;
-//        printf( "--> %s V:%8.2f A:%8.2f\r\n", index ? "Audio":"Video", inputSource->pts[0], inputSource->pts[1]);
+/*
+ * The box around everything in the luma plane that is not a black line.
+ * Returns 0 for a picture that is black all over, or that has no 8 bit
+ * luma plane to look at.
+ */
+static int localFindPicture( AVFrame *frame, int *x0, int *y0, int *x1, int *y1)
+{
+const AVPixFmtDescriptor *desc = av_pix_fmt_desc_get( frame->format);
+const uint8_t *luma = frame->data[0];
+int linesize = frame->linesize[0];
+int top, bottom, left, right;
+
+    if( !desc || !luma || (desc->flags & (AV_PIX_FMT_FLAG_RGB | AV_PIX_FMT_FLAG_PAL | AV_PIX_FMT_FLAG_BITSTREAM)) ||
+        desc->comp[0].depth!=8 || desc->comp[0].step!=1 || desc->comp[0].plane)
+        return 0;
+
+    for( top=0; top<frame->height && localDarkLine( luma+(top*linesize), 1, frame->width); top++);
+    if( top==frame->height)
+        return 0;
+    for( bottom=frame->height; bottom>top && localDarkLine( luma+((bottom-1)*linesize), 1, frame->width); bottom--);
+    for( left=0; left<frame->width && localDarkLine( luma+(top*linesize)+left, linesize, bottom-top); left++);
+    for( right=frame->width; right>left && localDarkLine( luma+(top*linesize)+right-1, linesize, bottom-top); right--);
+
+    *x0 = left;
+    *y0 = top;
+    *x1 = right;
+    *y1 = bottom;
+
+    return 1;
+}
 
-        current->frame = av_frame_clone( frame);
-        current->pts   = pts;
-        current->next  = NULL;
-        pthread_mutex_lock( &inputSource->list_mutex);
-        here = inputSource->packets_list[index];
-#if 0
-        if( !here) {
-            inputSource->packets_list[index] = current;
-        }
-        else {
-            while( here) {
-                if( !here->next) {
-                    here->next = current;
-                    here = NULL;
-                }
-                else {
-                    here = here->next;
-                }
-            }
-        }
-#else
-        if( !here) {
-            inputSource->packets_list[index] = current;
-        }
-        else {
-        videoFrames *last = NULL;
+/*
+ * crop="auto": every CROP_SPACING frames the picture area is found until
+ * CROP_SAMPLES frames have been looked at, the crop is then everything any
+ * of them showed (a dark scene does not crop into the picture). The whole
+ * thing is done again every CROP_REVALIDATE to follow a change of format.
+ */
+static void localDetectCrop( inputMosaic *inputSource, AVFrame *frame, int64_t now)
+{
+int x0, y0, x1, y1;
 
-            while( here) {
-                if( current->pts<here->pts) {
-                    if( !last) {
-                        current->next = here;
-                        inputSource->packets_list[index] = current;
-                    }
-                    else {
-                        current->next = last->next;
-                        last->next = current;
-                    }
-                    goto used;
-                }
-                last = here;
-                here = last->next;
-            }
-            if( !here) {
-                last->next = current;
-            }
-        }
-#endif
-used:   pthread_mutex_unlock( &inputSource->list_mutex);
+    if( !inputSource->crop_auto)
+        return;
+    if( inputSource->detect_at) {
+        if( now<inputSource->detect_at)
+            return;
+        inputSource->detect_at = 0;
     }
-#if !API_MODE
-    avcodec_free_frame(&frame);
-#else
-    av_frame_free(&frame);
-#endif
+    if( inputSource->detect_wait>0) {
+        inputSource->detect_wait--;
+        return;
+    }
+    inputSource->detect_wait = CROP_SPACING;
+    if( !localFindPicture( frame, &x0, &y0, &x1, &y1))
+        return;
 
-    return decoded;
+    if( inputSource->detect_samples++) {
+        x0 = FFMIN( x0, inputSource->detect_x0);
+        y0 = FFMIN( y0, inputSource->detect_y0);
+        x1 = FFMAX( x1, inputSource->detect_x1);
+        y1 = FFMAX( y1, inputSource->detect_y1);
+    }
+    inputSource->detect_x0 = x0;
+    inputSource->detect_y0 = y0;
+    inputSource->detect_x1 = x1;
+    inputSource->detect_y1 = y1;
+    if( inputSource->detect_samples<CROP_SAMPLES)
+        return;
+
+    // in to even lines for the chroma, a pixel of picture lost at most
+    x0 = (x0+1)&~1;
+    y0 = (y0+1)&~1;
+    x1 = x1&~1;
+    y1 = y1&~1;
+    if( x1-x0>=16 && y1-y0>=16 &&
+        (x0!=inputSource->auto_x || y0!=inputSource->auto_y || x1-x0!=inputSource->auto_w || y1-y0!=inputSource->auto_h)) {
+        printf( "%s: crop %dx%d+%d+%d, %d%% of the %dx%d picture was bars\n", inputSource->name, x1-x0, y1-y0, x0, y0,
+                100-(int)((int64_t)(x1-x0)*(y1-y0)*100/(frame->width*frame->height)), frame->width, frame->height);
+        inputSource->auto_x = x0;
+        inputSource->auto_y = y0;
+        inputSource->auto_w = x1-x0;
+        inputSource->auto_h = y1-y0;
+    }
+    inputSource->detect_samples = 0;
+    inputSource->detect_at      = now+CROP_REVALIDATE;
 }
 
-static int open_codec_context(int *stream_idx,
-                              AVFormatContext *fmt_ctx, enum AVMediaType type,
-                              inputMosaic *inputSource)
+/*
+ * Move the plane pointers of a picture to pixel x,y. Works for planar,
+ * semi-planar and packed layouts, x has to be even for subsampled ones.
+ */
+static int localOffsetPlanes( int format, const uint8_t *const in[4], const int linesize[4], int x, int y, const uint8_t *out[4])
 {
-    int ret;
-    AVStream *st;
-    AVCodecContext *dec_ctx = NULL;
-    AVCodec *dec = NULL;
-    AVDictionary *opts = NULL;
+const AVPixFmtDescriptor *desc = av_pix_fmt_desc_get( format);
+int p, c;
 
-    ret = av_find_best_stream(fmt_ctx, type, -1, -1, NULL, 0);
-    if (ret < 0) {
-        fprintf(stderr, "Could not find %s stream in input file '%s'\n",
-                av_get_media_type_string(type), inputSource->src_filename);
-        return ret;
-    } else {
-        *stream_idx = ret;
-        st = fmt_ctx->streams[*stream_idx];
+    for( p=0; p<4; p++) {
+        out[p] = in[p];
+    }
+    if( !desc || (desc->flags & AV_PIX_FMT_FLAG_BITSTREAM))
+        return 0;
 
-        /* find decoder for the stream */
-        dec_ctx = st->codec;
-        dec = avcodec_find_decoder(dec_ctx->codec_id);
-        if (!dec) {
-            fprintf(stderr, "Failed to find %s codec\n",
-                    av_get_media_type_string(type));
-            return AVERROR(EINVAL);
-        }
+    for( p=0; p<4 && in[p]; p++) {
+    int chroma = (p==1 || p==2);
+    int step = 1;
 
-        /* Init the decoders, with or without reference counting */
-#if API_MODE == API_MODE_NEW_API_REF_COUNT
-        av_dict_set(&opts, "refcounted_frames", "1", 0);
-#endif
-        av_dict_set( &opts, "threads", "auto", 0);
-        if ((ret = avcodec_open2(dec_ctx, dec, &opts)) < 0) {
-            fprintf(stderr, "Failed to open %s codec\n",
-                    av_get_media_type_string(type));
-            return ret;
+        for( c=0; c<desc->nb_components; c++) {
+            if( desc->comp[c].plane==p) {
+                step = desc->comp[c].step;
+                break;
+            }
         }
+        out[p] += ((chroma ? y>>desc->log2_chroma_h : y)*linesize[p]) + ((chroma ? x>>desc->log2_chroma_w : x)*step);
     }
 
-    return 0;
+    return 1;
 }
 
-#if 0
-static int get_format_from_sample_fmt(const char **fmt,
-                                      enum AVSampleFormat sample_fmt)
+/*
+ * Integer ratio downscale done with the box filter kernels instead of
+ * swscale, reading only the cropped area. 4:2:2 and 4:4:4 sources are
+ * brought down to 4:2:0 in the same pass by widening the chroma box.
+ * Returns 0 when the geometry does not allow it.
+ */
+static int localBoxScale( int format, const uint8_t *data[4], const int linesize[4], int cw, int ch, Tiles *tile, uint8_t *const dst[4])
 {
-    int i;
-    struct sample_fmt_entry {
-        enum AVSampleFormat sample_fmt; const char *fmt_be, *fmt_le;
-    } sample_fmt_entries[] = {
-        { AV_SAMPLE_FMT_U8,  "u8",    "u8"    },
-        { AV_SAMPLE_FMT_S16, "s16be", "s16le" },
-        { AV_SAMPLE_FMT_S32, "s32be", "s32le" },
-        { AV_SAMPLE_FMT_FLT, "f32be", "f32le" },
-        { AV_SAMPLE_FMT_DBL, "f64be", "f64le" },
-    };
-    *fmt = NULL;
-
-    for (i = 0; i < FF_ARRAY_ELEMS(sample_fmt_entries); i++) {
-        struct sample_fmt_entry *entry = &sample_fmt_entries[i];
-        if (sample_fmt == entry->sample_fmt) {
-            *fmt = AV_NE(entry->fmt_be, entry->fmt_le);
+int fx, fy, cfx, cfy;
+int ssx, ssy;
+
+    switch( format) {
+        case AV_PIX_FMT_YUV420P: ssx = 1; ssy = 1; break;
+        case AV_PIX_FMT_YUV422P: ssx = 1; ssy = 0; break;
+        case AV_PIX_FMT_YUV444P: ssx = 0; ssy = 0; break;
+        default:
             return 0;
-        }
     }
+    if( (tile->w|tile->h)&1 || cw%tile->w || ch%tile->h)
+        return 0;
 
-    fprintf(stderr,
-            "sample format %s is not supported as output format\n",
-            av_get_sample_fmt_name(sample_fmt));
-    return -1;
+    fx  = cw/tile->w;
+    fy  = ch/tile->h;
+    cfx = fx<<(1-ssx);
+    cfy = fy<<(1-ssy);
+    if( cfx>SIMD_BOX_MAX_FACTOR || cfy>SIMD_BOX_MAX_FACTOR)
+        return 0;
+
+    simd.box_downscale( dst[0], tile->video_dst_linesize[0], data[0], linesize[0], tile->w,   tile->h,   fx,  fy);
+    simd.box_downscale( dst[1], tile->video_dst_linesize[1], data[1], linesize[1], tile->w/2, tile->h/2, cfx, cfy);
+    simd.box_downscale( dst[2], tile->video_dst_linesize[2], data[2], linesize[2], tile->w/2, tile->h/2, cfx, cfy);
+
+    return 1;
 }
-#endif
 
-static int interrupt_cb(void *ctx)
+/*
+ * Large tiles are scaled as horizontal slices on the scale pool. A slice
+ * starts and ends on rows where source and tile line up exactly, so every
+ * slice keeps the scale of the whole picture, and it is scaled with enough
+ * rows of its neighbours above and below for the filter taps. Only its own
+ * rows are then copied into the tile, so no seam shows between slices.
+ */
+#define SCALE_SLICE_MIN_PIXELS  (320*240)       // below this the input thread scales on its own
+#define SCALE_SLICE_MIN_ROWS    64
+
+typedef struct _ScaleJob {
+    inputMosaic   *inputSource;
+    int            t;
+    Tiles         *tile;
+    uint8_t       *dst[4];
+    int            format;
+    const uint8_t *data[4];
+    int            linesize[4];
+    int            cw;
+    int            ch;
+    int            slices;
+    int            failed;
+} ScaleJob;
+
+typedef struct _SliceRows {
+    int dy0, dy1;       // tile rows of the slice
+    int fd0, fd1;       // tile rows scaled, with the overlap
+    int fs0, fs1;       // source rows that give them
+} SliceRows;
+
+/*
+ * Smallest step in tile rows (and the source rows it takes) on which the two
+ * line up exactly, even in both and a multiple of 4 source rows so that any
+ * chroma layout of the source splits cleanly.
+ */
+static void localSliceUnit( int dh, int sh, int *unit_d, int *unit_s)
 {
-    inputMosaic *inputSource = ctx;
+int g = (int)av_gcd( dh, sh);
+int p = dh/g, q = sh/g;
+int k;
+
+    for( k=1; (q*k)%4 || (p*k)%2; k++)
+        ;
+    *unit_d = p*k;
+    *unit_s = q*k;
+}
 
-//    printf( "."); fflush(stdout);
+static int localScaleSlices( Tiles *tile, int ch)
+{
+int slices = FFMIN( tile->h, ch)/SCALE_SLICE_MIN_ROWS;
+int unit_d, unit_s;
 
-    if (inputSource->quit || stop_all_tasks)
+    if( tile->w*tile->h<SCALE_SLICE_MIN_PIXELS || !scale_pool)
         return 1;
 
-    return 0;
-} 
+    localSliceUnit( tile->h, ch, &unit_d, &unit_s);
+    slices = FFMIN( slices, tile->h/unit_d);
+    slices = FFMIN( slices, scale_pool->threads+1);
+    slices = FFMIN( slices, SCALE_MAX_SLICES);
 
-static void *inputThread( void *_whichSource)
+    return FFMAX( slices, 1);
+}
+
+static void localSliceRows( int n, int slices, int dh, int sh, SliceRows *rows)
 {
-    inputMosaic *inputSource = _whichSource;
-    int ret = 0, got_frame;
-    AVDictionary *d = NULL;
- //   Tiles *tile = outputSettings->tiles[ inputSource->tile_number&~TILE_MASK];
-    int t;
+int unit_d, unit_s, units, overlap;
+int b0, b1;
+
+    localSliceUnit( dh, sh, &unit_d, &unit_s);
+    units = dh/unit_d;
+    b0    = n*units/slices;
+    b1    = (n+1)*units/slices;
+    // bicubic reaches 2 rows out at the source scale, twice that on chroma
+    overlap = (4*((sh+dh-1)/dh+1)+unit_s-1)/unit_s;
+
+    rows->dy0 = b0*unit_d;
+    rows->dy1 = n+1<slices ? b1*unit_d : dh;
+    rows->fd0 = FFMAX( b0-overlap, 0)*unit_d;
+    rows->fs0 = FFMAX( b0-overlap, 0)*unit_s;
+    if( n+1<slices && b1+overlap<units) {
+        rows->fd1 = (b1+overlap)*unit_d;
+        rows->fs1 = (b1+overlap)*unit_s;
+    }
+    else {
+        // the remainder below the last whole step goes with the bottom of the picture
+        rows->fd1 = dh;
+        rows->fs1 = sh;
+    }
+}
 
-    inputSource->quit = 0;
-    inputSource->finished = 0;
-    inputSource->fmt_ctx = avformat_alloc_context();
-    if( inputSource->fmt_ctx) {
-    float myFps;
+static void localScaleSlice( void *ctx, int n)
+{
+ScaleJob *job = ctx;
+Tiles *tile = job->tile;
+struct SwsContext **sws = &job->inputSource->slice_sws_ctx[job->t][n];
+uint8_t **band = job->inputSource->slice_data[job->t][n];
+int *band_linesize = job->inputSource->slice_linesize[job->t][n];
+const uint8_t *src[4];
+SliceRows rows;
+int p;
+
+    localSliceRows( n, job->slices, tile->h, job->ch, &rows);
+    if( !*sws) {
+        *sws = sws_getContext( job->cw, rows.fs1-rows.fs0, job->format, tile->w, rows.fd1-rows.fd0, STREAM_PIX_FMT, SCALE_FLAGS, NULL, NULL, NULL);
+        if( !*sws || av_image_alloc( band, band_linesize, tile->w, rows.fd1-rows.fd0, STREAM_PIX_FMT, 32)<0) {
+            sws_freeContext( *sws);
+            *sws = NULL;
+            job->failed = 1;
+            return;
+        }
+    }
+    localOffsetPlanes( job->format, job->data, job->linesize, 0, rows.fs0, src);
+    sws_scale( *sws, src, job->linesize, 0, rows.fs1-rows.fs0, band, band_linesize);
+
+    av_image_copy_plane( job->dst[0] + rows.dy0*tile->video_dst_linesize[0], tile->video_dst_linesize[0],
+                         band[0] + (rows.dy0-rows.fd0)*band_linesize[0], band_linesize[0], tile->w, rows.dy1-rows.dy0);
+    for( p=1; p<3; p++) {
+        av_image_copy_plane( job->dst[p] + (rows.dy0/2)*tile->video_dst_linesize[p], tile->video_dst_linesize[p],
+                             band[p] + ((rows.dy0-rows.fd0)/2)*band_linesize[p], band_linesize[p], (tile->w+1)/2, (rows.dy1+1)/2-rows.dy0/2);
+    }
+}
 
-        inputSource->fmt_ctx->interrupt_callback.callback = interrupt_cb;
-        inputSource->fmt_ctx->interrupt_callback.opaque = inputSource;
-        inputSource->fmt_ctx->flags |= AVFMT_FLAG_NONBLOCK;
+static void localFreeScalers( inputMosaic *inputSource, int t)
+{
+int n;
+
+    sws_freeContext( inputSource->scale_sws_ctx[t]);
+    inputSource->scale_sws_ctx[t] = NULL;
+    sws_freeContext( inputSource->deep_sws_ctx[t]);
+    inputSource->deep_sws_ctx[t] = NULL;
+    av_freep( &inputSource->deep_data[t][0]);
+    for( n=0; n<SCALE_MAX_SLICES; n++) {
+        sws_freeContext( inputSource->slice_sws_ctx[t][n]);
+        inputSource->slice_sws_ctx[t][n] = NULL;
+        av_freep( &inputSource->slice_data[t][n][0]);
+    }
+}
 
-        av_dict_set( &d, "loglevel", "quiet", 0);
+/*
+ * 10 bit (and deeper) YUV, HDR10 and HLG among them. Letting swscale make
+ * 8 bit of it takes its slow high bit depth paths at the source size and
+ * shows HDR washed out, so the picture is scaled to the tile as 16 bit
+ * 4:2:0 and only then taken to 8 bit with the tables for its transfer
+ * curve, at tile size where it is cheap. Returns 0 for 8 bit sources.
+ */
+static int localToneMapScale( inputMosaic *inputSource, int t, AVFrame *frame, const uint8_t *data[4], const int linesize[4], int cw, int ch, Tiles *tile, uint8_t *const dst[4])
+{
+const AVPixFmtDescriptor *desc = av_pix_fmt_desc_get( frame->format);
+int curve = tonemap_curve( frame->color_trc);
+int p;
+
+    if( !desc || desc->comp[0].depth<=8 || desc->nb_components<3 ||
+        (desc->flags & (AV_PIX_FMT_FLAG_RGB | AV_PIX_FMT_FLAG_PAL | AV_PIX_FMT_FLAG_BITSTREAM)))
+        return 0;
+
+    if( !inputSource->deep_data[t][0] &&
+        av_image_alloc( inputSource->deep_data[t], inputSource->deep_linesize[t], tile->w, tile->h, AV_PIX_FMT_YUV420P16, 32)<0) {
+        inputSource->deep_data[t][0] = NULL;
+        return 0;
+    }
+    inputSource->deep_sws_ctx[t] = sws_getCachedContext( inputSource->deep_sws_ctx[t], cw, ch, frame->format,
+                                                         tile->w, tile->h, AV_PIX_FMT_YUV420P16, SCALE_FLAGS, NULL, NULL, NULL);
+    if( !inputSource->deep_sws_ctx[t])
+        return 0;
+    if( curve+1!=inputSource->tone_curve) {
+        printf( "%s: %d bit %s, tone mapped to 8 bit at %dx%d\n", inputSource->name, desc->comp[0].depth, tonemap_name( curve), tile->w, tile->h);
+        inputSource->tone_curve = curve+1;
+    }
 
-        avio_open2( &inputSource->fmt_ctx->pb, inputSource->src_filename, AVIO_FLAG_READ, &inputSource->fmt_ctx->interrupt_callback, &d);
+    sws_scale( inputSource->deep_sws_ctx[t], data, linesize, 0, ch, inputSource->deep_data[t], inputSource->deep_linesize[t]);
+    for( p=0; p<3; p++) {
+        simd.tone_lut( dst[p], tile->video_dst_linesize[p], (const uint16_t *)inputSource->deep_data[t][p], inputSource->deep_linesize[t][p],
+                       p ? tile->w/2 : tile->w, p ? tile->h/2 : tile->h, tonemap_lut( curve, p));
+    }
 
-        /* open input file, and allocate format context */
-        if (avformat_open_input(&inputSource->fmt_ctx, inputSource->src_filename, NULL, NULL) < 0) {
-            fprintf(stderr, "%s:Could not open source file %s\n", inputSource->name, inputSource->src_filename);
-            goto end;
-        }
+    return 1;
+}
 
-        /* retrieve stream information */
-        if (avformat_find_stream_info(inputSource->fmt_ctx, NULL) < 0) {
-            fprintf(stderr, "Could not find stream information\n");
-            goto end;
-        }
+/*
+ * Thumbnail mode fills the tiles in turn, passing over the ones that are
+ * covered. Returns 1 when it went round, i.e. every tile has a picture.
+ */
+static int localNextThumbnail( OutputInfo *outputSettings)
+{
+int wrapped = 0;
+int n;
 
-        if (open_codec_context(&inputSource->video_stream_idx, inputSource->fmt_ctx, AVMEDIA_TYPE_VIDEO, inputSource) >= 0) {
-            inputSource->video_stream = inputSource->fmt_ctx->streams[inputSource->video_stream_idx];
-            inputSource->video_dec_ctx = inputSource->video_stream->codec;
+    for( n=0; n<outputSettings->tiles_count; n++) {
+        if( ++outputSettings->thumbnail_count>=outputSettings->tiles_count) {
+            outputSettings->thumbnail_count = 0;
+            wrapped = 1;
         }
+        if( !outputSettings->tiles[outputSettings->thumbnail_count]->hidden)
+            break;
+    }
 
-        /* dump input information to stderr */
-        av_dump_format(inputSource->fmt_ctx, 0, inputSource->src_filename, 0);
+    return wrapped;
+}
 
-        myFps = 25.0;
-        if( !inputSource->video_dec_ctx->framerate.num && inputSource->video_dec_ctx->framerate.den==1) {
-            if( inputSource->video_dec_ctx->pkt_timebase.num==1) {
-                myFps = ((double)(inputSource->video_dec_ctx->pkt_timebase.num/10))/100.0;
-            }
-        }
-        else {
-            myFps = (double)inputSource->video_dec_ctx->framerate.num/(double)inputSource->video_dec_ctx->framerate.den;
-        }
+/*
+ * Mode M makes an output frame once every visible tile with a running
+ * input has a new picture, an input that is ahead waits for the others.
+ */
+static int localRoundComplete( OutputInfo *outputSettings)
+{
+int t;
 
-        if( myFps!=inputSource->fps) {
-            printf( "%s (%2.3f - %2.3f) time_base:%d/%d (%f) ticks_per_frame:%d delay:%d framerate:%d/%d (%f) pkt_timebase:%d/%d (%f)\r\n", 
-                    inputSource->name, inputSource->fps, myFps,
-                    inputSource->video_dec_ctx->time_base.num, inputSource->video_dec_ctx->time_base.den,
-                    (double)inputSource->video_dec_ctx->time_base.den/inputSource->video_dec_ctx->time_base.num,
-                    inputSource->video_dec_ctx->ticks_per_frame, inputSource->video_dec_ctx->delay, 
-                    inputSource->video_dec_ctx->framerate.num, inputSource->video_dec_ctx->framerate.den,
-                    (double)inputSource->video_dec_ctx->framerate.num/inputSource->video_dec_ctx->framerate.den,
-                    inputSource->video_dec_ctx->pkt_timebase.num, inputSource->video_dec_ctx->pkt_timebase.den,
-                    (double)inputSource->video_dec_ctx->pkt_timebase.den/inputSource->video_dec_ctx->pkt_timebase.num);
+    for( t=0; t<outputSettings->tiles_count; t++) {
+    Tiles *tile = outputSettings->tiles[t];
 
-        }
+        if( tile->input && !tile->hidden && tile->input->running && !tile->input->stalled && !tile->fresh)
+            return 0;
+    }
+    for( t=0; t<outputSettings->tiles_count; t++) {
+        outputSettings->tiles[t]->fresh = 0;
+    }
 
-       /* When using the new API, you need to use the libavutil/frame.h API, while
-         * the classic frame management is available in libavcodec */
-        if ( 1) { // inputSource->frame) {
-        int error;
+    return 1;
+}
 
-            /* initialize packet, set data to NULL, let the demuxer fill it */
-            av_init_packet(&inputSource->pkt);
-            inputSource->pkt.data = NULL;
-            inputSource->pkt.size = 0;
+/*
+ * pacing="offline" keeps the tiles in step with the output timeline: a
+ * picture due at "at" is only applied once every output frame before it
+ * has been made, and only when no other input has an earlier picture
+ * waiting (the first input in the list goes first on a tie), so the tiles
+ * go through the same states on every run whatever the threads do. All of
+ * this runs under offline_mutex.
+ */
+static int localOfflineFirst( inputMosaic *inputSource, int64_t at)
+{
+int before = 1;
+int i;
 
-            /* read frames from the file */
-            pthread_mutex_init( &inputSource->list_mutex, NULL);
+    for( i=0; i<inputs_count; i++) {
+        if( inputs[i]==inputSource) {
+            before = 0;
+        }
+        else if( inputs[i]->offline_next<at || (before && inputs[i]->offline_next==at)) {
+            return 0;
+        }
+    }
 
-            if( !inputSource->videoThread) {
-                pthread_mutex_init( &inputSource->av_mutex, NULL);
-                error = pthread_create( &inputSource->videoThread, NULL, inputThreadVideo, (void *)inputSource);
-                if (!error) {
-                    pthread_detach( inputSource->videoThread);
-                }
-                else {
-                    error = -1;
-                    printf( "Could not create display thread\r\n");
+    return 1;
+}
+
+// Earliest picture any input still has to apply, what the output may go up to
+static int64_t localOfflineHorizon( void)
+{
+int64_t horizon = OFFLINE_DONE;
+int i;
+
+    for( i=0; i<inputs_count; i++) {
+        horizon = FFMIN( horizon, inputs[i]->offline_next);
+    }
+
+    return horizon;
+}
+
+static void localOfflineTurn( inputMosaic *inputSource, int64_t at)
+{
+    pthread_mutex_lock( &offline_mutex);
+    inputSource->offline_next = at;
+    pthread_cond_broadcast( &offline_cond);
+    while( !stop_all_tasks && (at>offline_time || !localOfflineFirst( inputSource, at))) {
+        localCondWait( &offline_cond, &offline_mutex);
+    }
+    pthread_mutex_unlock( &offline_mutex);
+}
+
+static void localOfflineDone( inputMosaic *inputSource)
+{
+    pthread_mutex_lock( &offline_mutex);
+    inputSource->offline_next = OFFLINE_DONE;
+    pthread_cond_broadcast( &offline_cond);
+    pthread_mutex_unlock( &offline_mutex);
+}
+
+/*
+ * Crops, deinterlaces and scales the picture into dst, the picture of the
+ * tile or in mode M its back buffer. size is the geometry the scalers of
+ * the input were made for. Returns the microseconds it took, -1 when no
+ * scaler could be made.
+ */
+static int localScaleTile( inputMosaic *inputSource, int t, Tiles *tile, AVFrame *frame, uint8_t *const dst[4], int size[4])
+{
+const uint8_t *data[4];
+int linesize[4] = { frame->linesize[0], frame->linesize[1], frame->linesize[2], frame->linesize[3] };
+int cx, cy, cw, ch;
+int slices;
+int deinterlace = DEINTERLACE_OFF;
+struct timeval start, stop;
+
+    localGetCrop( inputSource, frame, &cx, &cy, &cw, &ch);
+    if( !localOffsetPlanes( frame->format, (const uint8_t * const *)frame->data, frame->linesize, cx, cy, data)) {
+        cw = frame->width;
+        ch = frame->height;
+    }
+    else if( (deinterlace = localDeinterlaceMode( inputSource, frame))==DEINTERLACE_FIELD) {
+        localFieldPlanes( linesize, &ch);
+    }
+    if( size[0]!=tile->w || size[1]!=tile->h || size[2]!=cw || size[3]!=ch) {
+        size[0] = tile->w;
+        size[1] = tile->h;
+        size[2] = cw;
+        size[3] = ch;
+        localFreeScalers( inputSource, t);
+        if( verbose) {
+            printf( "%d:%d '%s' needed scale from %dx%d (crop %d,%d) to %dx%d, type %d, %d slices\n", t, inputSource->tile_number[t], inputSource->name,
+                cw, ch, cx, cy, tile->w, tile->h, frame->format, localScaleSlices( tile, ch));
+            fflush( stdout);
+        }
+    }
+
+    gettimeofday( &start, NULL);
+    if( deinterlace==DEINTERLACE_BLEND) {
+        localBlendFields( inputSource, frame->format, data, linesize, cw, ch);
+    }
+    if( !localToneMapScale( inputSource, t, frame, data, linesize, cw, ch, tile, dst) &&
+        !localBoxScale( frame->format, data, linesize, cw, ch, tile, dst)) {
+        if( (slices = localScaleSlices( tile, ch))>1) {
+        ScaleJob job = { inputSource, t, tile, { dst[0], dst[1], dst[2], dst[3] }, frame->format, { data[0], data[1], data[2], data[3] },
+                         { linesize[0], linesize[1], linesize[2], linesize[3] }, cw, ch, slices, 0 };
+
+            worker_pool_try_run( scale_pool, slices, localScaleSlice, &job);
+            if( job.failed) {
+                fprintf(stderr, "Impossible to create slice scale context for %s s:%dx%d -> s:%dx%d\n",
+                        av_get_pix_fmt_name(frame->format), cw, ch, tile->w, tile->h);
+                return -1;
+            }
+        }
+        else {
+            if( !inputSource->scale_sws_ctx[t]) {
+                /* create scaling context */
+                inputSource->scale_sws_ctx[t] = sws_getContext(cw, ch, frame->format,
+                                     tile->w, tile->h, STREAM_PIX_FMT, SCALE_FLAGS, NULL, NULL, NULL);
+                if (!inputSource->scale_sws_ctx[t]) {
+                    fprintf(stderr,
+                            "Impossible to create scale context for the conversion "
+                            "fmt:%s s:%dx%d -> fmt:%s s:%dx%d\n",
+                            av_get_pix_fmt_name(frame->format), cw, ch,
+                            av_get_pix_fmt_name(STREAM_PIX_FMT), tile->w, tile->h);
+                    return -1;
                 }
             }
-            else {
-                error = 0;
+
+            sws_scale(inputSource->scale_sws_ctx[t],
+                data, linesize, 0,
+                ch, dst, tile->video_dst_linesize);
+        }
+    }
+    gettimeofday( &stop, NULL);
+
+    return TIMEOFDAY( stop) - TIMEOFDAY( start);
+}
+
+// Under buffer_mutex, once the new picture is the one the tile shows
+static void localTileScaled( OutputInfo *outputSettings, inputMosaic *inputSource, Tiles *tile, double pts, int cnt, int scale_time)
+{
+    tile->scale_time      = scale_time;
+    tile->scale_time_sum += scale_time;
+    tile->updated_at      = localTimeNow();
+    tile->queue_depth     = cnt;
+
+    tile->source_name = inputSource->name;
+    tile->source_pts  = pts;
+    tile->source      = inputSource;
+    inputSource->stalled = 0;
+    tile->video_dst_dirty++;
+    tile->changed++;
+    tile->updates_per_second++;
+    if( outputSettings->mode==MODE_MAPPED) {
+        tile->fresh = 1;
+        if( localRoundComplete( outputSettings)) {
+            frame_ready = outputSettings->frames_count;
+        }
+    }
+    else if( localNextThumbnail( outputSettings)) {
+        frame_ready = outputSettings->frames_count;
+    }
+}
+
+static void *inputThreadVideo( void *_whichSource)
+{
+GET_OUTPUT_SETTINGS;
+inputMosaic *inputSource = _whichSource;
+int skip = inputSource->skip_frames;
+int size[4] = { -1, -1, -1, -1 };
+
+    while( FULL_TASK_RUN) {
+    int cnt = localNumberOfPackets( inputSource, VIDEO_INDEX);
+
+        if( outputSettings->pacing==PACING_FRAMES &&
+            (frame_ready || (outputSettings->mode==MODE_MAPPED && inputSource->mapped_tile && inputSource->mapped_tile->fresh))) {
+            usleep(100);
+        } 
+        else if( cnt) { // >inputSource->video_dec_ctx->delay) {
+            if( skip) {
+            int ret = localClearPackets( inputSource, VIDEO_INDEX, skip);
+
+                skip -= FFMIN( skip, ret);
             }
+            else {
+            videoFrames *here;
+            AVFrame *frame;
+            int t;
 
-            if (!error) {
-            int x = 0;
+                pthread_mutex_lock( &inputSource->list_mutex);
+                here  = inputSource->packets_list[VIDEO_INDEX];
+                inputSource->packets_list[VIDEO_INDEX] = here->next;
+                frame = here->frame;
+                inputSource->video_busy = 1;
+                pthread_mutex_unlock( &inputSource->list_mutex);
 
-                inputSource->running = 1;
-                while (FULL_TASK_RUN && (av_read_frame(inputSource->fmt_ctx, &inputSource->pkt) >= 0)) {
-                int cnt;
+                if( outputSettings->pacing==PACING_OFFLINE) {
+                    localOfflineTurn( inputSource, here->at);
+                }
+                localDetectCrop( inputSource, frame, outputSettings->pacing==PACING_OFFLINE ? here->at : localTimeNow());
+                if (frame->key_frame) {
+                    if (verbose) {
+                        printf("%s video_frame n:%d coded_n:%d pts:%s %f %c\n",
+                               inputSource->name, inputSource->video_frame_count, frame->display_picture_number,
+                                av_ts2timestr(frame->pts, &inputSource->video_dec_ctx->time_base), here->pts,
+                                frame->key_frame ? 'K':' ');
+                    }
+                }
 
-                    do {
-                        ret = decode_packet(&got_frame, 0, inputSource);
-                        if (ret < 0)
-                            break;
-                        inputSource->pkt.data += ret;
-                        inputSource->pkt.size -= ret;
-                    } while( FULL_TASK_RUN && inputSource->pkt.size > 0);
-#define PACKETS_HIGH    (inputSource->video_dec_ctx->delay*8)
-#define PACKETS_LOW     (inputSource->video_dec_ctx->delay*2)
-                    cnt = localNumberOfPackets( inputSource, VIDEO_INDEX);
-                    if( cnt>PACKETS_HIGH) {
-                        //printf( "inputThread PAUSED %d\r\n", cnt);
-                        do {
-                            usleep(1000);
-                            cnt = localNumberOfPackets( inputSource, VIDEO_INDEX);
-                        } while( FULL_TASK_RUN && cnt>PACKETS_LOW);
-                        // printf( "inputThread RESTART %d\r\n, cnt");
-                        if( x) {
-                            if( !--x) {
-                                goto end;
+                if( outputSettings->mode==MODE_MAPPED) {
+                Tiles *tile = inputSource->mapped_tile;
+                int scale_time;
+
+                    if( tile && !tile->hidden && inputSource->running) {
+                        if( tile->back_data[0]) {
+                            // scaled while the output composites from the front picture, only the swap is locked
+                            scale_time = localScaleTile( inputSource, 0, tile, frame, tile->back_data, size);
+                            pthread_mutex_lock( &outputSettings->buffer_mutex);
+                            if( scale_time>=0) {
+                            int p;
+
+                                for( p=0; p<4; p++) {
+                                    FFSWAP( uint8_t *, tile->video_dst_data[p], tile->back_data[p]);
+                                }
                             }
                         }
+                        else {
+                            pthread_mutex_lock( &outputSettings->buffer_mutex);
+                            scale_time = localScaleTile( inputSource, 0, tile, frame, tile->video_dst_data, size);
+                        }
+                        if( scale_time>=0) {
+                            localTileScaled( outputSettings, inputSource, tile, here->pts, cnt, scale_time);
+                        }
+                        pthread_mutex_unlock( &outputSettings->buffer_mutex);
                     }
-                    else {
+                }
+                else {
+                    pthread_mutex_lock( &outputSettings->buffer_mutex);
+                    for(t=0; t<MAX_TILES_PER_INPUT; t++) {
+                    Tiles *tile = outputSettings->tiles[outputSettings->thumbnail_count];
+                    static int frame_counter = 0;
+                    int add;
+
+                        if( !tile || tile->hidden)
+                            continue;
+                        add  = (outputSettings->mode==-1);
+                        add |= (outputSettings->mode==-2 && frame->key_frame);
+                        add |= (outputSettings->mode>0 && ++frame_counter>=outputSettings->mode);
+                        if( add) {
+                            frame_counter = 0;
+                            if( inputSource->running) {
+                            int scale_time = localScaleTile( inputSource, t, tile, frame, tile->video_dst_data, size);
+
+                                if( scale_time<0)
+                                    break;
+                                localTileScaled( outputSettings, inputSource, tile, here->pts, cnt, scale_time);
+                            }
+                        }
                     }
+                    pthread_mutex_unlock( &outputSettings->buffer_mutex);
                 }
+#if !API_MODE
+                avcodec_free_frame(&here->frame);
+#else
+                av_frame_free(&here->frame);
+#endif
+                free( here);
+                // the end path of the session may now close the decoder and free the scalers
+                pthread_mutex_lock( &inputSource->list_mutex);
+                inputSource->video_busy = 0;
+                pthread_mutex_unlock( &inputSource->list_mutex);
             }
         }
+        else if( outputSettings->pacing==PACING_OFFLINE && inputSource->finished) {
+            localOfflineDone( inputSource);
+            break;
+        }
         else {
-            printf( "Could not allocate frame\r\n");
+            usleep(1000);
         }
-end:;
-        while( localNumberOfPackets( inputSource, VIDEO_INDEX) || localNumberOfPackets( inputSource, AUDIO_INDEX)) {
-            printf( "%s closing down %3d %3d\r", inputSource->name, localNumberOfPackets( inputSource, VIDEO_INDEX), localNumberOfPackets( inputSource, AUDIO_INDEX));
-            sleep( 1);
+    }
+
+    return NULL;
+}
+
+#define METER_FLOOR_DB      -60.0f      // bottom of the meter
+
+static int localMeterScale( float value)
+{
+float db;
+
+    if( value<=0)
+        return 0;
+    db = 20*log10f( value);
+
+    return FFMIN( FFMAX( (int)((db-METER_FLOOR_DB)*100/-METER_FLOOR_DB), 0), 100);
+}
+
+/*
+ * Measure RMS and peak per channel over windows of one output frame and
+ * hand the result to the meter of the tile. Anything that is not stereo
+ * or mono planar float is converted (and downmixed) first.
+ */
+static void localMeterAudio( inputMosaic *inputSource, AVFrame *frame)
+{
+GET_OUTPUT_SETTINGS;
+Tiles *tile = inputSource->meter_tile;
+const float *planes[VU_CHANNELS];
+int channels = frame->channels;
+int window, samples, done, c;
+
+    if( !tile || !frame->nb_samples || !frame->sample_rate || channels<1)
+        return;
+
+    if( frame->format==AV_SAMPLE_FMT_FLTP && channels<=VU_CHANNELS) {
+        for( c=0; c<VU_CHANNELS; c++) {
+            planes[c] = (const float *)frame->extended_data[ FFMIN( c, channels-1)];
         }
-        inputSource->running = 0;
-        if( inputSource->video_dec_ctx)
-            avcodec_close(inputSource->video_dec_ctx);
+        samples = frame->nb_samples;
+    }
+    else {
+    int layout = channels==1 ? AV_CH_LAYOUT_MONO : AV_CH_LAYOUT_STEREO;
+    int out_channels = channels==1 ? 1 : VU_CHANNELS;
+
+        if( !inputSource->scale_swr_ctx[0]) {
+            inputSource->scale_swr_ctx[0] = swr_alloc_set_opts( NULL, layout, AV_SAMPLE_FMT_FLTP, frame->sample_rate,
+                                    frame->channel_layout ? frame->channel_layout : av_get_default_channel_layout( channels),
+                                    frame->format, frame->sample_rate, 0, NULL);
+            if( !inputSource->scale_swr_ctx[0] || swr_init( inputSource->scale_swr_ctx[0])<0) {
+                fprintf( stderr, "%s: could not convert audio for the meter\n", inputSource->name);
+                swr_free( &inputSource->scale_swr_ctx[0]);
+                inputSource->meter_tile = NULL;
+                return;
+            }
+        }
+        if( frame->nb_samples>inputSource->meter_allocated) {
+            av_freep( &inputSource->meter_data[0]);
+            if( av_samples_alloc( inputSource->meter_data, NULL, VU_CHANNELS, frame->nb_samples, AV_SAMPLE_FMT_FLTP, 0)<0) {
+                inputSource->meter_allocated = 0;
+                return;
+            }
+            inputSource->meter_allocated = frame->nb_samples;
+        }
+        samples = swr_convert( inputSource->scale_swr_ctx[0], inputSource->meter_data, inputSource->meter_allocated,
+                               (const uint8_t **)frame->extended_data, frame->nb_samples);
+        if( samples<=0)
+            return;
+        for( c=0; c<VU_CHANNELS; c++) {
+            planes[c] = (const float *)inputSource->meter_data[ FFMIN( c, out_channels-1)];
+        }
+    }
+
+    window = FFMAX( frame->sample_rate/FFMAX( outputSettings->video_frame_rate, 1), 1);
+    for( done=0; done<samples; ) {
+    int n = FFMIN( samples-done, window-inputSource->meter_count);
+
+        for( c=0; c<VU_CHANNELS; c++) {
+            simd.audio_level( planes[c]+done, n, &inputSource->meter_sum[c], &inputSource->meter_peak[c]);
+        }
+        done += n;
+        inputSource->meter_count += n;
+        if( inputSource->meter_count>=window) {
+            for( c=0; c<VU_CHANNELS; c++) {
+                tile->vu_level[c] = localMeterScale( sqrtf( inputSource->meter_sum[c]/window));
+                tile->vu_peak[c]  = localMeterScale( inputSource->meter_peak[c]);
+                inputSource->meter_sum[c]  = 0;
+                inputSource->meter_peak[c] = 0;
+            }
+            inputSource->meter_count = 0;
+        }
+    }
+}
+
+/*
+ * Time of a picture from the start of its input, from the timestamps of the
+ * stream alone. A picture without one comes a frame after the last.
+ */
+static int64_t localOfflineTime( inputMosaic *inputSource, AVFrame *frame)
+{
+int64_t ts = av_frame_get_best_effort_timestamp( frame);
+
+    if( ts==AV_NOPTS_VALUE) {
+        inputSource->offline_last += TIMEOFDAY_S/(inputSource->fps>0 ? inputSource->fps : 25);
+    }
+    else {
+        if( inputSource->offline_origin==AV_NOPTS_VALUE) {
+            inputSource->offline_origin = ts;
+        }
+        inputSource->offline_last = FFMAX( av_rescale_q( ts-inputSource->offline_origin, inputSource->video_stream->time_base, AV_TIME_BASE_Q), 0);
+    }
+
+    return inputSource->offline_last;
+}
+
+static int decode_packet(int *got_frame, int cached, inputMosaic *inputSource)
+{
+    int decoded = inputSource->pkt.size;
+    AVFrame *frame;
+    int index = MAX_INDEX;
+
+    *got_frame = 0;
+
 #if !API_MODE
-//        avcodec_free_frame(&inputSource->frame);
+    frame = avcodec_alloc_frame();
 #else
-//        av_frame_free(&inputSource->frame);
+    frame = av_frame_alloc();
 #endif
 
-        for(t=0;t<MAX_TILES_PER_INPUT;t++) {
-            if( inputSource->scale_sws_ctx[t]) {
-                sws_freeContext(inputSource->scale_sws_ctx[t]);
-                inputSource->scale_sws_ctx[t] = NULL;
-            }
-        }
+    if (inputSource->pkt.stream_index == inputSource->video_stream_idx) {
+    int ret = avcodec_decode_video2(inputSource->video_dec_ctx, frame, got_frame, &inputSource->pkt);
+
+        /* decode video frame */
+        if (ret < 0) {
+            fprintf(stderr, "Error decoding video frame (%s)\n", av_err2str(ret));
+            return ret;
+        }
+        index = VIDEO_INDEX;
+    } 
+    else if( inputSource->audio_dec_ctx && inputSource->pkt.stream_index == inputSource->audio_stream_idx) {
+    int ret = avcodec_decode_audio4(inputSource->audio_dec_ctx, frame, got_frame, &inputSource->pkt);
+
+        if (ret < 0) {
+            fprintf(stderr, "Error decoding audio frame (%s)\n", av_err2str(ret));
+            av_frame_free(&frame);
+            return ret;
+        }
+        /* some decoders consume less than the whole packet */
+        decoded = FFMIN(ret, inputSource->pkt.size);
+        if( *got_frame) {
+            localMeterAudio( inputSource, frame);
+        }
+    }
+    if( *got_frame && index==VIDEO_INDEX) {
+        inputSource->last_frame_at = localTimeNow();
+        inputSource->session_frames++;
+    }
+    if( *got_frame && index<MAX_INDEX) {
+    videoFrames *here;
+    videoFrames *current = calloc( 1, sizeof( videoFrames));
+    double pts;
+
+        if( (pts = av_frame_get_best_effort_timestamp( frame))==AV_NOPTS_VALUE) {
+            pts = 0;
+        }
+        if( index==VIDEO_INDEX) {
+            pts *= av_q2d(inputSource->video_dec_ctx->time_base);
+        }
+        inputSource->pts[index] = pts;
+//        printf( "--> %s V:%8.2f A:%8.2f\r\n", index ? "Audio":"Video", inputSource->pts[0], inputSource->pts[1]);
+
+        current->frame = av_frame_clone( frame);
+        current->pts   = pts;
+        current->at    = index==VIDEO_INDEX ? localOfflineTime( inputSource, frame) : 0;
+        current->next  = NULL;
+        pthread_mutex_lock( &inputSource->list_mutex);
+        here = inputSource->packets_list[index];
+#if 0
+        if( !here) {
+            inputSource->packets_list[index] = current;
+        }
+        else {
+            while( here) {
+                if( !here->next) {
+                    here->next = current;
+                    here = NULL;
+                }
+                else {
+                    here = here->next;
+                }
+            }
+        }
+#else
+        if( !here) {
+            inputSource->packets_list[index] = current;
+        }
+        else {
+        videoFrames *last = NULL;
+
+            while( here) {
+                if( current->pts<here->pts) {
+                    if( !last) {
+                        current->next = here;
+                        inputSource->packets_list[index] = current;
+                    }
+                    else {
+                        current->next = last->next;
+                        last->next = current;
+                    }
+                    goto used;
+                }
+                last = here;
+                here = last->next;
+            }
+            if( !here) {
+                last->next = current;
+            }
+        }
+#endif
+used:   pthread_mutex_unlock( &inputSource->list_mutex);
+    }
+#if !API_MODE
+    avcodec_free_frame(&frame);
+#else
+    av_frame_free(&frame);
+#endif
+
+    return decoded;
+}
+
+static int open_codec_context(int *stream_idx,
+                              AVFormatContext *fmt_ctx, enum AVMediaType type,
+                              inputMosaic *inputSource)
+{
+    int ret;
+    AVStream *st;
+    AVCodecContext *dec_ctx = NULL;
+    AVCodec *dec = NULL;
+    AVDictionary *opts = NULL;
+
+    ret = av_find_best_stream(fmt_ctx, type, -1, -1, NULL, 0);
+    if (ret < 0) {
+        fprintf(stderr, "Could not find %s stream in input file '%s'\n",
+                av_get_media_type_string(type), inputSource->src_filename);
+        return ret;
+    } else {
+        *stream_idx = ret;
+        st = fmt_ctx->streams[*stream_idx];
+
+        /* find decoder for the stream */
+        dec_ctx = st->codec;
+        dec = avcodec_find_decoder(dec_ctx->codec_id);
+        if (!dec) {
+            fprintf(stderr, "Failed to find %s codec\n",
+                    av_get_media_type_string(type));
+            return AVERROR(EINVAL);
+        }
+
+        /* Init the decoders, with or without reference counting */
+#if API_MODE == API_MODE_NEW_API_REF_COUNT
+        av_dict_set(&opts, "refcounted_frames", "1", 0);
+#endif
+        av_dict_set( &opts, "threads", "auto", 0);
+        if ((ret = avcodec_open2(dec_ctx, dec, &opts)) < 0) {
+            fprintf(stderr, "Failed to open %s codec\n",
+                    av_get_media_type_string(type));
+            return ret;
+        }
+    }
+
+    return 0;
+}
+
+#if 0
+static int get_format_from_sample_fmt(const char **fmt,
+                                      enum AVSampleFormat sample_fmt)
+{
+    int i;
+    struct sample_fmt_entry {
+        enum AVSampleFormat sample_fmt; const char *fmt_be, *fmt_le;
+    } sample_fmt_entries[] = {
+        { AV_SAMPLE_FMT_U8,  "u8",    "u8"    },
+        { AV_SAMPLE_FMT_S16, "s16be", "s16le" },
+        { AV_SAMPLE_FMT_S32, "s32be", "s32le" },
+        { AV_SAMPLE_FMT_FLT, "f32be", "f32le" },
+        { AV_SAMPLE_FMT_DBL, "f64be", "f64le" },
+    };
+    *fmt = NULL;
+
+    for (i = 0; i < FF_ARRAY_ELEMS(sample_fmt_entries); i++) {
+        struct sample_fmt_entry *entry = &sample_fmt_entries[i];
+        if (sample_fmt == entry->sample_fmt) {
+            *fmt = AV_NE(entry->fmt_be, entry->fmt_le);
+            return 0;
+        }
+    }
+
+    fprintf(stderr,
+            "sample format %s is not supported as output format\n",
+            av_get_sample_fmt_name(sample_fmt));
+    return -1;
+}
+#endif
+
+// Nothing queued and nothing being scaled, the video thread is done with this session
+static int localVideoIdle( inputMosaic *inputSource)
+{
+int idle;
+
+    pthread_mutex_lock( &inputSource->list_mutex);
+    idle = !inputSource->packets_list[VIDEO_INDEX] && !inputSource->video_busy;
+    pthread_mutex_unlock( &inputSource->list_mutex);
+
+    return idle;
+}
+
+static int interrupt_cb(void *ctx)
+{
+    inputMosaic *inputSource = ctx;
+
+//    printf( "."); fflush(stdout);
+
+    if (inputSource->quit || inputSource->reconnect || stop_all_tasks)
+        return 1;
+
+    return 0;
+} 
+
+/* One connection to the input, from opening it to the end or a stall */
+static void localRunInput( inputMosaic *inputSource)
+{
+    GET_OUTPUT_SETTINGS;
+    int ret = 0, got_frame;
+    AVDictionary *d = NULL;
+    AVIOContext *pb = NULL;
+ //   Tiles *tile = outputSettings->tiles[ inputSource->tile_number&~TILE_MASK];
+    int t;
+
+    // nothing of the last session is left to the end path when this one fails early
+    inputSource->video_stream  = NULL;
+    inputSource->video_dec_ctx = NULL;
+    inputSource->audio_dec_ctx = NULL;
+    inputSource->fmt_ctx = avformat_alloc_context();
+    if( inputSource->fmt_ctx) {
+    float myFps;
+
+        inputSource->fmt_ctx->interrupt_callback.callback = interrupt_cb;
+        inputSource->fmt_ctx->interrupt_callback.opaque = inputSource;
+        if( outputSettings->pacing!=PACING_OFFLINE) {
+            inputSource->fmt_ctx->flags |= AVFMT_FLAG_NONBLOCK;
+        }
+
+        av_dict_set( &d, "loglevel", "quiet", 0);
+
+        // ours to close, avformat_open_input() leaves a pb it was given alone even when it fails
+        avio_open2( &pb, inputSource->src_filename, AVIO_FLAG_READ, &inputSource->fmt_ctx->interrupt_callback, &d);
+        inputSource->fmt_ctx->pb = pb;
+
+        /* open input file, and allocate format context */
+        if (avformat_open_input(&inputSource->fmt_ctx, inputSource->src_filename, NULL, NULL) < 0) {
+            fprintf(stderr, "%s:Could not open source file %s\n", inputSource->name, inputSource->src_filename);
+            goto end;
+        }
+
+        /* retrieve stream information */
+        if (avformat_find_stream_info(inputSource->fmt_ctx, NULL) < 0) {
+            fprintf(stderr, "Could not find stream information\n");
+            goto end;
+        }
+
+        if (open_codec_context(&inputSource->video_stream_idx, inputSource->fmt_ctx, AVMEDIA_TYPE_VIDEO, inputSource) >= 0) {
+            inputSource->video_stream = inputSource->fmt_ctx->streams[inputSource->video_stream_idx];
+            inputSource->video_dec_ctx = inputSource->video_stream->codec;
+        }
+        if( !inputSource->video_dec_ctx) {
+            fprintf(stderr, "%s:No video in %s\n", inputSource->name, inputSource->src_filename);
+            goto end;
+        }
+        inputSource->audio_stream_idx = -1;
+        if( inputSource->meter_tile && open_codec_context(&inputSource->audio_stream_idx, inputSource->fmt_ctx, AVMEDIA_TYPE_AUDIO, inputSource) >= 0) {
+            inputSource->audio_dec_ctx = inputSource->fmt_ctx->streams[inputSource->audio_stream_idx]->codec;
+        }
+
+        /* dump input information to stderr */
+        av_dump_format(inputSource->fmt_ctx, 0, inputSource->src_filename, 0);
+
+        myFps = 25.0;
+        if( !inputSource->video_dec_ctx->framerate.num && inputSource->video_dec_ctx->framerate.den==1) {
+            if( inputSource->video_dec_ctx->pkt_timebase.num==1) {
+                myFps = ((double)(inputSource->video_dec_ctx->pkt_timebase.num/10))/100.0;
+            }
+        }
+        else {
+            myFps = (double)inputSource->video_dec_ctx->framerate.num/(double)inputSource->video_dec_ctx->framerate.den;
+        }
+
+        if( myFps!=inputSource->fps) {
+            printf( "%s (%2.3f - %2.3f) time_base:%d/%d (%f) ticks_per_frame:%d delay:%d framerate:%d/%d (%f) pkt_timebase:%d/%d (%f)\r\n", 
+                    inputSource->name, inputSource->fps, myFps,
+                    inputSource->video_dec_ctx->time_base.num, inputSource->video_dec_ctx->time_base.den,
+                    (double)inputSource->video_dec_ctx->time_base.den/inputSource->video_dec_ctx->time_base.num,
+                    inputSource->video_dec_ctx->ticks_per_frame, inputSource->video_dec_ctx->delay, 
+                    inputSource->video_dec_ctx->framerate.num, inputSource->video_dec_ctx->framerate.den,
+                    (double)inputSource->video_dec_ctx->framerate.num/inputSource->video_dec_ctx->framerate.den,
+                    inputSource->video_dec_ctx->pkt_timebase.num, inputSource->video_dec_ctx->pkt_timebase.den,
+                    (double)inputSource->video_dec_ctx->pkt_timebase.den/inputSource->video_dec_ctx->pkt_timebase.num);
+
+        }
+
+       /* When using the new API, you need to use the libavutil/frame.h API, while
+         * the classic frame management is available in libavcodec */
+        if ( 1) { // inputSource->frame) {
+        int error;
+
+            /* initialize packet, set data to NULL, let the demuxer fill it */
+            av_init_packet(&inputSource->pkt);
+            inputSource->pkt.data = NULL;
+            inputSource->pkt.size = 0;
+
+            /* read frames from the file */
+            if( !inputSource->videoThread) {
+                pthread_mutex_init( &inputSource->list_mutex, NULL);
+                pthread_mutex_init( &inputSource->av_mutex, NULL);
+                error = pthread_create( &inputSource->videoThread, NULL, inputThreadVideo, (void *)inputSource);
+                if (!error) {
+                    pthread_detach( inputSource->videoThread);
+                }
+                else {
+                    error = -1;
+                    printf( "Could not create display thread\r\n");
+                }
+            }
+            else {
+                error = 0;
+            }
+
+            if (!error) {
+            int x = 0;
+
+                // the stall timer starts with the first read, not with the open
+                inputSource->last_frame_at = localTimeNow();
+                inputSource->probing       = 0;
+                inputSource->running = 1;
+                while (FULL_TASK_RUN && (av_read_frame(inputSource->fmt_ctx, &inputSource->pkt) >= 0)) {
+                int cnt;
+
+                    do {
+                        ret = decode_packet(&got_frame, 0, inputSource);
+                        if (ret < 0)
+                            break;
+                        inputSource->pkt.data += ret;
+                        inputSource->pkt.size -= ret;
+                    } while( FULL_TASK_RUN && inputSource->pkt.size > 0);
+#define PACKETS_HIGH    (inputSource->video_dec_ctx->delay*8)
+#define PACKETS_LOW     (inputSource->video_dec_ctx->delay*2)
+                    cnt = localNumberOfPackets( inputSource, VIDEO_INDEX);
+                    if( cnt>PACKETS_HIGH) {
+                        //printf( "inputThread PAUSED %d\r\n", cnt);
+                        do {
+                            usleep(1000);
+                            cnt = localNumberOfPackets( inputSource, VIDEO_INDEX);
+                            // waiting on the output is not a stall
+                            inputSource->last_frame_at = localTimeNow();
+                        } while( FULL_TASK_RUN && cnt>PACKETS_LOW);
+                        // printf( "inputThread RESTART %d\r\n, cnt");
+                        if( x) {
+                            if( !--x) {
+                                goto end;
+                            }
+                        }
+                    }
+                    else {
+                    }
+                }
+            }
+        }
+        else {
+            printf( "Could not allocate frame\r\n");
+        }
+end:;
+        while( !localVideoIdle( inputSource) || localNumberOfPackets( inputSource, AUDIO_INDEX)) {
+            printf( "%s closing down %3d %3d\r", inputSource->name, localNumberOfPackets( inputSource, VIDEO_INDEX), localNumberOfPackets( inputSource, AUDIO_INDEX));
+            sleep( 1);
+        }
+        inputSource->running = 0;
+        if( inputSource->video_dec_ctx)
+            avcodec_close(inputSource->video_dec_ctx);
+        if( inputSource->audio_dec_ctx)
+            avcodec_close(inputSource->audio_dec_ctx);
+        inputSource->audio_dec_ctx = NULL;
+        swr_free( &inputSource->scale_swr_ctx[0]);
+        av_freep( &inputSource->meter_data[0]);
+        av_freep( &inputSource->blend_data[0]);
+        inputSource->blend_w = 0;
+        inputSource->meter_allocated = 0;
+#if !API_MODE
+//        avcodec_free_frame(&inputSource->frame);
+#else
+//        av_frame_free(&inputSource->frame);
+#endif
+
+        for(t=0;t<MAX_TILES_PER_INPUT;t++) {
+            localFreeScalers( inputSource, t);
+        }
+
+        // a failed avformat_open_input() already freed the context and cleared it
+        if( inputSource->fmt_ctx)
+            avformat_close_input(&inputSource->fmt_ctx);
+        avio_closep( &pb);
+        inputSource->video_stream  = NULL;
+        inputSource->video_dec_ctx = NULL;
+
+        av_dict_free( &d);
+    }
+}
+
+#define WATCHDOG_STALL      (4*TIMEOFDAY_S)     // no picture for this long is no signal
+#define WATCHDOG_PROBE      (3*WATCHDOG_STALL)  // an open and probe that takes longer is given up
+#define RECONNECT_MIN       1                   // seconds, doubled after every failed attempt
+#define RECONNECT_MAX       32
+
+/*
+ * Keeps the input open: whenever it ends, fails to open or is stalled by
+ * the watchdog it is opened again, waiting RECONNECT_MIN seconds and twice
+ * as long after every attempt that brought no picture. All of it happens on
+ * this thread, the output carries on with the slate in the meantime.
+ */
+static void *inputThread( void *_whichSource)
+{
+    GET_OUTPUT_SETTINGS;
+    inputMosaic *inputSource = _whichSource;
+    int backoff = RECONNECT_MIN;
+
+    inputSource->quit = 0;
+    inputSource->finished = 0;
+    while( FULL_TASK_RUN) {
+    int wait;
+
+        inputSource->reconnect      = 0;
+        inputSource->session_frames = 0;
+        // the source may come back in another format
+        inputSource->auto_w         = 0;
+        inputSource->detect_samples = 0;
+        inputSource->detect_wait    = 0;
+        inputSource->detect_at      = 0;
+        inputSource->probe_at       = localTimeNow();
+        inputSource->probing        = 1;
+        inputSource->offline_origin = AV_NOPTS_VALUE;
+        localRunInput( inputSource);
+        inputSource->probing        = 0;
+        // offline the end of a file is the end of the input
+        if( !FULL_TASK_RUN || outputSettings->pacing==PACING_OFFLINE)
+            break;
+
+        if( inputSource->session_frames) {
+            backoff = RECONNECT_MIN;
+        }
+        inputSource->stalled = 1;
+        inputSource->reconnects++;
+        printf( "%s: lost, reconnecting in %ds (attempt %d)\n", inputSource->name, backoff, inputSource->reconnects);
+        for( wait=0; FULL_TASK_RUN && wait<backoff*10; wait++) {
+            usleep( 100000);
+        }
+        backoff = FFMIN( backoff*2, RECONNECT_MAX);
+    }
+    if( outputSettings->pacing==PACING_OFFLINE) {
+        // an input that never got its video thread must not hold the others at frame 0
+        localOfflineDone( inputSource);
+    }
+
+    inputSource->finished = 1;
+
+    return NULL;
+}
+
+static void log_packet(const AVFormatContext *fmt_ctx, const AVPacket *pkt)
+{
+    if (!pkt->stream_index && verbose) {
+        AVRational *time_base = &fmt_ctx->streams[pkt->stream_index]->time_base;
+
+        printf("pts_time:%-12s dts_time:%-12s duration_time:%s stream_index:%d [pts:%s dts:%s duration:%s]\n",
+           av_ts2timestr(pkt->pts, time_base), av_ts2timestr(pkt->dts, time_base), av_ts2timestr(pkt->duration, time_base),
+           pkt->stream_index,
+           av_ts2str(pkt->pts), av_ts2str(pkt->dts), av_ts2str(pkt->duration));
+    }
+}
+
+/*
+ * Hands the packet to every sink as a new reference, no copy of the data.
+ * A full queue drops the packet and everything after it up to the next key
+ * frame, so the sink picks up again with a picture it can decode.
+ */
+static void localQueueSinks( OutputInfo *outputSettings, AVPacket *pkt)
+{
+int i;
+
+    for( i=0; i<outputSettings->sinks_count; i++) {
+    Sink *sink = &outputSettings->sinks[i];
+
+        if( !sink->started)
+            continue;
+        pthread_mutex_lock( &sink->mutex);
+        if( sink->count==sink->queue_size || (sink->key_wait && !(pkt->flags & AV_PKT_FLAG_KEY))) {
+            sink->key_wait = 1;
+            sink->dropped++;
+        }
+        else {
+        AVPacket *ref = av_packet_clone( pkt);
+
+            if( ref) {
+                sink->queue[ (sink->head+sink->count)%sink->queue_size] = ref;
+                sink->count++;
+                sink->key_wait = 0;
+                pthread_cond_signal( &sink->cond);
+            }
+        }
+        pthread_mutex_unlock( &sink->mutex);
+    }
+}
+
+static int write_frame(AVFormatContext *fmt_ctx, const AVRational *time_base, AVStream *st, AVPacket *pkt)
+{
+    /* rescale output packet timestamp values from codec to stream timebase */
+    av_packet_rescale_ts(pkt, *time_base, st->time_base);
+    pkt->stream_index = st->index;
+
+    if( !st->index) {
+    GET_OUTPUT_SETTINGS;
+    int r;
+
+        if( fmt_ctx==outputSettings->oc) {
+            encoded_frames++;
+            encoded_bytes += pkt->size;
+            localQueueSinks( outputSettings, pkt);
+        }
+        for( r=0; r<outputSettings->renditions_count; r++) {
+            if( fmt_ctx==outputSettings->renditions[r].settings.oc) {
+                outputSettings->renditions[r].encoded_frames++;
+                outputSettings->renditions[r].encoded_bytes += pkt->size;
+            }
+        }
+    }
+    /* Write the compressed frame to the media file. */
+    log_packet(fmt_ctx, pkt);
+    return av_interleaved_write_frame(fmt_ctx, pkt);
+}
+
+/*
+ * Encoder settings by profile, on top of the preset. "throughput" runs a
+ * frame per thread with b-frames and a short lookahead, for the most frames
+ * a second; "low_latency" splits every frame over sliced threads with no
+ * b-frames or lookahead and tune zerolatency, so a frame comes out as it
+ * goes in; "archive" spends more b-frames and lookahead on quality per bit.
+ * "default" leaves it all to the preset. x264_threads applies to all of
+ * them, "auto" (0) lets the encoder pick.
+ */
+static void localEncoderProfile( AVCodecContext *c, OutputInfo *outputSettings, int profile)
+{
+    c->thread_count = atoi( outputSettings->x264_threads);
+    switch( profile) {
+        case PROFILE_THROUGHPUT:
+            c->thread_type  = FF_THREAD_FRAME;
+            c->max_b_frames = 3;
+            av_opt_set( c->priv_data, "rc-lookahead", "20", 0);
+            break;
+
+        case PROFILE_LOW_LATENCY:
+            c->thread_type  = FF_THREAD_SLICE;
+            c->max_b_frames = 0;
+            av_opt_set( c->priv_data, "tune", "zerolatency", 0);
+            av_opt_set( c->priv_data, "rc-lookahead", "0", 0);
+            break;
+
+        case PROFILE_ARCHIVE:
+            c->thread_type  = FF_THREAD_FRAME;
+            c->max_b_frames = 5;
+            av_opt_set( c->priv_data, "b-pyramid", "normal", 0);
+            av_opt_set( c->priv_data, "rc-lookahead", "60", 0);
+            break;
+    }
+}
+
+/*
+ * One slice per row of the grid, each on a thread of its own. The encoder
+ * cuts at whole macroblock rows (see localAlignSliceRows), x265 has no
+ * tiles so HEVC gets its slices.
+ */
+static void localEncoderSlices( AVCodecContext *c, int slices)
+{
+char params[32];
+
+    if( slices<2)
+        return;
+    c->slices       = slices;
+    c->thread_type  = FF_THREAD_SLICE;
+    c->thread_count = slices;
+    if( c->codec_id==AV_CODEC_ID_HEVC) {
+        snprintf( params, sizeof( params), "slices=%d", slices);
+        av_opt_set( c->priv_data, "x265-params", params, 0);
+    }
+}
+
+/* Add an output stream. */
+/*
+ * frame_hold="repeat": a repeat of the picture is left out of the stream,
+ * the next picture's pts a frame time later is what holds it. Only a
+ * stream without timestamps needs every repeat as a frame of its own.
+ */
+static int localRepeatSkipped( OutputInfo *outputSettings, AVFormatContext *oc)
+{
+    return outputSettings->frame_hold==HOLD_REPEAT && !(oc->oformat->flags & (AVFMT_NOTIMESTAMPS | AVFMT_RAWPICTURE));
+}
+
+static void add_stream(OutputStream *ost, AVFormatContext *oc,
+                       AVCodec **codec,
+                       enum AVCodecID codec_id,
+                       OutputInfo *outputSettings)
+{
+    AVCodecContext *c;
+    int sink;
+
+    /* find the encoder */
+    *codec = avcodec_find_encoder(codec_id);
+    if (!(*codec)) {
+        fprintf(stderr, "Could not find encoder for '%s'\n", avcodec_get_name(codec_id));
+        exit(1);
+    }
+
+    ost->st = avformat_new_stream(oc, *codec);
+    if (!ost->st) {
+        fprintf(stderr, "Could not allocate stream\n");
+        exit(1);
+    }
+    ost->st->id = oc->nb_streams-1;
+    c = ost->st->codec;
+
+    switch ((*codec)->type) {
+    case AVMEDIA_TYPE_AUDIO:
+        c->sample_fmt     = outputSettings->audio_format;
+        c->bit_rate       = outputSettings->audio_bit_rate;        // AUDIO_BIT_RATE; // 64000
+        c->sample_rate    = outputSettings->audio_sample_rate;     // AUDIO_SAMPLE_RATE; // 44100;
+        c->channels       = outputSettings->audio_channels;
+        c->channel_layout = av_get_default_channel_layout(c->channels);
+        if ((*codec)->supported_samplerates) {
+        int i;
+
+            c->sample_rate = (*codec)->supported_samplerates[0];
+            for (i = 0; (*codec)->supported_samplerates[i]; i++) {
+                if ((*codec)->supported_samplerates[i] == outputSettings->audio_sample_rate)
+                    c->sample_rate = outputSettings->audio_sample_rate;
+            }
+        }
+        c->channels       = av_get_channel_layout_nb_channels(c->channel_layout);
+        c->channel_layout = AV_CH_LAYOUT_STEREO;
+        if ((*codec)->channel_layouts) {
+        int i;
+
+            c->channel_layout = (*codec)->channel_layouts[0];
+            for (i = 0; (*codec)->channel_layouts[i]; i++) {
+                if ((*codec)->channel_layouts[i] == AV_CH_LAYOUT_STEREO)
+                    c->channel_layout = AV_CH_LAYOUT_STEREO;
+            }
+        }
+        c->channels        = av_get_channel_layout_nb_channels(c->channel_layout);
+//        ost->st->time_base = (AVRational){ 1, c->sample_rate };
+//        c->time_base       = ost->st->time_base;
+        c->time_base       = (AVRational){ 1, c->sample_rate };
+        break;
+
+    case AVMEDIA_TYPE_VIDEO:
+        c->codec_id = (*codec)->id;
+        if( c->codec_id!=AV_CODEC_ID_RAWVIDEO)
+            c->bit_rate = outputSettings->video_bitrate;
+        c->width    = outputSettings->screen_width;      /* Resolution must be a multiple of two. */
+        c->height   = outputSettings->screen_height;
+        /* timebase: This is the fundamental unit of time (in seconds) in terms
+         * of which frame timestamps are represented. For fixed-fps content,
+         * timebase should be 1/framerate and timestamp increments should be
+         * identical to 1. */
+        ost->st->time_base = (AVRational){ 1, outputSettings->video_frame_rate };
+        c->time_base     = ost->st->time_base;
+        c->gop_size      = outputSettings->gop_size;    // 12; /* emit one intra frame every twelve frames at most */
+        if( outputSettings->frame_hold==HOLD_VFR || localRepeatSkipped( outputSettings, oc)) {
+            // the gop counts encoded pictures, keep the key frames as far apart in time
+            c->gop_size  = FFMAX( c->gop_size/outputSettings->frames_count, 1);
+        }
+        c->pix_fmt       = STREAM_PIX_FMT;
+        if( outputSettings->pacing==PACING_OFFLINE) {
+            c->flags |= AV_CODEC_FLAG_BITEXACT;
+        }
+        if (c->codec_id == AV_CODEC_ID_H264) {
+            av_opt_set( c->priv_data, "preset", outputSettings->x264_preset, 0);
+            if( outputSettings->roi_offset || outputSettings->renditions_count) {
+                // key frames only every gop_size pictures, where the region hints leave them
+                // alone and on the same pictures in every rung of a ladder
+                av_opt_set( c->priv_data, "x264-params", "scenecut=0", 0);
+            }
+        }
+        if (c->codec_id == AV_CODEC_ID_MPEG2VIDEO) {
+            /* just for testing, we also add B frames */
+            c->max_b_frames = 2;
+        }
+        if (c->codec_id == AV_CODEC_ID_MPEG1VIDEO) {
+            /* Needed to avoid using macroblocks in which some coeffs overflow.
+             * This does not happen with normal video, it just happens here as
+             * the motion of the chroma plane does not match the luma plane. */
+            c->mb_decision = 2;
+        }
+        if( c->codec_id==AV_CODEC_ID_H264 || c->codec_id==AV_CODEC_ID_HEVC) {
+            // the profiles and slices are x264/x265 options, a shm canvas is raw pictures
+            localEncoderProfile( c, outputSettings, outputSettings->profile);
+            localEncoderSlices( c, outputSettings->slice_rows);
+        }
+        break;
+
+    default:
+        break;
+    }
+
+    /* Some formats want stream headers to be separate. */
+    if (oc->oformat->flags & AVFMT_GLOBALHEADER)
+        c->flags |= CODEC_FLAG_GLOBAL_HEADER;
+    for( sink=0; sink<outputSettings->sinks_count; sink++) {
+        // a sink like mpegts needs them in the stream, mp4 and mkv find them there too
+        if( outputSettings->sinks[sink].oc && !(outputSettings->sinks[sink].oc->oformat->flags & AVFMT_GLOBALHEADER))
+            c->flags &= ~CODEC_FLAG_GLOBAL_HEADER;
+    }
+}
+
+static AVFrame *alloc_picture(enum AVPixelFormat pix_fmt, int width, int height)
+{
+    AVFrame *picture;
+    int ret;
+
+    picture = av_frame_alloc();
+    if (!picture)
+        return NULL;
+
+    picture->format = pix_fmt;
+    picture->width  = width;
+    picture->height = height;
+
+    /* allocate the buffers for the frame data */
+    ret = av_frame_get_buffer(picture, 32);
+    if (ret < 0) {
+        fprintf(stderr, "Could not allocate frame data.\n");
+        exit(1);
+    }
+
+    return picture;
+}
+
+
+/* 1 when the encoder is open with its pictures, 0 when not */
+static int open_video(AVFormatContext *oc, AVCodec *codec, OutputStream *ost, AVDictionary *opt_arg, OutputInfo *outputSettings)
+{
+    int ret;
+    AVCodecContext *c = ost->st->codec;
+    AVDictionary *opt = NULL;
+
+    av_dict_copy(&opt, opt_arg, 0);
+
+    /* open the codec */
+    ret = avcodec_open2(c, codec, &opt);
+    av_dict_free(&opt);
+    if (ret < 0) {
+        fprintf(stderr, "Could not open video codec: %s\n", av_err2str(ret));
+        return 0;
+    }
+
+    /* allocate and init a re-usable frame */
+    ost->video_frame = alloc_picture(c->pix_fmt, c->width, c->height);
+    if (!ost->video_frame) {
+        fprintf(stderr, "Could not allocate video frame\n");
+        return 0;
+    }
+
+   /* If the output format is not YUV420P, then a temporary YUV420P
+    * picture is needed too. It is then converted to the required
+    * output format. */
+    ost->tmp_video_frame = NULL;
+    if (c->pix_fmt != STREAM_PIX_FMT) {
+        ost->tmp_video_frame = alloc_picture(STREAM_PIX_FMT, c->width, c->height);
+        if (!ost->tmp_video_frame) {
+            fprintf(stderr, "Could not allocate temporary picture\n");
+            return 0;
+       }
+    }
+
+    return 1;
+}
+
+/*
+ * The canvas is described as a list of render operations which is then
+ * played back band by band, each band on a worker of its own, so a band
+ * of the picture stays in cache while every operation touching it runs.
+ */
+#define COMPOSITE_BAND_HEIGHT       64
+#define COMPOSITE_PARALLEL_PIXELS   (1280*720)      // smaller canvases are composited on the output thread
+
+static RenderOp *localAddRenderOp( RenderList *list, int type, int x, int y, int w, int h)
+{
+RenderOp *op;
+
+    if( x<0 || y<0 || x>=list->width || y>=list->height || w<=0 || h<=0)
+        return NULL;
+
+    if( list->count==list->allocated) {
+    RenderOp *ops = realloc( list->ops, (list->allocated+16)*sizeof( RenderOp));
+
+        if( !ops)
+            return NULL;
+        list->ops        = ops;
+        list->allocated += 16;
+    }
+    op = &list->ops[ list->count++];
+    memset( op, 0, sizeof( RenderOp));
+    op->type = type;
+    op->x    = x;
+    op->y    = y;
+    op->w    = FFMIN( w, list->width-x);
+    op->h    = FFMIN( h, list->height-y);
+
+    return op;
+}
+
+/* Run the part of one operation that falls inside the rows b0 to b1 */
+static void localRenderOp( RenderList *list, const RenderOp *op, int b0, int b1)
+{
+AVFrame *pict = list->pict;
+int y0 = FFMAX( op->y, b0);
+int y1 = FFMIN( op->y+op->h, b1);
+int c0 = FFMAX( op->y>>1, b0>>1);
+int c1 = FFMIN( (op->y+op->h+1)>>1, (b1+1)>>1);
+int cx = op->x>>1;
+int cw = (op->w+1)>>1;
+
+    if( y0>=y1)
+        return;
+
+    switch( op->type) {
+        case RENDER_FILL:
+            simd.fill( pict->data[0] + (y0*pict->linesize[0]) + op->x, pict->linesize[0], op->w, y1-y0, op->colour>>16);
+            simd.fill( pict->data[1] + (c0*pict->linesize[1]) + cx,    pict->linesize[1], cw,    c1-c0, op->colour>>8);
+            simd.fill( pict->data[2] + (c0*pict->linesize[2]) + cx,    pict->linesize[2], cw,    c1-c0, op->colour);
+            break;
+
+        case RENDER_COPY:
+            simd.blit( pict->data[0] + (y0*pict->linesize[0]) + op->x, pict->linesize[0],
+                       op->data[0] + ((y0-op->y)*op->linesize[0]), op->linesize[0], op->w, y1-y0);
+            simd.blit( pict->data[1] + (c0*pict->linesize[1]) + cx, pict->linesize[1],
+                       op->data[1] + ((c0-(op->y>>1))*op->linesize[1]), op->linesize[1], cw, c1-c0);
+            simd.blit( pict->data[2] + (c0*pict->linesize[2]) + cx, pict->linesize[2],
+                       op->data[2] + ((c0-(op->y>>1))*op->linesize[2]), op->linesize[2], cw, c1-c0);
+            break;
+
+        case RENDER_PATTERN:
+            /* Y = x + y + i*3, Cb = 128 + y + i*2, Cr = 64 + x + i*5 */
+            simd.pattern( pict->data[0] + (y0*pict->linesize[0]) + op->x, pict->linesize[0], op->x, y0, op->w, y1-y0, list->frame_index*3, 1, 1);
+            simd.pattern( pict->data[1] + (c0*pict->linesize[1]) + cx, pict->linesize[1], cx, c0, cw, c1-c0, 128 + list->frame_index*2, 0, 1);
+            simd.pattern( pict->data[2] + (c0*pict->linesize[2]) + cx, pict->linesize[2], cx, c0, cw, c1-c0, 64 + list->frame_index*5, 1, 0);
+            break;
+
+        case RENDER_MASK:
+            /* both chroma planes share the one subsampled mask */
+            simd.mask_blend( pict->data[0] + (y0*pict->linesize[0]) + op->x, pict->linesize[0],
+                             op->data[0] + ((y0-op->y)*op->linesize[0]), op->linesize[0], op->w, y1-y0, op->colour>>16);
+            simd.mask_blend( pict->data[1] + (c0*pict->linesize[1]) + cx, pict->linesize[1],
+                             op->data[1] + ((c0-(op->y>>1))*op->linesize[1]), op->linesize[1], cw, c1-c0, op->colour>>8);
+            simd.mask_blend( pict->data[2] + (c0*pict->linesize[2]) + cx, pict->linesize[2],
+                             op->data[1] + ((c0-(op->y>>1))*op->linesize[1]), op->linesize[1], cw, c1-c0, op->colour);
+            break;
+
+        case RENDER_BLEND:
+            simd.alpha_blend( pict->data[0] + (y0*pict->linesize[0]) + op->x, pict->linesize[0],
+                              op->data[0] + ((y0-op->y)*op->linesize[0]), op->linesize[0],
+                              op->data[3] + ((y0-op->y)*op->linesize[3]), op->linesize[3], op->w, y1-y0);
+            simd.alpha_blend( pict->data[1] + (c0*pict->linesize[1]) + cx, pict->linesize[1],
+                              op->data[1] + ((c0-(op->y>>1))*op->linesize[1]), op->linesize[1],
+                              op->chroma_alpha + ((c0-(op->y>>1))*op->chroma_alpha_linesize), op->chroma_alpha_linesize, cw, c1-c0);
+            simd.alpha_blend( pict->data[2] + (c0*pict->linesize[2]) + cx, pict->linesize[2],
+                              op->data[2] + ((c0-(op->y>>1))*op->linesize[2]), op->linesize[2],
+                              op->chroma_alpha + ((c0-(op->y>>1))*op->chroma_alpha_linesize), op->chroma_alpha_linesize, cw, c1-c0);
+            break;
+    }
+}
+
+#define STRING_CENTRE   -1
+#define STRING_END      -2
+
+/*
+ * Queue an already rasterised label inside a tile. x0/y0 are tile
+ * relative, STRING_CENTRE or STRING_END (right/bottom edge), box is the
+ * colour put behind the text or -1 for none.
+ */
+static void localAddLabel( RenderList *list, Tiles *tile, GlyphLabel *label, int x0, int y0, int colour, int box)
+{
+RenderOp *op;
+int w, h;
+
+    if( !label->w)
+        return;
+
+    if( x0==STRING_CENTRE) {
+        x0 = (tile->w-label->w)/2;
+    }
+    else if( x0==STRING_END) {
+        x0 = tile->w-label->w-2;
+    }
+    if( y0==STRING_CENTRE) {
+        y0 = (tile->h-label->h)/2;
+    }
+    else if( y0==STRING_END) {
+        y0 = tile->h-label->h-2;
+    }
+    x0 = FFMAX( x0, 0)&~1;
+    y0 = FFMAX( y0, 0)&~1;
+    w  = FFMIN( label->w, tile->w-x0);
+    h  = FFMIN( label->h, tile->h-y0);
+    if( w<=0 || h<=0)
+        return;
+
+    if( box>=0) {
+    int bx = FFMAX( x0-2, 0);
+    int by = FFMAX( y0-2, 0);
+
+        if( (op = localAddRenderOp( list, RENDER_FILL, tile->x+bx, tile->y+by,
+                                    FFMIN( w+4, tile->w-bx), FFMIN( h+4, tile->h-by)))) {
+            op->colour = box;
+        }
+    }
+    if( (op = localAddRenderOp( list, RENDER_MASK, tile->x+x0, tile->y+y0, w, h))) {
+        op->colour      = colour;
+        op->data[0]     = label->mask[0];
+        op->data[1]     = label->mask[1];
+        op->linesize[0] = label->linesize[0];
+        op->linesize[1] = label->linesize[1];
+    }
+}
+
+/*
+ * Queue a string inside a tile. The label keeps the rasterised text, so as
+ * long as the string is the same every frame only the blend is redone.
+ */
+static void localAddString( RenderList *list, Tiles *tile, GlyphLabel *label, int x0, int y0,
+                            const char *string, int size, int colour, int box)
+{
+    glyph_label_set( label, string, size);
+    localAddLabel( list, tile, label, x0, y0, colour, box);
+}
+
+static void localAddCaption( RenderList *list, OutputInfo *outputSettings, Tiles *tile)
+{
+char text[GLYPH_LABEL_TEXT] = "";
+
+    if( (outputSettings->caption & CAPTION_NAME) && tile->source_name) {
+        snprintf( text, sizeof( text), "%s", tile->source_name);
+    }
+    if( outputSettings->caption & CAPTION_TIME) {
+    int seconds = (int)tile->source_pts;
+
+        snprintf( text+strlen( text), sizeof( text)-strlen( text), "%s%02d:%02d:%02d", text[0] ? " " : "",
+                  seconds/3600, (seconds/60)%60, seconds%60);
+    }
+    localAddString( list, tile, &tile->caption, 2, STRING_END, text, outputSettings->caption_size, YCrCb_WHITE, YCrCb_GREY);
+}
+
+#define ANALOG_MAX_SIZE     256         // the dial is redrawn every second, keep it cheap
+#define VU_BAR_GAP          2
+
+static void localAddWidget( OutputInfo *outputSettings, Tiles *tile, int type)
+{
+Widget *widgets = realloc( outputSettings->widgets, (outputSettings->widgets_count+1)*sizeof( Widget));
+
+    if( !widgets)
+        return;
+    outputSettings->widgets = widgets;
+    widgets += outputSettings->widgets_count++;
+    memset( widgets, 0, sizeof( Widget));
+    widgets->type = type;
+    widgets->tile = tile;
+    widgets->key  = -1;
+}
+
+/* Widgets are only created once the tiles have their final size */
+static void localCreateWidgets( OutputInfo *outputSettings)
+{
+int t;
+
+    for( t=0; t<outputSettings->tiles_count; t++) {
+    Tiles *tile = outputSettings->tiles[t];
+
+        if( tile->named)
+            localAddWidget( outputSettings, tile, WIDGET_NAMED);
+        if( tile->clock)
+            localAddWidget( outputSettings, tile, WIDGET_CLOCK);
+        if( tile->analog)
+            localAddWidget( outputSettings, tile, WIDGET_ANALOG);
+        if( tile->vu_meter)
+            localAddWidget( outputSettings, tile, WIDGET_VU_METER);
+    }
+}
+
+static void localFreeWidgets( OutputInfo *outputSettings)
+{
+int w;
+
+    for( w=0; w<outputSettings->widgets_count; w++) {
+        free( outputSettings->widgets[w].buffer);
+        free( outputSettings->widgets[w].scratch);
+        glyph_label_free( &outputSettings->widgets[w].label);
+    }
+    free( outputSettings->widgets);
+    outputSettings->widgets       = NULL;
+    outputSettings->widgets_count = 0;
+}
+
+/* Size the masks of a widget and clear them, w and h must be even */
+static int localWidgetLayers( Widget *widget, int w, int h, int layers)
+{
+int plane = (w*h) + ((w/2)*(h/2));
+int l;
+
+    if( plane*layers>widget->allocated) {
+    uint8_t *buffer = realloc( widget->buffer, plane*layers);
+
+        if( !buffer)
+            return 0;
+        widget->buffer    = buffer;
+        widget->allocated = plane*layers;
+    }
+    widget->w           = w;
+    widget->h           = h;
+    widget->layers      = layers;
+    widget->linesize[0] = w;
+    widget->linesize[1] = w/2;
+    for( l=0; l<layers; l++) {
+        widget->mask[l][0] = widget->buffer + (l*plane);
+        widget->mask[l][1] = widget->mask[l][0] + (w*h);
+    }
+    simd.fill( widget->buffer, plane*layers, plane*layers, 1, 0);
+
+    return 1;
+}
+
+static void localWidgetRect( Widget *widget, int layer, int x, int y, int w, int h)
+{
+    if( w<=0 || h<=0)
+        return;
+    simd.fill( widget->mask[layer][0] + (y*widget->linesize[0]) + x, widget->linesize[0], w, h, 255);
+    simd.fill( widget->mask[layer][1] + ((y>>1)*widget->linesize[1]) + (x>>1), widget->linesize[1], (w+1)>>1, (h+1)>>1, 255);
+}
+
+static float localSegmentDistance( float px, float py, float dx, float dy, float length)
+{
+float t = FFMIN( FFMAX( px*dx + py*dy, 0), length);
+
+    return hypotf( px-(t*dx), py-(t*dy));
+}
+
+/*
+ * Draw the dial at twice the size with hard edges and box filter it down,
+ * layer 0 is the face and the hour and minute hands, layer 1 the second hand.
+ */
+static void localDrawAnalog( Widget *widget, const struct tm *now)
+{
+int   size = widget->w*2;
+float r    = (size/2)-2;
+float angle[3] = {
+    ((now->tm_hour%12) + (now->tm_min/60.0f))*(float)M_PI/6,
+    (now->tm_min + (now->tm_sec/60.0f))*(float)M_PI/30,
+    now->tm_sec*(float)M_PI/30,
+};
+float length[3] = { r*0.50f, r*0.80f, r*0.90f };
+float width[3]  = { FFMAX( r*0.05f, 2), FFMAX( r*0.03f, 2), FFMAX( r*0.01f, 1) };
+float tick      = FFMAX( r*0.015f, 1);
+float dx[15], dy[15];       // the three hands then the twelve hour marks
+int l, x, y, i;
+
+    for( i=0; i<15; i++) {
+    float a = i<3 ? angle[i] : (i-3)*(float)M_PI/6;
+
+        dx[i] =  sinf( a);
+        dy[i] = -cosf( a);
+    }
+    for( l=0; l<2; l++) {
+        for( y=0; y<size; y++) {
+        uint8_t *out = widget->scratch + (y*size);
+        float py = y - (size/2) + 0.5f;
+
+            for( x=0; x<size; x++) {
+            float px = x - (size/2) + 0.5f;
+            float d  = hypotf( px, py);
+            int on;
+
+                if( l==0) {
+                    on  = (d<=r && d>=r*0.94f);
+                    on |= localSegmentDistance( px, py, dx[0], dy[0], length[0]) <= width[0];
+                    on |= localSegmentDistance( px, py, dx[1], dy[1], length[1]) <= width[1];
+                    for( i=3; i<15 && !on && d>=r*0.80f && d<r*0.94f; i++) {
+                        on = localSegmentDistance( px, py, dx[i], dy[i], r) <= tick;
+                    }
+                }
+                else {
+                    on  = localSegmentDistance( px, py, dx[2], dy[2], length[2]) <= width[2];
+                    on |= d<=r*0.04f;
+                }
+                out[x] = on ? 255 : 0;
+            }
+        }
+        simd.box_downscale( widget->mask[l][0], widget->linesize[0], widget->scratch, size, widget->w, widget->h, 2, 2);
+        simd.box_downscale( widget->mask[l][1], widget->linesize[1], widget->mask[l][0], widget->linesize[0], widget->w/2, widget->h/2, 2, 2);
+    }
+}
+
+/*
+ * One bar per channel, green over the lower 70%, then yellow, red in the
+ * top tenth, with a two line mark at the peak in the colour of its zone.
+ */
+static void localDrawVuMeter( Widget *widget, const int *level, const int *peak)
+{
+int bar = (widget->w - (VU_BAR_GAP*(VU_CHANNELS-1)))/VU_CHANNELS;
+int red = (widget->h/10)&~1;
+int yel = (widget->h*3/10)&~1;
+int c;
+
+    for( c=0; c<VU_CHANNELS; c++) {
+    int x   = c*(bar+VU_BAR_GAP);
+    int top = (widget->h - (FFMIN( FFMAX( level[c], 0), 100)*widget->h/100))&~1;
+
+        localWidgetRect( widget, 2, x, top,               bar, red-top);
+        localWidgetRect( widget, 1, x, FFMAX( top, red), bar, yel-FFMAX( top, red));
+        localWidgetRect( widget, 0, x, FFMAX( top, yel), bar, widget->h-FFMAX( top, yel));
+
+        top = (widget->h - (FFMIN( FFMAX( peak[c], 0), 100)*widget->h/100))&~1;
+        if( peak[c]>0) {
+            top = FFMIN( top, widget->h-2);
+            localWidgetRect( widget, top<red ? 2 : top<yel ? 1 : 0, x, top, bar, 2);
+        }
+    }
+}
+
+/* Redraw the masks of a widget when what it shows has changed */
+static void localUpdateWidget( Widget *widget, time_t now)
+{
+Tiles *tile = widget->tile;
+struct tm tm;
+int key;
+
+    switch( widget->type) {
+        case WIDGET_ANALOG:
+            key = (int)now;
+            if( key!=widget->key) {
+            int size = FFMIN( FFMIN( tile->w, tile->h)-4, ANALOG_MAX_SIZE)&~3;
+
+                if( size<8)
+                    break;
+                if( size!=widget->w) {
+                    free( widget->scratch);
+                    widget->scratch = malloc( (size*2)*(size*2));
+                }
+                if( !widget->scratch || !localWidgetLayers( widget, size, size, 2))
+                    break;
+                localtime_r( &now, &tm);
+                widget->x         = ((tile->w-size)/2)&~1;
+                widget->y         = ((tile->h-size)/2)&~1;
+                widget->colour[0] = YCrCb_WHITE;
+                widget->colour[1] = YCrCb_RED;
+                localDrawAnalog( widget, &tm);
+                widget->key = key;
+            }
+            break;
+
+        case WIDGET_VU_METER:
+            key = (((((tile->vu_level[0]*101) + tile->vu_level[1])*101) + tile->vu_peak[0])*101) + tile->vu_peak[1];
+            if( key!=widget->key) {
+            int w = FFMAX( tile->w/16, 8)&~1;
+            int h = (tile->h-8)&~1;
+
+                if( h<10 || !localWidgetLayers( widget, w, h, 3))
+                    break;
+                widget->x         = tile->w-w-4;
+                widget->y         = 4;
+                widget->colour[0] = YCrCb_GREEN;
+                widget->colour[1] = 0xd21092;   // yellow
+                widget->colour[2] = YCrCb_RED;
+                localDrawVuMeter( widget, tile->vu_level, tile->vu_peak);
+                widget->key = key;
+            }
+            break;
+    }
+}
+
+/* Queue the cached widgets, they are only redrawn when their key changes */
+/* Widgets go on with their tile, so a tile above covers them as well */
+static void localAddWidgets( RenderList *list, OutputInfo *outputSettings, Tiles *tile, time_t now)
+{
+int w, l;
+
+    for( w=0; w<outputSettings->widgets_count; w++) {
+    Widget *widget = &outputSettings->widgets[w];
+    RenderOp *op;
+
+        if( widget->tile!=tile)
+            continue;
+        localUpdateWidget( widget, now);
+        switch( widget->type) {
+            case WIDGET_NAMED:
+                localAddString( list, tile, &widget->label, 2, 2, tile->named, outputSettings->caption_size, YCrCb_WHITE, YCrCb_GREY);
+                break;
+
+            case WIDGET_CLOCK: {
+            char text[16];
+            struct tm tm;
+
+                localtime_r( &now, &tm);
+                snprintf( text, sizeof( text), "%02d:%02d:%02d", tm.tm_hour, tm.tm_min, tm.tm_sec);
+                localAddString( list, tile, &widget->label, STRING_END, 2, text, outputSettings->caption_size, YCrCb_WHITE, YCrCb_GREY);
+                break;
+            }
+
+            case WIDGET_VU_METER:
+                if( widget->key!=-1 && (op = localAddRenderOp( list, RENDER_FILL, tile->x+widget->x-2, tile->y+widget->y-2, widget->w+4, widget->h+4))) {
+                    op->colour = YCrCb_BLACK;
+                }
+                // fall through
+            case WIDGET_ANALOG:
+                for( l=0; widget->key!=-1 && l<widget->layers; l++) {
+                    if( (op = localAddRenderOp( list, RENDER_MASK, tile->x+widget->x, tile->y+widget->y, widget->w, widget->h))) {
+                        op->colour      = widget->colour[l];
+                        op->data[0]     = widget->mask[l][0];
+                        op->data[1]     = widget->mask[l][1];
+                        op->linesize[0] = widget->linesize[0];
+                        op->linesize[1] = widget->linesize[1];
+                    }
+                }
+                break;
+        }
+    }
+}
+
+/* Overlays go on last, over the tiles and widgets */
+static void localAddOverlays( RenderList *list, OutputInfo *outputSettings)
+{
+int o, p;
+
+    for( o=0; o<outputSettings->overlays_count; o++) {
+    Overlay *overlay = &outputSettings->overlays[o];
+    RenderOp *op;
+
+        if( !overlay->frame || !(op = localAddRenderOp( list, RENDER_BLEND, overlay->x+overlay->bx, overlay->y+overlay->by, overlay->bw, overlay->bh)))
+            continue;
+        for( p=0; p<4; p++) {
+        int shift = (p==1 || p==2);
+
+            op->data[p]     = overlay->frame->data[p] + ((overlay->by>>shift)*overlay->frame->linesize[p]) + (overlay->bx>>shift);
+            op->linesize[p] = overlay->frame->linesize[p];
+        }
+        op->chroma_alpha          = overlay->chroma_alpha + ((overlay->by>>1)*overlay->chroma_alpha_linesize) + (overlay->bx>>1);
+        op->chroma_alpha_linesize = overlay->chroma_alpha_linesize;
+    }
+}
+
+#define DIAGNOSTICS_REFRESH     250000      // a tile's line is redrawn at most this often, in microseconds
+#define DIAGNOSTICS_BUDGET      300         // redrawing stops for the frame once this much time went on it
+
+/*
+ * One line per tile: updates in the last second, decoded frames queued,
+ * last scale time and how old the picture in the tile is. Lines are
+ * redrawn in turn, oldest first, and only for as long as the budget lasts,
+ * so a big wall spreads its redraws over a few frames instead of slowing
+ * one down. Blending the lines into the frame is timed by the bands and
+ * counted against the budget of the next frame.
+ */
+static void localAddDiagnostics( RenderList *list, OutputInfo *outputSettings)
+{
+struct timeval tv;
+int64_t start, now;
+int n, t;
+
+    if( !outputSettings->tiles_count)
+        return;
+
+    gettimeofday( &tv, NULL);
+    start = now = TIMEOFDAY( tv);
+    for( n=0; n<outputSettings->tiles_count && now-start+outputSettings->diagnostics_blend<DIAGNOSTICS_BUDGET; n++) {
+    Tiles *tile = outputSettings->tiles[ (outputSettings->diagnostics_next+n)%outputSettings->tiles_count];
+    char text[GLYPH_LABEL_TEXT];
+
+        if( now-tile->diagnostics_at<DIAGNOSTICS_REFRESH)
+            continue;
+        if( tile->updated_at) {
+            snprintf( text, sizeof( text), "%d/s q%d %dus %dms", tile->updates_last, tile->queue_depth, tile->scale_time,
+                      (int)((now-tile->updated_at)/1000));
+        }
+        else {
+            snprintf( text, sizeof( text), "no picture");
+        }
+        glyph_label_set( &tile->diagnostics, text, GLYPH_SIZE_SMALL);
+        tile->diagnostics_at = now;
+
+        gettimeofday( &tv, NULL);
+        now = TIMEOFDAY( tv);
+    }
+    outputSettings->diagnostics_next = (outputSettings->diagnostics_next+n)%outputSettings->tiles_count;
+
+    list->timed_first = list->count;
+    for( t=0; t<outputSettings->tiles_count; t++) {
+        localAddLabel( list, outputSettings->tiles[t], &outputSettings->tiles[t]->diagnostics, 2, STRING_CENTRE, YCrCb_WHITE, YCrCb_BLACK);
+    }
+    list->timed_last = list->count;
+    gettimeofday( &tv, NULL);
+    outputSettings->diagnostics_time_sum += TIMEOFDAY( tv) - start;
+    outputSettings->diagnostics_frames++;
+}
+
+static void localCompositeBand( void *ctx, int band)
+{
+RenderList *list = ctx;
+int b0 = band*list->band_height;
+int b1 = FFMIN( b0+list->band_height, list->height);
+int64_t start;
+int i;
+
+    for( i=0; i<list->timed_first; i++) {
+        localRenderOp( list, &list->ops[i], b0, b1);
+    }
+    if( list->timed_last>list->timed_first) {
+        start = localMonotonicNow();
+        for( ; i<list->timed_last; i++) {
+            localRenderOp( list, &list->ops[i], b0, b1);
+        }
+        __atomic_add_fetch( &list->timed_time, localMonotonicNow()-start, __ATOMIC_RELAXED);
+    }
+    for( ; i<list->count; i++) {
+        localRenderOp( list, &list->ops[i], b0, b1);
+    }
+}
+
+/* Covered tiles never are, popups only between their start and end */
+static int localTileShown( Tiles *tile, int frame_index, OutputInfo *outputSettings)
+{
+int seconds = frame_index/FFMAX( outputSettings->video_frame_rate, 1);
+
+    if( tile->hidden)
+        return 0;
+    if( !tile->popup)
+        return 1;
+
+    return seconds>=tile->pop_start && (!tile->pop_length || seconds<tile->pop_start+tile->pop_length);
+}
+
+/* The input that filled the tile last, or the one mapped to it, has gone quiet */
+static int localShowSlate( Tiles *tile)
+{
+inputMosaic *feed = tile->source ? tile->source : tile->input;
+
+    return tile->slate_data[0] && feed && feed->last_frame_at && feed->stalled;
+}
+
+// Something drawn over the tile changes on its own, the clocks and meters or the diagnostics
+static int localTileAnimated( OutputInfo *outputSettings, Tiles *tile)
+{
+int w;
+
+    if( outputSettings->diagnostics)
+        return 1;
+    for( w=0; w<outputSettings->widgets_count; w++) {
+        if( outputSettings->widgets[w].tile==tile && outputSettings->widgets[w].type!=WIDGET_NAMED)
+            return 1;
+    }
+
+    return 0;
+}
+
+/*
+ * Note what of the tile changes in this frame for the region hints: a new
+ * picture, the slate coming or going, a popup going up or down.
+ */
+static void localNoteChange( OutputInfo *outputSettings, Tiles *tile, int state)
+{
+    if( outputSettings->roi && (tile->changed || state!=tile->roi_state || localTileAnimated( outputSettings, tile))) {
+    TileRect *rect = &outputSettings->roi[ outputSettings->roi_count++];
+
+        rect->x = tile->x;
+        rect->y = tile->y;
+        rect->w = tile->w;
+        rect->h = tile->h;
+    }
+    tile->changed   = 0;
+    tile->roi_state = state;
+}
+
+/*
+ * Region hints for the encoder: the tiles that changed keep the quantizer
+ * of the frame and everything else (background, borders, frozen tiles)
+ * gets roi_offset more, so it costs next to nothing. Overlapping regions
+ * take the first, so the changes go before the whole frame. Key frames get
+ * no hints, what they code is what the static parts show until the next.
+ */
+static void localAttachRegions( AVFrame *frame, OutputInfo *outputSettings, int64_t picture, int gop_size)
+{
+#if HAVE_REGIONS
+AVFrameSideData *side;
+AVRegionOfInterest *roi;
+int r;
+
+    av_frame_remove_side_data( frame, AV_FRAME_DATA_REGIONS_OF_INTEREST);
+    if( !outputSettings->roi_offset || !(picture%FFMAX( gop_size, 1)))
+        return;
+
+    side = av_frame_new_side_data( frame, AV_FRAME_DATA_REGIONS_OF_INTEREST, (outputSettings->roi_count+1)*sizeof( AVRegionOfInterest));
+    if( !side)
+        return;
+    roi = (AVRegionOfInterest *)side->data;
+    for( r=0; r<=outputSettings->roi_count; r++) {
+    TileRect whole = { 0, 0, frame->width, frame->height };
+    const TileRect *rect = r<outputSettings->roi_count ? &outputSettings->roi[r] : &whole;
+
+        roi[r].self_size = sizeof( AVRegionOfInterest);
+        roi[r].left      = FFMAX( rect->x, 0);
+        roi[r].top       = FFMAX( rect->y, 0);
+        roi[r].right     = FFMIN( rect->x+rect->w, frame->width);
+        roi[r].bottom    = FFMIN( rect->y+rect->h, frame->height);
+        roi[r].qoffset   = r<outputSettings->roi_count ? av_make_q( 0, 1) : av_make_q( outputSettings->roi_offset, 51);
+    }
+#endif
+}
+
+static void localCreateVideoFrame(AVFrame *pict, int frame_index,
+                           int width, int height)
+{
+    GET_OUTPUT_SETTINGS;
+    RenderList *list = &outputSettings->render;
+    AVFrame *background = outputSettings->background_frame;
+    // offline the clocks show the time into the output, so every run draws the same
+    time_t now = outputSettings->pacing==PACING_OFFLINE ? frame_index/FFMAX( outputSettings->video_frame_rate, 1) : time( NULL);
+    RenderOp *op;
+    int t, ret;
+
+    /* when we pass a frame to the encoder, it may keep a reference to it
+     * internally;
+     * make sure we do not overwrite it here
+     */
+    ret = av_frame_make_writable(pict);
+    if (ret < 0)
+        exit(1);
+
+    list->pict        = pict;
+    list->frame_index = frame_index;
+    list->width       = width;
+    list->height      = height;
+    list->band_height = COMPOSITE_BAND_HEIGHT;
+    list->count       = 0;
+    list->timed_first = 0;
+    list->timed_last  = 0;
+    list->timed_time  = 0;
+
+    if( background && background->data[0]) {
+        if( (op = localAddRenderOp( list, RENDER_COPY, 0, 0, background->width, background->height))) {
+            for( t=0; t<4; t++) {
+                op->data[t]     = background->data[t];
+                op->linesize[t] = background->linesize[t];
+            }
+        }
+    }
+    else if( !outputSettings->fillColourY) {
+        localAddRenderOp( list, RENDER_PATTERN, 0, 0, width, height);
+    }
+    else if( (op = localAddRenderOp( list, RENDER_FILL, 0, 0, width, height))) {
+        op->colour = (outputSettings->fillColourY<<16) | (outputSettings->fillColourCb<<8) | outputSettings->fillColourCr;
+    }
+
+    if( outputSettings->roi_offset && !outputSettings->roi) {
+        outputSettings->roi = calloc( outputSettings->tiles_count, sizeof( TileRect));
+    }
+    outputSettings->roi_count = 0;
+
+    pthread_mutex_lock( &outputSettings->buffer_mutex);
+    for( t=0; t<outputSettings->tiles_count; t++) {
+    Tiles *tile = outputSettings->tiles[ outputSettings->draw_order ? outputSettings->draw_order[t] : t];
+
+    int slate = localShowSlate( tile);
+    int shown = localTileShown( tile, frame_index, outputSettings);
+    uint8_t **data = slate ? tile->slate_data : tile->video_dst_data;
+    int *linesize  = slate ? tile->slate_linesize : tile->video_dst_linesize;
+    int r;
+
+        localNoteChange( outputSettings, tile, shown | (slate<<1));
+        if( !shown)
+            continue;
+        // only the parts no tile above covers
+        for( r=0; (slate || tile->video_dst_dirty) && r<tile->visible_count; r++) {
+        const TileRect *rect = &tile->visible[r];
+        int sx = rect->x - tile->x;
+        int sy = rect->y - tile->y;
+
+            if( (op = localAddRenderOp( list, RENDER_COPY, rect->x, rect->y, rect->w, rect->h))) {
+                op->data[0]     = data[0] + (sy*linesize[0]) + sx;
+                op->data[1]     = data[1] + ((sy>>1)*linesize[1]) + (sx>>1);
+                op->data[2]     = data[2] + ((sy>>1)*linesize[2]) + (sx>>1);
+                op->linesize[0] = linesize[0];
+                op->linesize[1] = linesize[1];
+                op->linesize[2] = linesize[2];
+            }
+        }
+        if( tile->video_dst_dirty && outputSettings->caption) {
+            localAddCaption( list, outputSettings, tile);
+        }
+        localAddWidgets( list, outputSettings, tile, now);
+    }
+    localAddOverlays( list, outputSettings);
+    if( outputSettings->diagnostics) {
+        localAddDiagnostics( list, outputSettings);
+    }
+    worker_pool_run( width*height>=COMPOSITE_PARALLEL_PIXELS ? outputSettings->composite_pool : NULL,
+                     (height+list->band_height-1)/list->band_height, localCompositeBand, list);
+    pthread_mutex_unlock( &outputSettings->buffer_mutex);
+    if( outputSettings->diagnostics) {
+        outputSettings->diagnostics_blend     = list->timed_time;
+        outputSettings->diagnostics_time_sum += list->timed_time;
+    }
+}
+
+typedef struct _RenditionFeed {
+    OutputInfo *outputSettings;
+    AVFrame    *canvas;
+    int64_t     pts;
+} RenditionFeed;
+
+// One rung, waits for its encoder to have taken the last picture
+static void localScaleRendition( void *ctx, int job)
+{
+RenditionFeed *feed = ctx;
+Rendition *rung = &feed->outputSettings->renditions[job];
+AVFrame *frame = rung->settings.video_st.video_frame;
+
+    if( !rung->started)
+        return;
+    pthread_mutex_lock( &rung->mutex);
+    while( rung->full && !stop_all_tasks) {
+        localCondWait( &rung->cond, &rung->mutex);
+    }
+    pthread_mutex_unlock( &rung->mutex);
+    if( rung->full || av_frame_make_writable( frame)<0)
+        return;
+
+    sws_scale( rung->sws_ctx, (const uint8_t * const *)feed->canvas->data, feed->canvas->linesize, 0, feed->canvas->height,
+               frame->data, frame->linesize);
+    frame->pts = feed->pts;
+
+    pthread_mutex_lock( &rung->mutex);
+    rung->full = 1;
+    pthread_cond_broadcast( &rung->cond);
+    pthread_mutex_unlock( &rung->mutex);
+}
+
+/*
+ * Every rung is scaled from the finished canvas, in parallel on the
+ * compositing workers, so decoding, tile scaling and compositing are done
+ * once for the whole ladder. Each rung has one picture of buffer, the
+ * slowest encoder holds the others back and every rung gets every frame.
+ */
+static void localFeedRenditions( OutputInfo *outputSettings, AVFrame *canvas, int64_t pts)
+{
+RenditionFeed feed = { outputSettings, canvas, pts };
+
+    if( outputSettings->renditions_count) {
+        worker_pool_run( outputSettings->composite_pool, outputSettings->renditions_count, localScaleRendition, &feed);
+    }
+}
+
+static AVFrame *get_video_frame(OutputStream *ost)
+{
+    GET_OUTPUT_SETTINGS;
+    AVCodecContext *c = ost->st->codec;
+
+#if STREAM_DURATION
+    /* check if we want to generate more frames */
+    if (av_compare_ts(ost->next_pts, ost->st->codec->time_base,
+                      STREAM_DURATION, (AVRational){ 1, 1 }) >= 0)
+        return NULL;
+#else
+    if(stop_all_tasks)
+        return NULL;
+#endif
+
+    if (c->pix_fmt != STREAM_PIX_FMT) {
+        /* as we only generate a YUV420P picture, we must convert it
+         * to the codec pixel format if needed */
+        if( !ost->out_sws_ctx) {
+            ost->out_sws_ctx = sws_getContext(c->width, c->height,
+                                      STREAM_PIX_FMT,
+                                      c->width, c->height,
+                                      c->pix_fmt,
+                                      SCALE_FLAGS, NULL, NULL, NULL);
+            if (!ost->out_sws_ctx) {
+                fprintf(stderr,
+                        "Could not initialize the conversion context\n");
+                exit(1);
+            }
+        }
+        if( !ost->reuse) {
+            localCreateVideoFrame(ost->tmp_video_frame, ost->next_pts, c->width, c->height);
+            sws_scale(ost->out_sws_ctx,
+                      (const uint8_t * const *)ost->tmp_video_frame->data, ost->tmp_video_frame->linesize,
+                      0, c->height, ost->video_frame->data, ost->video_frame->linesize);
+        }
+    }
+    else if( !ost->reuse) {
+        localCreateVideoFrame(ost->video_frame, ost->next_pts, c->width, c->height);
+    }
+    if( ost->reuse) {
+        // the same picture again, nothing in it changed
+        outputSettings->roi_count = 0;
+    }
+    localAttachRegions( ost->video_frame, outputSettings, ost->pictures++, c->gop_size);
+
+    ost->video_frame->pts = ost->next_pts;
+    localFeedRenditions( outputSettings, c->pix_fmt!=STREAM_PIX_FMT ? ost->tmp_video_frame : ost->video_frame, ost->next_pts);
+    ost->next_pts += FFMAX( ost->hold, 1);
+    shown_frames  += FFMAX( ost->hold, 1);
+
+    return ost->video_frame;
+}
+
+/*
+ * encode one video frame and send it to the muxer
+ * return 1 when encoding is finished, 0 otherwise
+ */
+static int localEncodeFrame(AVFormatContext *oc, OutputStream *ost, AVFrame *frame)
+{
+    GET_OUTPUT_SETTINGS;
+    int ret;
+    AVCodecContext *c;
+    int got_packet = 0;
+
+    c = ost->st->codec;
+
+    if (oc->oformat->flags & AVFMT_RAWPICTURE) {
+        /* a hack to avoid data copy with some raw video muxers */
+        AVPacket pkt;
+        av_init_packet(&pkt);
+
+        if (!frame)
+            return 1;
+
+        pkt.flags        |= AV_PKT_FLAG_KEY;
+        pkt.stream_index  = ost->st->index;
+        pkt.data          = (uint8_t *)frame;
+        pkt.size          = sizeof(AVPicture);
+
+        pkt.pts = pkt.dts = frame->pts;
+        av_packet_rescale_ts(&pkt, c->time_base, ost->st->time_base);
+
+        ret = av_interleaved_write_frame(oc, &pkt);
+    } else {
+        AVPacket pkt = { 0 };
+        av_init_packet(&pkt);
+
+        int64_t start = localMonotonicNow();
+
+        /* encode the image */
+        ret = avcodec_encode_video2(c, &pkt, frame, &got_packet);
+        if( oc==outputSettings->oc) {
+            encode_time_sum += localMonotonicNow()-start;
+        }
+        if (ret < 0) {
+            fprintf(stderr, "Error encoding video frame: %s\n", av_err2str(ret));
+            exit(1);
+        }
+
+        if (got_packet) {
+            ret = write_frame(oc, &c->time_base, ost->st, &pkt);
+        } else {
+            ret = 0;
+        }
+    }
+
+    if (ret < 0) {
+        fprintf(stderr, "Error while writing video frame: %s\n", av_err2str(ret));
+        exit(1);
+    }
+
+    return (frame || got_packet) ? 0 : 1;
+}
+
+static int write_video_frame(AVFormatContext *oc, OutputStream *ost)
+{
+    GET_OUTPUT_SETTINGS;
+    AVFrame *frame;
+
+    if( ost->reuse && !stop_all_tasks && !outputSettings->canvas_ring && localRepeatSkipped( outputSettings, oc)) {
+        // nothing changed, the picture already sent stays up for another frame time
+        ost->next_pts++;
+        shown_frames++;
+        return 0;
+    }
+    frame = get_video_frame(ost);
+
+    if( outputSettings->canvas_ring) {
+    int64_t start = localMonotonicNow();
+
+        // the canvas goes out as it is, nothing to encode
+        if( !frame)
+            return 1;
+        canvas_ring_publish( outputSettings->canvas_ring, (const uint8_t * const *)frame->data, frame->linesize, frame->pts);
+        encoded_frames++;
+        encode_time_sum += localMonotonicNow()-start;
+        return 0;
+    }
+
+    return localEncodeFrame(oc, ost, frame);
+}
+
+static void close_stream(AVFormatContext *oc, OutputStream *ost)
+{
+    avcodec_close(ost->st->codec);
+    av_frame_free(&ost->video_frame);
+    av_frame_free(&ost->tmp_video_frame);
+    sws_freeContext(ost->out_sws_ctx);
+}
+
+/**************************************************************/
+/* media file output */
+/* Every input that has been opened has gone quiet, none is making frames */
+static int localAllStalled( void)
+{
+int opened = 0;
+int i;
+
+    for( i=0; i<inputs_count; i++) {
+        if( inputs[i]->last_frame_at) {
+            if( !inputs[i]->stalled)
+                return 0;
+            opened = 1;
+        }
+    }
+
+    return opened;
+}
+
+/*
+ * pacing="live": a frame goes out at every tick of a monotonic clock at
+ * video_framerate, made from whatever the tiles hold at the time, so late
+ * inputs repeat their last picture and fast ones only replace it. Frame n
+ * is due at start + n/framerate and has pts n; when writing falls behind
+ * by whole frame times those ticks are dropped, so the pts stay in step
+ * with the clock and the latency does not build up.
+ */
+static void localPacedOutput( OutputInfo *outputSettings)
+{
+OutputStream *ost = &outputSettings->video_st;
+int rate = FFMAX( outputSettings->video_frame_rate, 1);
+int64_t start = localMonotonicNow();
+int64_t tick = 0;
+
+    while( !stop_all_tasks) {
+    int64_t deadline = start + tick*TIMEOFDAY_S/rate;
+    int64_t late;
+    struct timespec due;
+
+        due.tv_sec  = deadline/TIMEOFDAY_S;
+        due.tv_nsec = (deadline%TIMEOFDAY_S)*1000;
+        while( clock_nanosleep( CLOCK_MONOTONIC, TIMER_ABSTIME, &due, NULL)==EINTR && !stop_all_tasks)
+            ;
+
+        late = localMonotonicNow()-deadline;
+        if( late*rate>=TIMEOFDAY_S) {
+        int64_t missed = late*rate/TIMEOFDAY_S;
+
+            tick     += missed;
+            deadline  = start + tick*TIMEOFDAY_S/rate;
+            outputSettings->pace_missed += missed;
+        }
+
+        ost->next_pts = tick;
+        ost->hold     = 1;
+        ost->reuse    = 0;
+        if( write_video_frame( outputSettings->oc, ost))
+            break;
+
+        late = localMonotonicNow()-deadline;
+        outputSettings->pace_frames++;
+        outputSettings->pace_jitter_sum += late;
+        outputSettings->pace_jitter_max  = FFMAX( outputSettings->pace_jitter_max, late);
+        tick++;
+    }
+}
+
+/*
+ * pacing="offline": frame n stands for n/framerate into the inputs and is
+ * made as soon as every input has applied what comes before it (see
+ * localOfflineTurn), nothing sleeps for a time. When the last input ends
+ * one more frame shows its last pictures and the encoder is drained.
+ */
+static void localOfflineOutput( OutputInfo *outputSettings)
+{
+OutputStream *ost = &outputSettings->video_st;
+int rate = FFMAX( outputSettings->video_frame_rate, 1);
+int64_t start = localMonotonicNow();
+int64_t n, horizon = 0;
+double took;
+
+    for( n=0; !stop_all_tasks && horizon!=OFFLINE_DONE; n++) {
+    int64_t at = n*TIMEOFDAY_S/rate;
+
+        pthread_mutex_lock( &offline_mutex);
+        offline_time = at;
+        pthread_cond_broadcast( &offline_cond);
+        while( !stop_all_tasks && (horizon = localOfflineHorizon())<=at) {
+            localCondWait( &offline_cond, &offline_mutex);
+        }
+        pthread_mutex_unlock( &offline_mutex);
+
+        ost->next_pts = n;
+        ost->hold     = 1;
+        ost->reuse    = 0;
+        if( write_video_frame( outputSettings->oc, ost))
+            break;
+    }
+
+    // get_video_frame gives nothing from here on, which flushes the encoder
+    stop_all_tasks = 1;
+    while( !write_video_frame( outputSettings->oc, ost))
+        ;
+
+    took = (double)(localMonotonicNow()-start)/TIMEOFDAY_S;
+    printf( "%lld frames, %.2fs of output in %.2fs, %.2fx real time\n", (long long)n, (double)n/rate, took,
+        took>0 ? (double)n/rate/took : 0);
+}
+
+static void localAllocSinkMuxer( Sink *sink)
+{
+    avformat_alloc_output_context2( &sink->oc, NULL, sink->format, sink->url);
+    if( !sink->oc) {
+        printf( "Could not deduce the format of sink '%s': using mpegts.\n", sink->url);
+        free( sink->format);
+        sink->format = strdup( "mpegts");
+        avformat_alloc_output_context2( &sink->oc, NULL, "mpegts", sink->url);
+    }
+}
+
+// Muxers first, the encoder has to know whether any of them wants headers in the stream
+static void localPrepareSinks( OutputInfo *outputSettings)
+{
+int i;
+
+    for( i=0; i<outputSettings->sinks_count; i++) {
+    Sink *sink = &outputSettings->sinks[i];
+
+        if( sink->segment) {
+            // HLS segments, one muxer that moves from file to file
+            free( sink->format);
+            sink->format = strdup( "mpegts");
+        }
+        localAllocSinkMuxer( sink);
+    }
+}
+
+// The playlist url without .m3u8, then _sequence.ts
+static void localSegmentPath( Sink *sink, unsigned sequence, char *path, int size)
+{
+const char *dot = strrchr( sink->url, '.');
+int length = dot && !strcmp( dot, ".m3u8") ? (int)(dot-sink->url) : (int)strlen( sink->url);
+
+    snprintf( path, size, "%.*s_%u.ts", length, sink->url, sequence);
+}
+
+// fsync of a file, or with directory set of the directory it is in
+static void localSyncPath( const char *path, int directory)
+{
+char name[1024];
+int fd;
+
+    snprintf( name, sizeof( name), "%s", path);
+    if( directory) {
+    char *slash = strrchr( name, '/');
+
+        if( !slash)
+            strcpy( name, ".");
+        else
+            slash[ slash==name] = 0;
+    }
+    fd = open( name, O_RDONLY);
+    if( fd>=0) {
+        fsync( fd);
+        close( fd);
+    }
+}
+
+/*
+ * Written next to the playlist and renamed over it, so a player never reads
+ * half a playlist, and synced before the rename so it never lists a segment
+ * that is not on the disk yet.
+ */
+static void localWritePlaylist( Sink *sink, int final)
+{
+char tmp[1024];
+char path[1024];
+int first  = FFMAX( sink->segments_count-sink->keep, 0);
+int target = 1;
+FILE *f;
+int i;
+
+    for( i=first; i<sink->segments_count; i++) {
+        target = FFMAX( target, (int)(sink->segments[i].duration+0.5));
+    }
+    snprintf( tmp, sizeof( tmp), "%s.tmp", sink->url);
+    f = fopen( tmp, "w");
+    if( !f) {
+        printf( "Could not write '%s'\n", tmp);
+        return;
+    }
+    fprintf( f, "#EXTM3U\n#EXT-X-VERSION:3\n#EXT-X-TARGETDURATION:%d\n#EXT-X-MEDIA-SEQUENCE:%u\n", target,
+        first<sink->segments_count ? sink->segments[first].sequence : sink->sequence);
+    for( i=first; i<sink->segments_count; i++) {
+    const char *name;
+
+        localSegmentPath( sink, sink->segments[i].sequence, path, sizeof( path));
+        name = strrchr( path, '/');
+        fprintf( f, "#EXTINF:%.3f,\n%s\n", sink->segments[i].duration, name ? name+1 : path);
+    }
+    if( final) {
+        fprintf( f, "#EXT-X-ENDLIST\n");
+    }
+    fflush( f);
+    fsync( fileno( f));
+    fclose( f);
+    if( rename( tmp, sink->url)) {
+        printf( "Could not replace '%s'\n", sink->url);
+        return;
+    }
+    localSyncPath( sink->url, 1);
+}
+
+static int localOpenSegment( Sink *sink)
+{
+char path[1024];
+
+    localSegmentPath( sink, sink->sequence, path, sizeof( path));
+    if( avio_open( &sink->oc->pb, path, AVIO_FLAG_WRITE)<0)
+        return 0;
+    // every segment starts with its own PAT and PMT
+    av_opt_set( sink->oc->priv_data, "mpegts_flags", "resend_headers", 0);
+    sink->segment_start = AV_NOPTS_VALUE;
+
+    return 1;
+}
+
+/*
+ * Closes the segment at end (pts, time_base), lists it and deletes the
+ * ones that left the playlist SEGMENT_GRACE segments ago, which players
+ * may still be fetching. Runs on the thread of the sink, the encoder never
+ * waits for the syncs or the directory.
+ */
+static void localCloseSegment( Sink *sink, int64_t end, int final)
+{
+char path[1024];
+
+    avio_closep( &sink->oc->pb);
+    localSegmentPath( sink, sink->sequence, path, sizeof( path));
+    localSyncPath( path, 0);
+
+    if( sink->segment_start!=AV_NOPTS_VALUE) {
+        sink->segments[ sink->segments_count].sequence = sink->sequence;
+        sink->segments[ sink->segments_count].duration = (end-sink->segment_start)*av_q2d( sink->time_base);
+        sink->segments_count++;
+    }
+    sink->sequence++;
+    localWritePlaylist( sink, final);
+
+    while( sink->segments_count>sink->keep+SEGMENT_GRACE) {
+        localSegmentPath( sink, sink->segments[0].sequence, path, sizeof( path));
+        unlink( path);
+        sink->segments_count--;
+        memmove( sink->segments, sink->segments+1, sink->segments_count*sizeof( SinkSegment));
+    }
+}
+
+// Cuts the segment before a key frame once it has its gops, 0 if the packet can be written
+static int localSegmentPacket( Sink *sink, AVPacket *pkt)
+{
+    sink->last_pts = FFMAX( sink->last_pts, pkt->pts);
+    if( !(pkt->flags & AV_PKT_FLAG_KEY))
+        return sink->oc->pb ? 0 : -1;
+
+    if( sink->oc->pb && sink->segment_start!=AV_NOPTS_VALUE &&
+        pkt->pts-sink->segment_start>=sink->segment_ticks-sink->frame_ticks/2) {
+        // what the muxer still holds goes into the old segment
+        av_write_frame( sink->oc, NULL);
+        localCloseSegment( sink, pkt->pts, 0);
+    }
+    if( !sink->oc->pb && !localOpenSegment( sink))
+        return -1;
+    if( sink->segment_start==AV_NOPTS_VALUE) {
+        sink->segment_start = pkt->pts;
+    }
+
+    return 0;
+}
+
+// Stream, file or connection and header on the muxer in sink->oc, an AVERROR if any failed
+static int localOpenMuxer( Sink *sink)
+{
+int ret;
+
+    sink->st = avformat_new_stream( sink->oc, NULL);
+    if( !sink->st)
+        return AVERROR( ENOMEM);
+    ret = avcodec_copy_context( sink->st->codec, sink->codec);
+    if( ret<0)
+        return ret;
+    // the tag of the output format may mean nothing to this one
+    sink->st->codec->codec_tag = 0;
+    sink->st->time_base = sink->codec->time_base;
+
+    if( sink->segment) {
+        if( !localOpenSegment( sink))
+            return AVERROR( EIO);
+    }
+    else if( !(sink->oc->oformat->flags & AVFMT_NOFILE)) {
+        ret = avio_open( &sink->oc->pb, sink->url, AVIO_FLAG_WRITE);
+        if( ret<0)
+            return ret;
+    }
+
+    return avformat_write_header( sink->oc, NULL);
+}
+
+static int localOpenSink( Sink *sink, OutputInfo *outputSettings)
+{
+OutputStream *ost = &outputSettings->video_st;
+int ret;
+
+    if( sink->segment) {
+    AVCodecContext *c = ost->st->codec;
+    int gop = FFMAX( c->gop_size, 1);
+    int64_t frames = av_rescale_q( sink->segment, (AVRational){ 1, 1 }, c->time_base);
+
+        // the encoder makes a key frame every gop_size pictures and only there
+        frames = FFMAX( (frames+gop/2)/gop, 1)*gop;
+        sink->frame_ticks   = FFMAX( av_rescale_q( 1, c->time_base, ost->st->time_base), 1);
+        sink->segment_ticks = av_rescale_q( frames, c->time_base, ost->st->time_base);
+        sink->last_pts      = AV_NOPTS_VALUE;
+        // numbered from the start time, a restart does not write over what is still listed
+        sink->sequence      = outputSettings->pacing==PACING_OFFLINE ? 0 : (unsigned)time( NULL);
+        sink->segments      = calloc( sink->keep+SEGMENT_GRACE+1, sizeof( SinkSegment));
+        if( !sink->queue_size) {
+            // a sync or a slow directory may hold the writer back for a while
+            sink->queue_size = FFMAX( SINK_QUEUE, 2*frames);
+        }
+        if( !sink->segments)
+            return 0;
+    }
+    if( !sink->queue_size) {
+        sink->queue_size = SINK_QUEUE;
+    }
+    sink->queue = calloc( sink->queue_size, sizeof( AVPacket *));
+    sink->codec = avcodec_alloc_context3( NULL);
+    if( !sink->oc || !sink->queue || !sink->codec || avcodec_copy_context( sink->codec, ost->st->codec)<0)
+        return 0;
+    sink->time_base = ost->st->time_base;
+
+    ret = localOpenMuxer( sink);
+    if( ret<0) {
+        fprintf( stderr, "Could not open sink '%s': %s\n", sink->url, av_err2str( ret));
+        return 0;
+    }
+
+    return 1;
+}
+
+static void localFreeMuxer( Sink *sink)
+{
+    if( sink->oc) {
+        if( sink->oc->pb && !(sink->oc->oformat->flags & AVFMT_NOFILE))
+            avio_closep( &sink->oc->pb);
+        avformat_free_context( sink->oc);
+        sink->oc = NULL;
+        sink->st = NULL;
+    }
+}
+
+static void localCloseSink( Sink *sink)
+{
+    localFreeMuxer( sink);
+    avcodec_free_context( &sink->codec);
+    free( sink->queue);
+    free( sink->segments);
+    sink->queue    = NULL;
+    sink->segments = NULL;
+}
+
+/*
+ * The error of an AVIOContext sticks, so a sink is never written on after a
+ * failed write. A segment is cut short, not listed and deleted; a network
+ * sink drops its muxer and connection; both are opened again at the first
+ * key frame after the backoff, twice as long each time up to
+ * SINK_BACKOFF_MAX. A file sink stops for good, opening it again would
+ * truncate what it recorded.
+ */
+static void localSinkFailed( Sink *sink, int ret)
+{
+    if( !sink->backoff) {
+        printf( "Sink '%s' could not be written: %s\n", sink->url, av_err2str( ret));
+    }
+    sink->backoff  = FFMIN( FFMAX( sink->backoff*2, TIMEOFDAY_S/100), SINK_BACKOFF_MAX);
+    sink->retry_at = localMonotonicNow()+sink->backoff;
+    sink->down     = 1;
+
+    if( sink->segment) {
+        if( sink->oc->pb) {
+        char path[1024];
+
+            avio_closep( &sink->oc->pb);
+            localSegmentPath( sink, sink->sequence, path, sizeof( path));
+            unlink( path);
+        }
+    }
+    else if( strstr( sink->url, "://") && strncmp( sink->url, "file:", 5)) {
+        localFreeMuxer( sink);
+    }
+    else {
+        printf( "Sink '%s' stopped, a file is not opened over what it recorded\n", sink->url);
+        sink->dead = 1;
+    }
+}
+
+// 1 if the packet can go to the muxer, a sink that is down is opened again on a key frame
+static int localSinkReady( Sink *sink, AVPacket *pkt)
+{
+int ret;
+
+    if( !sink->down)
+        return 1;
+    if( sink->dead || !(pkt->flags & AV_PKT_FLAG_KEY) || localMonotonicNow()<sink->retry_at)
+        return 0;
+
+    if( sink->segment) {
+        ret = localOpenSegment( sink) ? 0 : AVERROR( EIO);
+    }
+    else {
+        localAllocSinkMuxer( sink);
+        ret = sink->oc ? localOpenMuxer( sink) : AVERROR( ENOMEM);
+    }
+    if( ret<0) {
+        localSinkFailed( sink, ret);
+        return 0;
+    }
+    printf( "Sink '%s' is written again\n", sink->url);
+    sink->down = 0;
+
+    return 1;
+}
+
+/*
+ * Writes the queue of one sink. While it is down after a failed write its
+ * packets are dropped, and the encoder and the other sinks carry on.
+ */
+static void *localSinkThread( void *_sink)
+{
+Sink *sink = _sink;
+
+    while( 1) {
+    AVPacket *pkt;
+    int ret;
+
+        pthread_mutex_lock( &sink->mutex);
+        while( !sink->count && !sink->stop) {
+            localCondWait( &sink->cond, &sink->mutex);
+        }
+        if( !sink->count) {
+            pthread_mutex_unlock( &sink->mutex);
+            break;
+        }
+        pkt = sink->queue[ sink->head];
+        sink->head = (sink->head+1)%sink->queue_size;
+        sink->count--;
+        pthread_mutex_unlock( &sink->mutex);
+
+        if( !localSinkReady( sink, pkt)) {
+            sink->dropped++;
+            av_packet_free( &pkt);
+            continue;
+        }
+        if( sink->segment && localSegmentPacket( sink, pkt)<0) {
+            // the next segment could not be opened
+            ret = AVERROR( EIO);
+        }
+        else {
+            av_packet_rescale_ts( pkt, sink->time_base, sink->st->time_base);
+            pkt->stream_index = sink->st->index;
+            ret = av_interleaved_write_frame( sink->oc, pkt);
+        }
+        av_packet_free( &pkt);
+        if( ret<0) {
+            localSinkFailed( sink, ret);
+        }
+        else {
+            sink->backoff = 0;
+            sink->written++;
+        }
+    }
+
+    return NULL;
+}
+
+// Once the output has its header, so the sinks take its time base
+static void localStartSinks( OutputInfo *outputSettings)
+{
+int i;
+
+    for( i=0; i<outputSettings->sinks_count; i++) {
+    Sink *sink = &outputSettings->sinks[i];
+
+        pthread_mutex_init( &sink->mutex, NULL);
+        pthread_cond_init( &sink->cond, NULL);
+        if( !localOpenSink( sink, outputSettings) || pthread_create( &sink->thread, NULL, localSinkThread, sink)) {
+            printf( "Sink '%s' could not be started\n", sink->url);
+            localCloseSink( sink);
+            continue;
+        }
+        sink->started = 1;
+    }
+}
+
+// After the encoder was drained, every sink writes what it has queued
+static void localStopSinks( OutputInfo *outputSettings)
+{
+int i;
+
+    for( i=0; i<outputSettings->sinks_count; i++) {
+    Sink *sink = &outputSettings->sinks[i];
+
+        if( sink->started) {
+            pthread_mutex_lock( &sink->mutex);
+            sink->stop = 1;
+            pthread_cond_broadcast( &sink->cond);
+            pthread_mutex_unlock( &sink->mutex);
+            pthread_join( sink->thread, NULL);
+            if( !sink->down) {
+                av_write_trailer( sink->oc);
+            }
+            if( sink->segment && !sink->down) {
+                localCloseSegment( sink, sink->last_pts+sink->frame_ticks, 1);
+            }
+            sink->started = 0;
+        }
+        localCloseSink( sink);
+    }
+}
+
+/*
+ * Muxer, encoder, file and header for the output, 0 if any of it failed.
+ * The mosaic and every rung of its ladder go through here.
+ */
+static int localOpenOutput( OutputInfo *outputSettings)
+{
+    AVOutputFormat *fmt;
+    int ret;
+    AVDictionary *opt = NULL;
+
+   /* allocate the output media context */
+    if( !strncmp( outputSettings->filename, "shm:", 4)) {
+        // raw canvases to shared memory; a rawvideo stream that is never encoded
+        // keeps the codec context the rest of the output goes by
+        avformat_alloc_output_context2(&outputSettings->oc, NULL, "null", NULL);
+    }
+    else
+        avformat_alloc_output_context2(&outputSettings->oc, NULL, NULL, outputSettings->filename);
+    if (!outputSettings->oc) {
+        printf("Could not deduce output format from file extension: using mpegts.\n");
+        avformat_alloc_output_context2(&outputSettings->oc, NULL, "mpegts", outputSettings->filename);
+    }
+    if (!outputSettings->oc)
+        return 0;
+
+    fmt = outputSettings->oc->oformat;
+
+    // a paced output makes one frame per tick, there is nothing to repeat
+    if( outputSettings->pacing!=PACING_FRAMES) {
+        outputSettings->frame_hold = HOLD_ENCODE;
+    }
+    if( outputSettings->pacing==PACING_OFFLINE) {
+        // no version strings or dates in the file, the same input gives the same bytes
+        outputSettings->oc->flags |= AVFMT_FLAG_BITEXACT;
+        if( outputSettings->diagnostics) {
+            printf( "diagnostics show timings, they are off for offline output\n");
+            outputSettings->diagnostics = 0;
+        }
+    }
+    if( outputSettings->roi_offset && !HAVE_REGIONS) {
+        printf( "roi_offset needs libavutil 56.29 (FFmpeg 4.2) or later, no region hints\n");
+        outputSettings->roi_offset = 0;
+    }
+
+    // the same rule ffmpeg uses to pick vfr, avi writes the gaps as skipped frames
+    if( outputSettings->frame_hold==HOLD_VFR && !(fmt->flags & AVFMT_VARIABLE_FPS) && strcmp( fmt->name, "avi")) {
+        printf( "%s needs a constant frame rate, holding pictures a frame time at a time\n", fmt->name);
+        outputSettings->frame_hold = HOLD_REPEAT;
+    }
+
+    localPrepareSinks( outputSettings);
+
+    /* Add the audio and video streams using the default format codecs
+     * and initialize the codecs. */
+    if (fmt->video_codec != AV_CODEC_ID_NONE) {
+        add_stream(&outputSettings->video_st, outputSettings->oc, &outputSettings->video_codec,
+                   strncmp( outputSettings->filename, "shm:", 4) ? outputSettings->video_encoding : AV_CODEC_ID_RAWVIDEO, outputSettings);
+    }
+
+    /* Now that all the parameters are set, we can open the audio and
+     * video codecs and allocate the necessary encode buffers. */
+    if (outputSettings->video_st.st &&
+        !open_video(outputSettings->oc, outputSettings->video_codec, &outputSettings->video_st, opt, outputSettings)) {
+        // a rung that cannot be encoded is left out, the rest of the ladder carries on
+        close_stream(outputSettings->oc, &outputSettings->video_st);
+        avformat_free_context(outputSettings->oc);
+        outputSettings->oc = NULL;
+        return 0;
+    }
+
+    av_dump_format(outputSettings->oc, 0, outputSettings->filename, 1);
+
+    /* open the output file, if needed */
+    if (!(fmt->flags & AVFMT_NOFILE)) {
+        ret = avio_open(&outputSettings->oc->pb, outputSettings->filename, AVIO_FLAG_WRITE);
+        if (ret < 0) {
+            fprintf(stderr, "Could not open '%s': %s\n", outputSettings->filename,
+                    av_err2str(ret));
+            return 0;
+        }
+    }
+
+    /* Write the stream header, if any. */
+    ret = avformat_write_header(outputSettings->oc, &opt);
+    if (ret < 0) {
+        fprintf(stderr, "Error occurred when opening output file: %s\n",
+                av_err2str(ret));
+        return 0;
+    }
+    if( !strncmp( outputSettings->filename, "shm:", 4) && outputSettings->video_st.st) {
+    AVCodecContext *c = outputSettings->video_st.st->codec;
+
+        outputSettings->canvas_ring = canvas_ring_create( outputSettings->filename+4, c->width, c->height,
+                                                          outputSettings->ring_slots, c->time_base.num, c->time_base.den);
+        if( !outputSettings->canvas_ring)
+            return 0;
+        if( outputSettings->sinks_count) {
+            printf( "'%s' has no packets for its sinks, they are not started\n", outputSettings->filename);
+        }
+    }
+    else if (outputSettings->video_st.st)
+        localStartSinks( outputSettings);
+
+    return 1;
+}
+
+static void localCloseOutput( OutputInfo *outputSettings)
+{
+    localStopSinks( outputSettings);
+    canvas_ring_destroy( outputSettings->canvas_ring);
+    outputSettings->canvas_ring = NULL;
+
+    /* Write the trailer, if any. The trailer must be written before you
+     * close the CodecContexts open when you wrote the header; otherwise
+     * av_write_trailer() may try to use memory that was freed on
+     * av_codec_close(). */
+    av_write_trailer(outputSettings->oc);
+
+    /* Close each codec. */
+    if (outputSettings->video_st.st)
+        close_stream(outputSettings->oc, &outputSettings->video_st);
+
+    if (!(outputSettings->oc->oformat->flags & AVFMT_NOFILE))
+        /* Close the output file. */
+        avio_close(outputSettings->oc->pb);
+
+    /* free the stream */
+    avformat_free_context(outputSettings->oc);
+    outputSettings->oc = NULL;
+}
 
-        avio_close(inputSource->fmt_ctx->pb);
-        avformat_close_input(&inputSource->fmt_ctx);
+static void *localRenditionThread( void *_rendition)
+{
+Rendition *rung = _rendition;
+OutputStream *ost = &rung->settings.video_st;
 
-        av_dict_free( &d);
+    while( 1) {
+    int full;
 
-        avformat_free_context (inputSource->fmt_ctx);
+        pthread_mutex_lock( &rung->mutex);
+        while( !rung->full && !rung->stop && !stop_all_tasks) {
+            localCondWait( &rung->cond, &rung->mutex);
+        }
+        full = rung->full;
+        pthread_mutex_unlock( &rung->mutex);
+        if( !full)
+            break;
+
+        localEncodeFrame( rung->settings.oc, ost, ost->video_frame);
+
+        pthread_mutex_lock( &rung->mutex);
+        rung->full = 0;
+        pthread_cond_broadcast( &rung->cond);
+        pthread_mutex_unlock( &rung->mutex);
     }
 
-    inputSource->finished = 1;
+    // drain the encoder
+    while( !localEncodeFrame( rung->settings.oc, ost, NULL))
+        ;
+    localCloseOutput( &rung->settings);
 
     return NULL;
 }
 
-static void log_packet(const AVFormatContext *fmt_ctx, const AVPacket *pkt)
+/*
+ * Opens every rung of the ladder once the mosaic itself is open, a rung
+ * that cannot be opened is left out and the others carry on.
+ */
+static void localStartRenditions( OutputInfo *outputSettings)
 {
-    if (!pkt->stream_index && verbose) {
-        AVRational *time_base = &fmt_ctx->streams[pkt->stream_index]->time_base;
-
-        printf("pts_time:%-12s dts_time:%-12s duration_time:%s stream_index:%d [pts:%s dts:%s duration:%s]\n",
-           av_ts2timestr(pkt->pts, time_base), av_ts2timestr(pkt->dts, time_base), av_ts2timestr(pkt->duration, time_base),
-           pkt->stream_index,
-           av_ts2str(pkt->pts), av_ts2str(pkt->dts), av_ts2str(pkt->duration));
+int r;
+
+    for( r=0; r<outputSettings->renditions_count; r++) {
+    Rendition *rung = &outputSettings->renditions[r];
+    OutputInfo *settings = &rung->settings;
+
+        // only what the encoder and muxer go by, none of the locks, pools or tiles of the canvas
+        memset( settings, 0, sizeof( OutputInfo));
+        settings->video_encoding   = outputSettings->video_encoding;
+        settings->video_frame_rate = outputSettings->video_frame_rate;
+        settings->gop_size         = outputSettings->gop_size;
+        settings->x264_preset      = rung->x264_preset ? rung->x264_preset : outputSettings->x264_preset;
+        settings->x264_threads     = outputSettings->x264_threads;
+        settings->frames_count     = outputSettings->frames_count;
+        settings->frame_hold       = outputSettings->frame_hold;
+        settings->pacing           = outputSettings->pacing;
+        settings->profile          = outputSettings->profile;
+        settings->ring_slots       = outputSettings->ring_slots;
+        settings->renditions_count = outputSettings->renditions_count;    // keeps the key frames of the ladder together
+        settings->screen_width     = FFMIN( rung->width, outputSettings->screen_width);
+        settings->screen_height    = FFMIN( rung->height, outputSettings->screen_height);
+        settings->video_bitrate    = rung->video_bitrate;
+        settings->filename         = rung->filename;
+        pthread_mutex_init( &rung->mutex, NULL);
+        pthread_cond_init( &rung->cond, NULL);
+
+        if( !localOpenOutput( settings)) {
+            printf( "Rendition %dx%d '%s' could not be opened\n", settings->screen_width, settings->screen_height, rung->filename);
+            continue;
+        }
+        rung->sws_ctx = sws_getContext( outputSettings->screen_width, outputSettings->screen_height, STREAM_PIX_FMT,
+                                        settings->screen_width, settings->screen_height, settings->video_st.st->codec->pix_fmt,
+                                        SWS_BICUBIC, NULL, NULL, NULL);
+        if( !rung->sws_ctx || pthread_create( &rung->thread, NULL, localRenditionThread, rung)) {
+            printf( "Rendition %dx%d '%s' could not be started\n", settings->screen_width, settings->screen_height, rung->filename);
+            localCloseOutput( settings);
+            continue;
+        }
+        rung->started = 1;
     }
 }
 
-static int write_frame(AVFormatContext *fmt_ctx, const AVRational *time_base, AVStream *st, AVPacket *pkt)
+// Lets every rung encode what it still has and write its trailer
+static void localStopRenditions( OutputInfo *outputSettings)
 {
-    /* rescale output packet timestamp values from codec to stream timebase */
-    av_packet_rescale_ts(pkt, *time_base, st->time_base);
-    pkt->stream_index = st->index;
-
-    if( !st->index) {
-        encoded_frames++;
+int r;
+
+    for( r=0; r<outputSettings->renditions_count; r++) {
+    Rendition *rung = &outputSettings->renditions[r];
+
+        if( !rung->started)
+            continue;
+        pthread_mutex_lock( &rung->mutex);
+        rung->stop = 1;
+        pthread_cond_broadcast( &rung->cond);
+        pthread_mutex_unlock( &rung->mutex);
+        pthread_join( rung->thread, NULL);
+        rung->started = 0;
     }
-    /* Write the compressed frame to the media file. */
-    log_packet(fmt_ctx, pkt);
-    return av_interleaved_write_frame(fmt_ctx, pkt);
 }
 
-/* Add an output stream. */
-static void add_stream(OutputStream *ost, AVFormatContext *oc,
-                       AVCodec **codec,
-                       enum AVCodecID codec_id,
-                       OutputInfo *outputSettings)
+void *outputThread( void *_outputSettings)
 {
-    AVCodecContext *c;
+    OutputInfo *outputSettings = _outputSettings;
+    int encode_video = 0;
+    int64_t last_frame = 0;
+    int repeats_left = 0;
 
-    /* find the encoder */
-    *codec = avcodec_find_encoder(codec_id);
-    if (!(*codec)) {
-        fprintf(stderr, "Could not find encoder for '%s'\n", avcodec_get_name(codec_id));
-        exit(1);
-    }
+    if( !localOpenOutput( outputSettings))
+        return NULL;
+    encode_video = outputSettings->video_st.st!=NULL;
+    localStartRenditions( outputSettings);
 
-    ost->st = avformat_new_stream(oc, *codec);
-    if (!ost->st) {
-        fprintf(stderr, "Could not allocate stream\n");
-        exit(1);
+    if( outputSettings->pacing==PACING_LIVE) {
+        localPacedOutput( outputSettings);
+        encode_video = 0;
     }
-    ost->st->id = oc->nb_streams-1;
-    c = ost->st->codec;
+    else if( outputSettings->pacing==PACING_OFFLINE) {
+        localOfflineOutput( outputSettings);
+        encode_video = 0;
+    }
+    while (!stop_all_tasks && (encode_video)) {
+        if( frame_ready) {
+        OutputStream *ost = &outputSettings->video_st;
+        int ready;
 
-    switch ((*codec)->type) {
-    case AVMEDIA_TYPE_AUDIO:
-        c->sample_fmt     = outputSettings->audio_format;
-        c->bit_rate       = outputSettings->audio_bit_rate;        // AUDIO_BIT_RATE; // 64000
-        c->sample_rate    = outputSettings->audio_sample_rate;     // AUDIO_SAMPLE_RATE; // 44100;
-        c->channels       = outputSettings->audio_channels;
-        c->channel_layout = av_get_default_channel_layout(c->channels);
-        if ((*codec)->supported_samplerates) {
-        int i;
+            // taken under the lock the inputs set it with, so a new mosaic is never counted off
+            pthread_mutex_lock( &outputSettings->buffer_mutex);
+            ready       = frame_ready;
+            frame_ready = outputSettings->frame_hold==HOLD_VFR ? 0 : ready-1;
+            pthread_mutex_unlock( &outputSettings->buffer_mutex);
 
-            c->sample_rate = (*codec)->supported_samplerates[0];
-            for (i = 0; (*codec)->supported_samplerates[i]; i++) {
-                if ((*codec)->supported_samplerates[i] == outputSettings->audio_sample_rate)
-                    c->sample_rate = outputSettings->audio_sample_rate;
+            // a count that went down by one since the last picture is a repeat of it
+            ost->reuse = outputSettings->frame_hold==HOLD_REPEAT && repeats_left && ready==repeats_left;
+            if( outputSettings->frame_hold==HOLD_VFR) {
+                // one picture, shown until the pts of the next one
+                ost->hold = ready;
             }
+            encode_video = !write_video_frame(outputSettings->oc, ost);
+            repeats_left = outputSettings->frame_hold==HOLD_VFR ? 0 : ready-1;
+            ost->hold    = 1;
+            last_frame   = localTimeNow();
         }
-        c->channels       = av_get_channel_layout_nb_channels(c->channel_layout);
-        c->channel_layout = AV_CH_LAYOUT_STEREO;
-        if ((*codec)->channel_layouts) {
-        int i;
-
-            c->channel_layout = (*codec)->channel_layouts[0];
-            for (i = 0; (*codec)->channel_layouts[i]; i++) {
-                if ((*codec)->channel_layouts[i] == AV_CH_LAYOUT_STEREO)
-                    c->channel_layout = AV_CH_LAYOUT_STEREO;
-            }
+        else if( localAllStalled() && localTimeNow()-last_frame>=TIMEOFDAY_S/FFMAX( outputSettings->video_frame_rate, 1)) {
+            // nothing is coming in, keep the frame rate going with the slates
+            outputSettings->video_st.reuse = 0;
+            encode_video = !write_video_frame(outputSettings->oc, &outputSettings->video_st);
+            last_frame = localTimeNow();
         }
-        c->channels        = av_get_channel_layout_nb_channels(c->channel_layout);
-//        ost->st->time_base = (AVRational){ 1, c->sample_rate };
-//        c->time_base       = ost->st->time_base;
-        c->time_base       = (AVRational){ 1, c->sample_rate };
-        break;
+        usleep( 500);
+    }
 
-    case AVMEDIA_TYPE_VIDEO:
-        c->codec_id = outputSettings->video_encoding;
-        c->bit_rate = outputSettings->video_bitrate;
-        c->width    = outputSettings->screen_width;      /* Resolution must be a multiple of two. */
-        c->height   = outputSettings->screen_height;
-        /* timebase: This is the fundamental unit of time (in seconds) in terms
-         * of which frame timestamps are represented. For fixed-fps content,
-         * timebase should be 1/framerate and timestamp increments should be
-         * identical to 1. */
-        ost->st->time_base = (AVRational){ 1, outputSettings->video_frame_rate };
-        c->time_base     = ost->st->time_base;
-        c->gop_size      = outputSettings->gop_size;    // 12; /* emit one intra frame every twelve frames at most */
-        c->pix_fmt       = STREAM_PIX_FMT;
-        if (c->codec_id == AV_CODEC_ID_H264) {
-            av_opt_set( c->priv_data, "preset", outputSettings->x264_preset, 0);
-        }
-        if (c->codec_id == AV_CODEC_ID_MPEG2VIDEO) {
-            /* just for testing, we also add B frames */
-            c->max_b_frames = 2;
+    localStopRenditions( outputSettings);
+    localCloseOutput( outputSettings);
+
+    return NULL;
+}
+
+/*
+ * Runs once a second. An input with no picture for WATCHDOG_STALL shows its
+ * slate, and its reads are interrupted so that inputThread reopens it. An
+ * open and probe that hangs for WATCHDOG_PROBE is interrupted the same way.
+ */
+static void localWatchdog( void)
+{
+int64_t now = localTimeNow();
+int i;
+
+    for( i=0; i<inputs_count; i++) {
+    inputMosaic *inputSource = inputs[i];
+
+        if( inputSource->finished)
+            continue;
+        if( inputSource->probing) {
+            if( now-inputSource->probe_at>WATCHDOG_PROBE && !inputSource->reconnect) {
+                printf( "%s: no answer after %ds, giving up on this attempt\n", inputSource->name, (int)((now-inputSource->probe_at)/TIMEOFDAY_S));
+                inputSource->stalled   = 1;
+                inputSource->reconnect = 1;
+            }
+            continue;
         }
-        if (c->codec_id == AV_CODEC_ID_MPEG1VIDEO) {
-            /* Needed to avoid using macroblocks in which some coeffs overflow.
-             * This does not happen with normal video, it just happens here as
-             * the motion of the chroma plane does not match the luma plane. */
-            c->mb_decision = 2;
+        if( !inputSource->last_frame_at)
+            continue;
+        // only a picture that reaches a tile clears stalled, a new attempt does not
+        if( now-inputSource->last_frame_at>WATCHDOG_STALL) {
+            if( !inputSource->stalled) {
+                printf( "%s: no signal for %ds\n", inputSource->name, (int)((now-inputSource->last_frame_at)/TIMEOFDAY_S));
+            }
+            inputSource->stalled   = 1;
+            inputSource->reconnect = 1;
         }
-        break;
-
-    default:
-        break;
     }
-
-    /* Some formats want stream headers to be separate. */
-    if (oc->oformat->flags & AVFMT_GLOBALHEADER)
-        c->flags |= CODEC_FLAG_GLOBAL_HEADER;
 }
 
-static AVFrame *alloc_picture(enum AVPixelFormat pix_fmt, int width, int height)
+void *mainThread( void *_outputMosaic)
 {
-    AVFrame *picture;
-    int ret;
-
-    picture = av_frame_alloc();
-    if (!picture)
-        return NULL;
+OutputInfo *outputSettings = _outputMosaic;
+int error;
+int t;
+int tile_replace;
 
-    picture->format = pix_fmt;
-    picture->width  = width;
-    picture->height = height;
+    for( tile_replace=0; tile_replace<inputs_count; tile_replace++) {
+    inputMosaic *thisOne = inputs[ tile_replace];
 
-    /* allocate the buffers for the frame data */
-    ret = av_frame_get_buffer(picture, 32);
-    if (ret < 0) {
-        fprintf(stderr, "Could not allocate frame data.\n");
-        exit(1);
+        // nothing of a covered tile is ever seen, so it is not even opened
+        if( outputSettings->mode==MODE_MAPPED && (!thisOne->mapped_tile || thisOne->mapped_tile->hidden)) {
+            printf( "Input %d not started, its tile is covered\n", tile_replace);
+            thisOne->running      = 0;
+            thisOne->offline_next = OFFLINE_DONE;
+            continue;
+        }
+        // Create thread
+        error = pthread_create( &thisOne->pulledThread, NULL, inputThread, (void *)thisOne);
+        if (!error) {
+            pthread_detach( thisOne->pulledThread);
+        }
+        else {
+            thisOne->running      = 0;
+            thisOne->offline_next = OFFLINE_DONE;
+        }
+        if( outputSettings->pacing!=PACING_OFFLINE) {
+            sleep(1);
+        }
     }
 
-    return picture;
-}
+    while(!stop_all_tasks) {
+    int timedOut = 0;
 
+        if( timedOut) {
+            pthread_mutex_lock( &outputSettings->buffer_mutex);
+            pthread_mutex_unlock( &outputSettings->buffer_mutex);
+        }
+        encoded_frames  = 0;
+        shown_frames    = 0;
+        encoded_bytes   = 0;
+        encode_time_sum = 0;
+        {
+        int t;
 
-static void open_video(AVFormatContext *oc, AVCodec *codec, OutputStream *ost, AVDictionary *opt_arg, OutputInfo *outputSettings)
-{
-    int ret;
-    AVCodecContext *c = ost->st->codec;
-    AVDictionary *opt = NULL;
+            sleep( 1);
+            if( outputSettings->pacing==PACING_OFFLINE) {
+                printf( "speed %.2fx ", (double)shown_frames/FFMAX( outputSettings->video_frame_rate, 1));
+            }
+            else {
+                localWatchdog();
+            }
+            printf( "Number of encoded frames %d (%d shown) %dkbit/s %dus/frame  ", encoded_frames, shown_frames,
+                encoded_bytes/125, encoded_frames ? encode_time_sum/encoded_frames : 0);
+            for( t=0; t<outputSettings->renditions_count; t++) {
+            Rendition *rung = &outputSettings->renditions[t];
 
-    av_dict_copy(&opt, opt_arg, 0);
+                if( rung->started) {
+                    printf( "%dp %d/%dkbit/s ", rung->settings.screen_height, rung->encoded_frames, rung->encoded_bytes/125);
+                }
+                rung->encoded_frames = 0;
+                rung->encoded_bytes  = 0;
+            }
+            for( t=0; t<outputSettings->sinks_count; t++) {
+            Sink *sink = &outputSettings->sinks[t];
 
-    ost->final_video_frame = NULL;
-    if (outputSettings->final_width && outputSettings->final_height) {
-        /* open the codec */
-        ret = avcodec_open2(c, codec, &opt);
-        av_dict_free(&opt);
-        if (ret < 0) {
-            fprintf(stderr, "Could not open video codec: %s\n", av_err2str(ret));
-            exit(1);
-        }
-    }
+                if( sink->started) {
+                    printf( "sink%d %d/%d dropped%s ", t, sink->written, sink->dropped, sink->dead ? " stopped" : sink->down ? " down" : "");
+                }
+                sink->written = 0;
+                sink->dropped = 0;
+            }
+            for(t=0;t<outputSettings->tiles_count;t++) {
+            Tiles *tile = outputSettings->tiles[t];
 
-    /* allocate and init a re-usable frame */
-    ost->video_frame = alloc_picture(c->pix_fmt, c->width, c->height);
-    if (!ost->video_frame) {
-        fprintf(stderr, "Could not allocate video frame\n");
-        exit(1);
+                printf( "%d/%dus ", tile->updates_per_second, tile->updates_per_second ? tile->scale_time_sum/tile->updates_per_second : 0);
+                if( tile->source && tile->source->auto_w) {
+                    printf( "[%dx%d] ", tile->source->auto_w, tile->source->auto_h);
+                }
+                tile->updates_last       = tile->updates_per_second;
+                tile->updates_per_second = 0;
+                tile->scale_time_sum     = 0;
+            }
+            if( outputSettings->diagnostics_frames) {
+                printf( "diagnostics %dus/frame ", outputSettings->diagnostics_time_sum/outputSettings->diagnostics_frames);
+                outputSettings->diagnostics_time_sum = 0;
+                outputSettings->diagnostics_frames   = 0;
+            }
+            if( outputSettings->pace_frames) {
+                printf( "late %d jitter %d/%dus ", outputSettings->pace_missed,
+                    outputSettings->pace_jitter_sum/outputSettings->pace_frames, outputSettings->pace_jitter_max);
+                outputSettings->pace_frames     = 0;
+                outputSettings->pace_missed     = 0;
+                outputSettings->pace_jitter_sum = 0;
+                outputSettings->pace_jitter_max = 0;
+            }
+            printf( "\r\n");
+        }
     }
+    sleep(5);
 
-   /* If the output format is not YUV420P, then a temporary YUV420P
-    * picture is needed too. It is then converted to the required
-    * output format. */
-    ost->tmp_video_frame = NULL;
-    if (c->pix_fmt != STREAM_PIX_FMT) {
-        ost->tmp_video_frame = alloc_picture(STREAM_PIX_FMT, c->width, c->height);
-        if (!ost->tmp_video_frame) {
-            fprintf(stderr, "Could not allocate temporary picture\n");
-            exit(1);
-       }
-    }
+    return NULL;
 }
 
-/* Prepare a dummy image. */
-static void localCreateVideoFrame(AVFrame *pict, int frame_index,
-                           int width, int height)
+/*
+ * Bring the loaded background image to the canvas size and pixel format
+ * once, so that compositing it is a plain copy.
+ */
+static void localPrepareBackground( OutputInfo *outputSettings)
 {
-    GET_OUTPUT_SETTINGS;
-    int x, y, ret;
+AVFrame *loaded = outputSettings->background_frame;
+AVFrame *canvas = NULL;
+struct SwsContext *sws = NULL;
 
-    /* when we pass a frame to the encoder, it may keep a reference to it
-     * internally;
-     * make sure we do not overwrite it here
-     */
-    ret = av_frame_make_writable(pict);
-    if (ret < 0)
-        exit(1);
+    if( !loaded)
+        return;
 
-    if( outputSettings->background) {
-        av_image_copy( pict->data, pict->linesize,
-            (const uint8_t **)(outputSettings->background_frame->data), outputSettings->background_frame->linesize,
-            outputSettings->background_frame->format, outputSettings->background_frame->width, outputSettings->background_frame->height);
+    if( loaded->data[0]) {
+        sws = sws_getContext( loaded->width, loaded->height, loaded->format,
+                              outputSettings->screen_width, outputSettings->screen_height, STREAM_PIX_FMT,
+                              SCALE_FLAGS, NULL, NULL, NULL);
     }
-    else if( !outputSettings->fillColourY) {
-    int i = frame_index;
-
-        /* Y */
-        for (y = 0; y < height; y++)
-            for (x = 0; x < width; x++)
-                pict->data[0][y * pict->linesize[0] + x] = x + y + i * 3;
-
-        /* Cb and Cr */
-        for (y = 0; y < height / 2; y++) {
-            for (x = 0; x < width / 2; x++) {
-                pict->data[1][y * pict->linesize[1] + x] = 128 + y + i * 2;
-                pict->data[2][y * pict->linesize[2] + x] = 64 + x + i * 5;
-            }
-        }
+    if( sws) {
+        canvas = alloc_picture( STREAM_PIX_FMT, outputSettings->screen_width, outputSettings->screen_height);
+        sws_scale( sws, (const uint8_t * const *)loaded->data, loaded->linesize, 0, loaded->height, canvas->data, canvas->linesize);
+        sws_freeContext( sws);
     }
     else {
-        /* Y */
-        for (y = 0; y < height; y++)
-            for (x = 0; x < width; x++)
-                pict->data[0][y * pict->linesize[0] + x] = outputSettings->fillColourY;
-
-        /* Cb and Cr */
-        for (y = 0; y < height / 2; y++) {
-            for (x = 0; x < width / 2; x++) {
-                pict->data[1][y * pict->linesize[1] + x] = outputSettings->fillColourCb;
-                pict->data[2][y * pict->linesize[2] + x] = outputSettings->fillColourCr;
-            }
-        }
+        printf( "Could not use background '%s'\n", outputSettings->background);
     }
 
-    if(1) {
-    time_t tt;
-    int t;
-    int l;
-
-        time(&tt);
-        pthread_mutex_lock( &outputSettings->buffer_mutex);
-        for( l=0; l<inputs_count; l++) {
-        inputMosaic *inputSource = inputs[l];
-
-            for(t=0;t<MAX_TILES_PER_INPUT;t++) {
-                for( tt=0; tt<outputSettings->tiles_count; tt++) {
-                Tiles *tile = outputSettings->tiles[tt];
-
-                    if( tile->video_dst_dirty) {
-                    uint8_t *newPos[4];
-
-                        newPos[0] = pict->data[0];
-                        newPos[1] = pict->data[1];
-                        newPos[2] = pict->data[2];
-                        newPos[3] = pict->data[3];
-
-                        newPos[0] += tile->x;
-                        newPos[0] += (tile->y*pict->linesize[0]);
-                        newPos[1] += tile->x/2;
-                        newPos[1] += (tile->y*pict->linesize[1]/2);
-                        newPos[2] += tile->x/2;
-                        newPos[2] += (tile->y*pict->linesize[2]/2);
-                        av_image_copy( newPos, pict->linesize,
-                            (const uint8_t **)(tile->video_dst_data), tile->video_dst_linesize,
-                            inputSource->video_dec_ctx->pix_fmt, tile->w, tile->h);
-                    }
-                }
-            }
-        }
-        pthread_mutex_unlock( &outputSettings->buffer_mutex);
-    }
+    av_freep( &loaded->data[0]);
+    av_frame_free( &outputSettings->background_frame);
+    outputSettings->background_frame = canvas;
 }
 
-static AVFrame *get_video_frame(OutputStream *ost)
+/* Blend a label into one picture, centred across and with its top at y */
+static void localSlateText( uint8_t **data, int *linesize, int w, int h, GlyphLabel *label, int y, int colour)
 {
-    AVCodecContext *c = ost->st->codec;
+int x  = FFMAX( (w-label->w)/2, 0)&~1;
+int lw = FFMIN( label->w, w-x);
+int lh = FFMIN( label->h, h-y);
 
-#if STREAM_DURATION
-    /* check if we want to generate more frames */
-    if (av_compare_ts(ost->next_pts, ost->st->codec->time_base,
-                      STREAM_DURATION, (AVRational){ 1, 1 }) >= 0)
-        return NULL;
-#else
-    if(stop_all_tasks)
-        return NULL;
-#endif
+    y &= ~1;
+    if( !label->w || lw<=0 || lh<=0)
+        return;
+    simd.mask_blend( data[0]+(y*linesize[0])+x, linesize[0], label->mask[0], label->linesize[0], lw, lh, colour>>16);
+    simd.mask_blend( data[1]+((y/2)*linesize[1])+(x/2), linesize[1], label->mask[1], label->linesize[1], lw/2, lh/2, colour>>8);
+    simd.mask_blend( data[2]+((y/2)*linesize[2])+(x/2), linesize[2], label->mask[1], label->linesize[1], lw/2, lh/2, colour);
+}
+
+/*
+ * Draw the "no signal" picture of every tile that can be seen, at the tile
+ * size, once. While an input is stalled its tiles copy this instead of the
+ * last picture, so it costs no more than a live tile.
+ */
+static void localPrepareSlates( OutputInfo *outputSettings)
+{
+GlyphLabel title = { { 0 } };
+GlyphLabel name  = { { 0 } };
+int t;
 
-//    printf( "get_video_frame %d,%d - %d,%d\r\n", c->width, c->height, ost->final_width, ost->final_height);
+    for( t=0; t<outputSettings->tiles_count; t++) {
+    Tiles *tile = outputSettings->tiles[t];
+    int size, y;
 
-    if (c->pix_fmt != STREAM_PIX_FMT) {
-        /* as we only generate a YUV420P picture, we must convert it
-         * to the codec pixel format if needed */
-        if( !ost->out_sws_ctx) {
-            ost->out_sws_ctx = sws_getContext(c->width, c->height,
-                                      STREAM_PIX_FMT,
-                                      c->width, c->height,
-                                      c->pix_fmt,
-                                      SCALE_FLAGS, NULL, NULL, NULL);
-            if (!ost->out_sws_ctx) {
-                fprintf(stderr,
-                        "Could not initialize the conversion context\n");
-                exit(1);
+        if( tile->hidden || tile->w<8 || tile->h<8)
+            continue;
+        if( av_image_alloc( tile->slate_data, tile->slate_linesize, tile->w, tile->h, STREAM_PIX_FMT, 16)<0) {
+            tile->slate_data[0] = NULL;
+            continue;
+        }
+        simd.fill( tile->slate_data[0], tile->slate_linesize[0], tile->w,   tile->h,   YCrCb_BLACK>>16);
+        simd.fill( tile->slate_data[1], tile->slate_linesize[1], tile->w/2, tile->h/2, (YCrCb_BLACK>>8)&0xff);
+        simd.fill( tile->slate_data[2], tile->slate_linesize[2], tile->w/2, tile->h/2, YCrCb_BLACK&0xff);
+        simd.border( tile->slate_data[0], tile->slate_linesize[0], tile->w,   tile->h,   2, YCrCb_GREY>>16);
+
+        // the biggest text that fits across the tile
+        for( size=GLYPH_SIZE_LARGE; size>GLYPH_SIZE_SMALL; size--) {
+            glyph_label_set( &title, "NO SIGNAL", size);
+            if( title.w<=tile->w-8)
+                break;
+        }
+        glyph_label_set( &title, "NO SIGNAL", size);
+        // only mode M keeps one input to a tile
+        glyph_label_set( &name, outputSettings->mode==MODE_MAPPED && tile->input ? tile->input->name : NULL, GLYPH_SIZE_SMALL);
+        y = (tile->h-title.h-(name.w ? name.h+4 : 0))/2;
+        localSlateText( tile->slate_data, tile->slate_linesize, tile->w, tile->h, &title, FFMAX( y, 0), YCrCb_WHITE);
+        if( name.w && y>=0) {
+            localSlateText( tile->slate_data, tile->slate_linesize, tile->w, tile->h, &name, y+title.h+4, YCrCb_GREY);
+        }
+    }
+    glyph_label_free( &title);
+    glyph_label_free( &name);
+}
+
+/*
+ * Load every overlay image, convert it to YUVA420P at its size on the
+ * canvas (layout coordinates mapped like the tiles when final_size is
+ * used), premultiply it and find the box that has any alpha in it.
+ */
+static void localPrepareOverlays( OutputInfo *outputSettings)
+{
+int o;
+
+    for( o=0; o<outputSettings->overlays_count; o++) {
+    Overlay *overlay = &outputSettings->overlays[o];
+    AVFrame *frame;
+    uint8_t *data[4] = { NULL };
+    int linesize[4];
+    int w, h, format;
+    int x, y, x0, y0, x1, y1;
+    struct SwsContext *sws = NULL;
+
+        if( ff_load_image( data, linesize, &w, &h, (enum AVPixelFormat *)&format, overlay->filename, NULL)<0 || !data[0]) {
+            printf( "Could not load overlay '%s'\n", overlay->filename);
+            continue;
+        }
+        if( !overlay->w || !overlay->h) {
+            overlay->w = w;
+            overlay->h = h;
+        }
+        overlay->x = (overlay->x*outputSettings->screen_width/outputSettings->layout_width)&~1;
+        overlay->y = (overlay->y*outputSettings->screen_height/outputSettings->layout_height)&~1;
+        overlay->w = overlay->w*outputSettings->screen_width/outputSettings->layout_width;
+        overlay->h = overlay->h*outputSettings->screen_height/outputSettings->layout_height;
+        // anything past the canvas edge is clipped when the blend is queued
+        overlay->w &= ~1;
+        overlay->h &= ~1;
+        if( overlay->w>0 && overlay->h>0) {
+            sws = sws_getContext( w, h, format, overlay->w, overlay->h, AV_PIX_FMT_YUVA420P, SCALE_FLAGS, NULL, NULL, NULL);
+        }
+        if( !sws) {
+            printf( "Could not use overlay '%s'\n", overlay->filename);
+            av_freep( &data[0]);
+            continue;
+        }
+        frame = alloc_picture( AV_PIX_FMT_YUVA420P, overlay->w, overlay->h);
+        sws_scale( sws, (const uint8_t * const *)data, linesize, 0, h, frame->data, frame->linesize);
+        sws_freeContext( sws);
+        av_freep( &data[0]);
+
+        overlay->chroma_alpha_linesize = overlay->w/2;
+        overlay->chroma_alpha          = malloc( (overlay->w/2)*(overlay->h/2));
+        if( !overlay->chroma_alpha) {
+            av_frame_free( &frame);
+            continue;
+        }
+        simd.box_downscale( overlay->chroma_alpha, overlay->chroma_alpha_linesize, frame->data[3], frame->linesize[3],
+                            overlay->w/2, overlay->h/2, 2, 2);
+
+        x0 = overlay->w;
+        y0 = overlay->h;
+        x1 = y1 = 0;
+        for( y=0; y<overlay->h; y++) {
+        uint8_t *Y = frame->data[0] + (y*frame->linesize[0]);
+        uint8_t *A = frame->data[3] + (y*frame->linesize[3]);
+
+            for( x=0; x<overlay->w; x++) {
+                Y[x] = ((Y[x]*A[x]) + 127)/255;
+                if( A[x]) {
+                    x0 = FFMIN( x0, x);
+                    y0 = FFMIN( y0, y);
+                    x1 = FFMAX( x1, x+1);
+                    y1 = FFMAX( y1, y+1);
+                }
             }
         }
-        localCreateVideoFrame(ost->tmp_video_frame, ost->next_pts, c->width, c->height);
-        sws_scale(ost->out_sws_ctx,
-                  (const uint8_t * const *)ost->tmp_video_frame->data, ost->tmp_video_frame->linesize,
-                  0, c->height, ost->video_frame->data, ost->video_frame->linesize);
-    } else if( ost->final_width || ost->final_height) {
-        if( !ost->final_sws_ctx) {
-            ost->final_sws_ctx = sws_getContext( c->width, c->height, c->pix_fmt,
-                                      ost->final_width, ost->final_height, c->pix_fmt,
-                                      SCALE_FLAGS, NULL, NULL, NULL);
-            if (!ost->final_sws_ctx) {
-                fprintf(stderr,
-                        "Could not initialize the conversion context\n");
-                exit(1);
+        for( y=0; y<overlay->h/2; y++) {
+        uint8_t *Cb = frame->data[1] + (y*frame->linesize[1]);
+        uint8_t *Cr = frame->data[2] + (y*frame->linesize[2]);
+        uint8_t *A  = overlay->chroma_alpha + (y*overlay->chroma_alpha_linesize);
+
+            for( x=0; x<overlay->w/2; x++) {
+                Cb[x] = ((Cb[x]*A[x]) + 127)/255;
+                Cr[x] = ((Cr[x]*A[x]) + 127)/255;
             }
         }
-        localCreateVideoFrame(ost->final_video_frame, ost->next_pts, ost->final_width, ost->final_height);
-        sws_scale(ost->out_sws_ctx,
-                  (const uint8_t * const *)ost->final_video_frame->data, ost->final_video_frame->linesize,
-                  0, c->height, ost->video_frame->data, ost->video_frame->linesize);
-    }
-    else {
-        localCreateVideoFrame(ost->video_frame, ost->next_pts, c->width, c->height);
+
+        overlay->bx = x0&~1;
+        overlay->by = y0&~1;
+        overlay->bw = FFMIN( (x1+1)&~1, overlay->w) - overlay->bx;
+        overlay->bh = FFMIN( (y1+1)&~1, overlay->h) - overlay->by;
+        if( overlay->bw<=0 || overlay->bh<=0) {
+            printf( "Overlay '%s' is fully transparent\n", overlay->filename);
+            av_frame_free( &frame);
+        }
+        else if( verbose) {
+            printf( "Overlay '%s' %d,%d %dx%d, blending %dx%d\n", overlay->filename, overlay->x, overlay->y,
+                    overlay->w, overlay->h, overlay->bw, overlay->bh);
+        }
+        overlay->frame = frame;
     }
+}
 
-    ost->video_frame->pts = ost->next_pts++;
+static void localFreeOverlays( OutputInfo *outputSettings)
+{
+int o;
 
-    return ost->video_frame;
+    for( o=0; o<outputSettings->overlays_count; o++) {
+        av_frame_free( &outputSettings->overlays[o].frame);
+        free( outputSettings->overlays[o].chroma_alpha);
+        free( outputSettings->overlays[o].filename);
+    }
+    free( outputSettings->overlays);
+    outputSettings->overlays       = NULL;
+    outputSettings->overlays_count = 0;
 }
 
 /*
- * encode one video frame and send it to the muxer
- * return 1 when encoding is finished, 0 otherwise
+ * final_size is the size that gets encoded. The layout is written in size
+ * coordinates, so instead of compositing at that size and scaling the
+ * whole picture down the tiles are mapped onto the final canvas, each
+ * source is then scaled once straight to its final tile size.
  */
-static int write_video_frame(AVFormatContext *oc, OutputStream *ost)
+static void localMapToFinalSize( OutputInfo *outputSettings)
 {
-    int ret;
-    AVCodecContext *c;
-    AVFrame *frame;
-    int got_packet = 0;
-
-    c = ost->st->codec;
-
-    frame = get_video_frame(ost);
+int sw = outputSettings->screen_width;
+int sh = outputSettings->screen_height;
+int fw = outputSettings->final_width&~1;
+int fh = outputSettings->final_height&~1;
+int t;
 
-    if (oc->oformat->flags & AVFMT_RAWPICTURE) {
-        /* a hack to avoid data copy with some raw video muxers */
-        AVPacket pkt;
-        av_init_packet(&pkt);
+    if( fw<=0 || fh<=0 || (fw==sw && fh==sh))
+        return;
 
-        if (!frame)
-            return 1;
+    for( t=0; t<outputSettings->tiles_count; t++) {
+    Tiles *tile = outputSettings->tiles[t];
+    int x0 = (tile->x*fw/sw)&~1;
+    int y0 = (tile->y*fh/sh)&~1;
+    int x1 = ((tile->x+tile->w)*fw/sw)&~1;
+    int y1 = ((tile->y+tile->h)*fh/sh)&~1;
 
-        pkt.flags        |= AV_PKT_FLAG_KEY;
-        pkt.stream_index  = ost->st->index;
-        pkt.data          = (uint8_t *)frame;
-        pkt.size          = sizeof(AVPicture);
+        if( verbose) {
+            printf( "tile %d %d,%d %dx%d -> %d,%d %dx%d\n", t, tile->x, tile->y, tile->w, tile->h, x0, y0, x1-x0, y1-y0);
+        }
+        tile->x = x0;
+        tile->y = y0;
+        tile->w = FFMAX( x1-x0, 2);
+        tile->h = FFMAX( y1-y0, 2);
+    }
+    outputSettings->screen_width  = fw;
+    outputSettings->screen_height = fh;
+}
 
-        pkt.pts = pkt.dts = frame->pts;
-        av_packet_rescale_ts(&pkt, c->time_base, ost->st->time_base);
+/*
+ * slices="rows": x264 (and x265) split the picture into N slices at whole
+ * macroblock rows, slice i starting at row (rows*i + N/2)/N. Every row of
+ * the automatic grid is moved into a slice of its own, centred in it and
+ * cut down to the smallest slice if it has to be, so no tile spans two
+ * slices and a row that did not change codes as cheaply as it can.
+ */
+#define MB_SIZE     16
 
-        ret = av_interleaved_write_frame(oc, &pkt);
-    } else {
-        AVPacket pkt = { 0 };
-        av_init_packet(&pkt);
+static void localAlignSliceRows( OutputInfo *outputSettings)
+{
+int rows = (outputSettings->screen_height+MB_SIZE-1)/MB_SIZE;
+int n = outputSettings->grid_down;
+int h = outputSettings->screen_height;
+int t, d;
 
-        /* encode the image */
-        ret = avcodec_encode_video2(c, &pkt, frame, &got_packet);
-        if (ret < 0) {
-            fprintf(stderr, "Error encoding video frame: %s\n", av_err2str(ret));
-            exit(1);
-        }
+    if( !outputSettings->slice_rows)
+        return;
+    if( !n || n>rows) {
+        printf( "slices=\"rows\" only works with the automatic grid, no slices\n");
+        outputSettings->slice_rows = 0;
+        return;
+    }
 
-        if (got_packet) {
-            ret = write_frame(oc, &c->time_base, ost->st, &pkt);
-        } else {
-            ret = 0;
+    for( d=0; d<n; d++) {
+        h = FFMIN( h, ((rows*(d+1) + n/2)/n - (rows*d + n/2)/n)*MB_SIZE);
+    }
+    for( t=0; t<outputSettings->tiles_count; t++) {
+    Tiles *tile = outputSettings->tiles[t];
+    int row = tile->index*n/outputSettings->tiles_count;
+    int y0 = ((rows*row + n/2)/n)*MB_SIZE;
+    int y1 = FFMIN( ((rows*(row+1) + n/2)/n)*MB_SIZE, outputSettings->screen_height);
+
+        tile->h = FFMIN( tile->h, h)&~3;
+        tile->y = (y0 + (y1-y0-tile->h)/2)&~1;
+        if( verbose) {
+            printf( "tile %d row %d in slice %d-%d: %d,%d %dx%d\n", t, row, y0, y1, tile->x, tile->y, tile->w, tile->h);
         }
     }
+    outputSettings->slice_rows = n;
+}
 
-    if (ret < 0) {
-        fprintf(stderr, "Error while writing video frame: %s\n", av_err2str(ret));
-        exit(1);
-    }
+/*
+ * Room for need rects. Crossing tiles can cut a rect list into many more
+ * pieces than there are tiles, so the lists grow as they are cut.
+ */
+static int localGrowRects( TileRect **rects, int *allocated, int need)
+{
+TileRect *grown;
 
-    return (frame || got_packet) ? 0 : 1;
+    if( need<=*allocated)
+        return 1;
+    need  = FFMAX( need, 2*(*allocated));
+    grown = realloc( *rects, need*sizeof( TileRect));
+    if( !grown)
+        return 0;
+    *rects     = grown;
+    *allocated = need;
+
+    return 1;
 }
 
-static void close_stream(AVFormatContext *oc, OutputStream *ost)
+/*
+ * Take the part of every rect in the list that lies inside x0,y0 - x1,y1
+ * out of it, leaving up to four rects for each one that was cut, so both
+ * lists need room for four times count.
+ */
+static int localCutRects( TileRect *rects, int count, TileRect *scratch, int x0, int y0, int x1, int y1)
 {
-    avcodec_close(ost->st->codec);
-    av_frame_free(&ost->video_frame);
-    av_frame_free(&ost->tmp_video_frame);
-    sws_freeContext(ost->out_sws_ctx);
+int n = 0;
+int r;
+
+    for( r=0; r<count; r++) {
+    TileRect *rect = &rects[r];
+    int rx1 = rect->x+rect->w;
+    int ry1 = rect->y+rect->h;
+    int top, bottom;
+
+        if( x0>=rx1 || x1<=rect->x || y0>=ry1 || y1<=rect->y) {
+            scratch[n++] = *rect;
+            continue;
+        }
+        top    = FFMAX( y0, rect->y);
+        bottom = FFMIN( y1, ry1);
+        if( top>rect->y) {
+            scratch[n++] = (TileRect){ rect->x, rect->y, rect->w, top-rect->y};
+        }
+        if( bottom<ry1) {
+            scratch[n++] = (TileRect){ rect->x, bottom, rect->w, ry1-bottom};
+        }
+        if( x0>rect->x) {
+            scratch[n++] = (TileRect){ rect->x, top, x0-rect->x, bottom-top};
+        }
+        if( x1<rx1) {
+            scratch[n++] = (TileRect){ x1, top, rx1-x1, bottom-top};
+        }
+    }
+    memcpy( rects, scratch, n*sizeof( TileRect));
+
+    return n;
 }
 
-/**************************************************************/
-/* media file output */
-void *outputThread( void *_outputSettings)
+/*
+ * Tiles are drawn lowest z first, tiles of the same z in the order they
+ * were given. Every tile is cut down to the rects that no tile drawn after
+ * it covers, so only what can be seen is copied, and a tile that is
+ * covered completely is neither scaled nor, in mode M, decoded.
+ * Popups come and go, so they never hide what is under them.
+ */
+static void localLayoutTiles( OutputInfo *outputSettings)
 {
-    OutputInfo *outputSettings = _outputSettings;
-    AVOutputFormat *fmt;
-    int ret;
-    int have_video = 0;
-    int encode_video = 0;
-    AVDictionary *opt = NULL;
+int count = outputSettings->tiles_count;
+TileRect *scratch = NULL;
+int scratch_allocated = 0;
+int t, u;
+
+    free( outputSettings->draw_order);
+    outputSettings->draw_order = malloc( FFMAX( count, 1)*sizeof( int));
+    if( !outputSettings->draw_order)
+        return;
+    for( t=0; t<count; t++) {
+    int z = outputSettings->tiles[t]->z;
 
-   /* allocate the output media context */
-    avformat_alloc_output_context2(&outputSettings->oc, NULL, NULL, outputSettings->filename);
-    if (!outputSettings->oc) {
-        printf("Could not deduce output format from file extension: using mpegts.\n");
-        avformat_alloc_output_context2(&outputSettings->oc, NULL, "mpegts", outputSettings->filename);
+        for( u=t; u>0 && outputSettings->tiles[ outputSettings->draw_order[u-1]]->z>z; u--) {
+            outputSettings->draw_order[u] = outputSettings->draw_order[u-1];
+        }
+        outputSettings->draw_order[u] = t;
     }
-    if (!outputSettings->oc)
-        return NULL;
 
-    fmt = outputSettings->oc->oformat;
+    for( t=0; t<count; t++) {
+    Tiles *tile = outputSettings->tiles[ outputSettings->draw_order[t]];
+    int allocated = 4;
 
-    /* Add the audio and video streams using the default format codecs
-     * and initialize the codecs. */
-    if (fmt->video_codec != AV_CODEC_ID_NONE) {
-        add_stream(&outputSettings->video_st, outputSettings->oc, &outputSettings->video_codec, outputSettings->video_encoding, outputSettings);
-        have_video = 1;
-        encode_video = 1;
+        free( tile->visible);
+        tile->visible       = malloc( allocated*sizeof( TileRect));
+        tile->visible_count = 0;
+        if( tile->visible && tile->w>0 && tile->h>0) {
+            tile->visible[0]    = (TileRect){ tile->x, tile->y, tile->w, tile->h};
+            tile->visible_count = 1;
+        }
+        for( u=t+1; u<count && tile->visible_count; u++) {
+        Tiles *above = outputSettings->tiles[ outputSettings->draw_order[u]];
+        // rounded in to even offsets in the tile for the chroma planes,
+        // the bit of overlap that leaves is drawn over by the tile above
+        int x0 = tile->x + ((above->x-tile->x+1)&~1);
+        int y0 = tile->y + ((above->y-tile->y+1)&~1);
+        int x1 = tile->x + ((above->x+above->w-tile->x)&~1);
+        int y1 = tile->y + ((above->y+above->h-tile->y)&~1);
+
+            if( above->popup || x0>=x1 || y0>=y1)
+                continue;
+            if( !localGrowRects( &tile->visible, &allocated, 4*tile->visible_count) ||
+                !localGrowRects( &scratch, &scratch_allocated, 4*tile->visible_count)) {
+                // what is left uncut is drawn over by the tiles above, only slower
+                break;
+            }
+            tile->visible_count = localCutRects( tile->visible, tile->visible_count, scratch, x0, y0, x1, y1);
+        }
+        tile->hidden = !tile->visible_count;
+        if( verbose) {
+            printf( "tile %d z %d%s: %s, %d rect%s\n", tile->index, tile->z, tile->popup ? " popup" : "",
+                    tile->hidden ? "covered" : "visible", tile->visible_count, tile->visible_count==1 ? "" : "s");
+        }
     }
+    free( scratch);
 
-    /* Now that all the parameters are set, we can open the audio and
-     * video codecs and allocate the necessary encode buffers. */
-    if (have_video)
-        open_video(outputSettings->oc, outputSettings->video_codec, &outputSettings->video_st, opt, outputSettings);
+    // thumbnail mode starts with the first tile that can be seen
+    outputSettings->thumbnail_count = 0;
+    for( t=0; t<count && outputSettings->tiles[t]->hidden; t++) {
+        outputSettings->thumbnail_count = t+1;
+    }
+    if( outputSettings->thumbnail_count>=count) {
+        outputSettings->thumbnail_count = 0;
+    }
+}
 
-    av_dump_format(outputSettings->oc, 0, outputSettings->filename, 1);
+/*
+ * benchmark="1": the time it takes to get a 1080i picture into a tile when
+ * it is taken as progressive, when one field is read and when the fields
+ * are blended first, for a tile the box filter does and one for swscale.
+ */
+#define BENCH_FIELD_WIDTH   1920
+#define BENCH_FIELD_HEIGHT  1080
 
-    /* open the output file, if needed */
-    if (!(fmt->flags & AVFMT_NOFILE)) {
-        ret = avio_open(&outputSettings->oc->pb, outputSettings->filename, AVIO_FLAG_WRITE);
-        if (ret < 0) {
-            fprintf(stderr, "Could not open '%s': %s\n", outputSettings->filename,
-                    av_err2str(ret));
-            return NULL;
-        }
+static void localBenchDeinterlace( void)
+{
+static const int sizes[][2] = { { 480, 270 }, { 352, 198 } };
+static const char *modes[] = { "progressive", "field", "blend" };
+inputMosaic *input = calloc( 1, sizeof( inputMosaic));
+uint8_t *src[4];
+int src_linesize[4];
+int s, m, i;
+
+    if( !input || av_image_alloc( src, src_linesize, BENCH_FIELD_WIDTH, BENCH_FIELD_HEIGHT, AV_PIX_FMT_YUV420P, 32)<0) {
+        free( input);
+        return;
     }
-
-    /* Write the stream header, if any. */
-    ret = avformat_write_header(outputSettings->oc, &opt);
-    if (ret < 0) {
-        fprintf(stderr, "Error occurred when opening output file: %s\n",
-                av_err2str(ret));
-        return NULL;
+    for( i=0; i<src_linesize[0]*BENCH_FIELD_HEIGHT; i++) {
+        src[0][i] = (i*2654435761u)>>24;
     }
+    memset( src[1], 0x80, src_linesize[1]*(BENCH_FIELD_HEIGHT/2));
+    memset( src[2], 0x80, src_linesize[2]*(BENCH_FIELD_HEIGHT/2));
 
-    while (!stop_all_tasks && (encode_video)) {
-        if( frame_ready) {
-            encode_video = !write_video_frame(outputSettings->oc, &outputSettings->video_st);
-            frame_ready--;
+    printf( "\n%-16s", "deinterlace");
+    for( m=0; m<3; m++) {
+        printf( "%12s", modes[m]);
+    }
+    printf( "   (us per %dx%d picture into the tile)\n", BENCH_FIELD_WIDTH, BENCH_FIELD_HEIGHT);
+    for( s=0; s<2; s++) {
+    Tiles tile = { 0 };
+    struct SwsContext *sws[2];
+    int box = 0;
+
+        tile.w = sizes[s][0];
+        tile.h = sizes[s][1];
+        if( av_image_alloc( tile.video_dst_data, tile.video_dst_linesize, tile.w, tile.h, STREAM_PIX_FMT, 16)<0)
+            break;
+        sws[0] = sws_getContext( BENCH_FIELD_WIDTH, BENCH_FIELD_HEIGHT, AV_PIX_FMT_YUV420P, tile.w, tile.h, STREAM_PIX_FMT, SCALE_FLAGS, NULL, NULL, NULL);
+        sws[1] = sws_getContext( BENCH_FIELD_WIDTH, BENCH_FIELD_HEIGHT/2, AV_PIX_FMT_YUV420P, tile.w, tile.h, STREAM_PIX_FMT, SCALE_FLAGS, NULL, NULL, NULL);
+        printf( "%4dx%-11d", tile.w, tile.h);
+        for( m=0; sws[0] && sws[1] && m<3; m++) {
+        int64_t start = localTimeNow();
+        int64_t elapsed;
+        int frames = 0;
+
+            do {
+            const uint8_t *data[4] = { src[0], src[1], src[2], src[3] };
+            int linesize[4] = { src_linesize[0], src_linesize[1], src_linesize[2], src_linesize[3] };
+            int ch = BENCH_FIELD_HEIGHT;
+
+                if( m==1) {
+                    localFieldPlanes( linesize, &ch);
+                }
+                else if( m==2) {
+                    localBlendFields( input, AV_PIX_FMT_YUV420P, data, linesize, BENCH_FIELD_WIDTH, ch);
+                }
+                box = localBoxScale( AV_PIX_FMT_YUV420P, data, linesize, BENCH_FIELD_WIDTH, ch, &tile, tile.video_dst_data);
+                if( !box) {
+                    sws_scale( sws[m==1], data, linesize, 0, ch, tile.video_dst_data, tile.video_dst_linesize);
+                }
+                frames++;
+                elapsed = localTimeNow() - start;
+            } while( elapsed<TIMEOFDAY_S/5);
+            printf( "%12.0f", (double)elapsed/frames);
         }
-        usleep( 500);
+        printf( "   %s\n", box ? "box filter" : "swscale");
+        sws_freeContext( sws[0]);
+        sws_freeContext( sws[1]);
+        av_freep( &tile.video_dst_data[0]);
     }
+    av_freep( &input->blend_data[0]);
+    av_freep( &src[0]);
+    free( input);
+}
 
-    /* Write the trailer, if any. The trailer must be written before you
-     * close the CodecContexts open when you wrote the header; otherwise
-     * av_write_trailer() may try to use memory that was freed on
-     * av_codec_close(). */
-    av_write_trailer(outputSettings->oc);
-
-    /* Close each codec. */
-    if (have_video)
-        close_stream(outputSettings->oc, &outputSettings->video_st);
-
-    if (!(fmt->flags & AVFMT_NOFILE))
-        /* Close the output file. */
-        avio_close(outputSettings->oc->pb);
+/*
+ * benchmark="1": a 4K 10 bit PQ picture into small tiles, swscale going
+ * straight to 8 bit against scaling at 16 bit and tone mapping at the tile.
+ */
+#define BENCH_HDR_WIDTH     3840
+#define BENCH_HDR_HEIGHT    2160
 
-    /* free the stream */
-    avformat_free_context(outputSettings->oc);
+static void localBenchToneMap( void)
+{
+static const int sizes[][2] = { { 480, 270 }, { 320, 180 }, { 160, 90 } };
+inputMosaic *input = calloc( 1, sizeof( inputMosaic));
+AVFrame *frame = alloc_picture( AV_PIX_FMT_YUV420P10, BENCH_HDR_WIDTH, BENCH_HDR_HEIGHT);
+int s, m, p, y, x;
+
+    if( !input || !frame) {
+        free( input);
+        av_frame_free( &frame);
+        return;
+    }
+    input->name      = "benchmark";
+    frame->color_trc = AVCOL_TRC_SMPTE2084;
+    for( p=0; p<3; p++) {
+        for( y=0; y<(p ? BENCH_HDR_HEIGHT/2 : BENCH_HDR_HEIGHT); y++) {
+        uint16_t *row = (uint16_t *)(frame->data[p] + (y*frame->linesize[p]));
+
+            for( x=0; x<(p ? BENCH_HDR_WIDTH/2 : BENCH_HDR_WIDTH); x++) {
+                row[x] = p ? 512 : 64 + (((x*7)+(y*3))%876);
+            }
+        }
+    }
 
-    return NULL;
+    printf( "\n%-16s%12s%12s   (us per %dx%d 10 bit PQ picture into the tile)\n", "tone map", "swscale", "16 bit+LUT",
+            BENCH_HDR_WIDTH, BENCH_HDR_HEIGHT);
+    for( s=0; s<(int)(sizeof( sizes)/sizeof( sizes[0])); s++) {
+    Tiles tile = { 0 };
+    struct SwsContext *sws;
+
+        tile.w = sizes[s][0];
+        tile.h = sizes[s][1];
+        if( av_image_alloc( tile.video_dst_data, tile.video_dst_linesize, tile.w, tile.h, STREAM_PIX_FMT, 16)<0)
+            break;
+        sws = sws_getContext( BENCH_HDR_WIDTH, BENCH_HDR_HEIGHT, AV_PIX_FMT_YUV420P10, tile.w, tile.h, STREAM_PIX_FMT, SCALE_FLAGS, NULL, NULL, NULL);
+        printf( "%4dx%-11d", tile.w, tile.h);
+        for( m=0; sws && m<2; m++) {
+        int64_t start = localTimeNow();
+        int64_t elapsed;
+        int frames = 0;
+
+            do {
+                if( m) {
+                    localToneMapScale( input, 0, frame, (const uint8_t **)frame->data, frame->linesize, BENCH_HDR_WIDTH, BENCH_HDR_HEIGHT, &tile, tile.video_dst_data);
+                }
+                else {
+                    sws_scale( sws, (const uint8_t * const *)frame->data, frame->linesize, 0, BENCH_HDR_HEIGHT, tile.video_dst_data, tile.video_dst_linesize);
+                }
+                frames++;
+                elapsed = localTimeNow() - start;
+            } while( elapsed<TIMEOFDAY_S/5);
+            printf( "%12.0f", (double)elapsed/frames);
+        }
+        printf( "\n");
+        sws_freeContext( sws);
+        localFreeScalers( input, 0);
+        av_freep( &tile.video_dst_data[0]);
+    }
+    av_frame_free( &frame);
+    free( input);
 }
 
-void *mainThread( void *_outputMosaic)
+#define BENCH_ENCODE_FRAMES 100
+
+/*
+ * benchmark="1": every encoder profile on the canvas of the first mosaic,
+ * then throughput with one sliced thread per row of the grid in place of
+ * the frame threads, a moving test pattern for BENCH_ENCODE_FRAMES frames. fps is frames in
+ * over the time it took, delay the frames that went in before the first
+ * came out and latency the average time from a frame going in to its packet.
+ */
+static void localBenchEncoder( void)
 {
-OutputInfo *outputSettings = _outputMosaic;
-int error;
-int t;
-int tile_replace;
+OutputInfo *outputSettings = outputMosaicsCnt ? outputMosaics[0] : NULL;
+AVCodec *codec = outputSettings ? avcodec_find_encoder( outputSettings->video_encoding) : NULL;
+int w, h, p;
+int64_t *sent;
+AVFrame *frame;
 
-    for( tile_replace=0; tile_replace<inputs_count; tile_replace++) {
-    inputMosaic *thisOne = inputs[ tile_replace];
+    if( !codec)
+        return;
+    w = (outputSettings->final_width>0 ? outputSettings->final_width : outputSettings->screen_width)&~1;
+    h = (outputSettings->final_height>0 ? outputSettings->final_height : outputSettings->screen_height)&~1;
+    frame = alloc_picture( STREAM_PIX_FMT, w, h);
+    sent  = calloc( BENCH_ENCODE_FRAMES, sizeof( int64_t));
+    if( !frame || !sent) {
+        av_frame_free( &frame);
+        free( sent);
+        return;
+    }
+    simd.fill( frame->data[1], frame->linesize[1], w/2, h/2, 128);
+    simd.fill( frame->data[2], frame->linesize[2], w/2, h/2, 128);
+
+    printf( "\n%-16s%12s%12s%12s   (%s %dx%d, preset %s, x264_threads %s)\n", "encoder", "fps", "delay", "latency ms",
+            avcodec_get_name( outputSettings->video_encoding), w, h, outputSettings->x264_preset, outputSettings->x264_threads);
+    for( p=PROFILE_DEFAULT; p<=PROFILES; p++) {
+    AVCodecContext *c = avcodec_alloc_context3( codec);
+    int64_t start, latency = 0;
+    int in = 0, out = 0, delay = -1;
+    char name[32];
+    AVPacket pkt;
 
-        // Create thread
-        error = pthread_create( &thisOne->pulledThread, NULL, inputThread, (void *)thisOne);
-        if (!error) {
-            pthread_detach( thisOne->pulledThread);
+        if( !c)
+            break;
+        c->width     = w;
+        c->height    = h;
+        c->pix_fmt   = STREAM_PIX_FMT;
+        c->bit_rate  = outputSettings->video_bitrate;
+        c->time_base = (AVRational){ 1, FFMAX( outputSettings->video_frame_rate, 1) };
+        c->gop_size  = outputSettings->gop_size;
+        if( c->codec_id==AV_CODEC_ID_H264) {
+            av_opt_set( c->priv_data, "preset", outputSettings->x264_preset, 0);
+        }
+        if( p<PROFILES) {
+            localEncoderProfile( c, outputSettings, p);
+            snprintf( name, sizeof( name), "%s", profileStrings[p]);
         }
         else {
-            thisOne->running = 0;
+            localEncoderProfile( c, outputSettings, PROFILE_THROUGHPUT);
+            localEncoderSlices( c, FFMAX( outputSettings->tiles_down, 2));
+            snprintf( name, sizeof( name), "%d slice rows", FFMAX( outputSettings->tiles_down, 2));
         }
-        sleep(1);
-    }
-
-    while(!stop_all_tasks) {
-    int timedOut = 0;
-
-        if( timedOut) {
-            pthread_mutex_lock( &outputSettings->buffer_mutex);
-            pthread_mutex_unlock( &outputSettings->buffer_mutex);
+        if( avcodec_open2( c, codec, NULL)<0) {
+            printf( "%-16s could not open the encoder\n", name);
+            avcodec_free_context( &c);
+            continue;
         }
-        encoded_frames = 0;
-        {
-        int t;
 
-            sleep( 1);
-            printf( "Number of encoded frames %d  ", encoded_frames);
-            for(t=0;t<outputSettings->tiles_count;t++) {
-                printf( "%d ", outputSettings->tiles[t]->updates_per_second);
-                outputSettings->tiles[t]->updates_per_second = 0;
+        start = localTimeNow();
+        while( out<BENCH_ENCODE_FRAMES) {
+        AVFrame *send = NULL;
+        int got_packet = 0;
+
+            if( in<BENCH_ENCODE_FRAMES && av_frame_make_writable( frame)>=0) {
+                simd.pattern( frame->data[0], frame->linesize[0], in*4, in*2, w, h, 16, 1, 1);
+                frame->pts = in;
+                sent[in++] = localTimeNow();
+                send       = frame;
+            }
+            av_init_packet( &pkt);
+            pkt.data = NULL;
+            pkt.size = 0;
+            // once everything is in, a NULL frame drains the encoder
+            if( avcodec_encode_video2( c, &pkt, send, &got_packet)<0 || (!send && !got_packet))
+                break;
+            if( got_packet) {
+                if( delay<0) {
+                    delay = in-1;
+                }
+                if( pkt.pts>=0 && pkt.pts<BENCH_ENCODE_FRAMES) {
+                    latency += localTimeNow()-sent[ pkt.pts];
+                }
+                out++;
+                av_packet_unref( &pkt);
             }
-            printf( "\r\n");
         }
+        printf( "%-16s%12.1f%12d%12.1f\n", name, (double)out*TIMEOFDAY_S/FFMAX( localTimeNow()-start, 1),
+                delay, out ? (double)latency/out/1000 : 0);
+        avcodec_free_context( &c);
     }
-    sleep(5);
-
-    return NULL;
+    av_frame_free( &frame);
+    free( sent);
 }
 
 int main( int argc, char **argv)
@@ -1997,6 +5639,23 @@ xmlNode *root_element = NULL;
     }
     xmlCleanupParser();
 
+    simd_init( SIMD_LEVEL_AUTO);
+    if( verbose) {
+        printf( "Pixel kernels: %s\n", simd_level_name( simd.level));
+    }
+    if( benchmark) {
+        simd_benchmark();
+        localBenchDeinterlace();
+        localBenchToneMap();
+        localBenchEncoder();
+        avformat_network_deinit();
+        return 0;
+    }
+    if( !glyph_atlas_init()) {
+        printf( "Captions disabled\n");
+    }
+    scale_pool = worker_pool_create( worker_cpu_count()-1);
+
     for( o=0;o<outputMosaicsCnt; o++) {
         outputSettings = outputMosaics[o];
 
@@ -2039,7 +5698,15 @@ xmlNode *root_element = NULL;
 
                 }
             }
+            outputSettings->grid_down = td;
         }
+        localMapToFinalSize( outputSettings);
+        localAlignSliceRows( outputSettings);
+        localLayoutTiles( outputSettings);
+        localPrepareBackground( outputSettings);
+        localCreateWidgets( outputSettings);
+        localPrepareOverlays( outputSettings);
+
         // Allocate space for the resized video frame
         for( tile_replace=0; tile_replace<outputSettings->tiles_count; tile_replace++) {
         Tiles *thisOne = outputSettings->tiles[tile_replace];
@@ -2047,10 +5714,17 @@ xmlNode *root_element = NULL;
             ret = av_image_alloc( thisOne->video_dst_data, thisOne->video_dst_linesize,
                                     thisOne->w, thisOne->h, STREAM_PIX_FMT, 16);
             thisOne->video_dst_bufsize = ret;
+            // same size and alignment, so the two share video_dst_linesize
+            if( outputSettings->mode==MODE_MAPPED && av_image_alloc( thisOne->back_data, thisOne->video_dst_linesize,
+                                    thisOne->w, thisOne->h, STREAM_PIX_FMT, 16)<0) {
+                printf( "Tile %d is scaled with the output waiting, no memory for a second picture\n", tile_replace);
+                thisOne->back_data[0] = NULL;
+            }
         }
 
         pthread_mutex_init( &outputSettings->tile_mutex, NULL);
         pthread_mutex_init( &outputSettings->buffer_mutex, NULL);
+        outputSettings->composite_pool = worker_pool_create( worker_cpu_count()-1);
         error = pthread_create( &outputSettings->outputThread, NULL, outputThread, (void *)outputSettings);
         if (!error) {
             pthread_detach( outputSettings->outputThread);
@@ -2068,11 +5742,19 @@ xmlNode *root_element = NULL;
             }
             inputs[tile_replace]->skip = 0;
             inputs[tile_replace]->tile_number[0] = m<outputSettings->tiles_count ? outputSettings->tile_map[m]+1:0;
+            if( m<outputSettings->tiles_count) {
+                inputs[tile_replace]->mapped_tile    = outputSettings->tiles[m];
+                outputSettings->tiles[m]->input      = inputs[tile_replace];
+            }
+            if( m<outputSettings->tiles_count && outputSettings->tiles[m]->vu_meter) {
+                inputs[tile_replace]->meter_tile = outputSettings->tiles[m];
+            }
             for(t=1;t<MAX_TILES_PER_INPUT;t++) {
                 inputs[tile_replace]->tile_number[t] = 0;
             }
             m++;
         }
+        localPrepareSlates( outputSettings);
         error = pthread_create( &outputSettings->threadMain, NULL, mainThread, (void *)outputSettings);
         if (error) {
             printf( "Main thread could not be created\n");
@@ -2084,20 +5766,47 @@ xmlNode *root_element = NULL;
 
         pthread_join( outputSettings->threadMain, NULL);
 
-        if (outputSettings->background_frame)
-            av_freep(&outputSettings->background_frame->data[0]);
         av_frame_free(&outputSettings->background_frame);
+        worker_pool_destroy( outputSettings->composite_pool);
+        free( outputSettings->render.ops);
+        localFreeWidgets( outputSettings);
+        localFreeOverlays( outputSettings);
 
         free( (void *)outputSettings->filename);
         free( (void *)outputSettings->x264_preset);
         free( (void *)outputSettings->x264_threads);
+        for( tile_replace=0; tile_replace<outputSettings->renditions_count; tile_replace++) {
+        Rendition *rung = &outputSettings->renditions[ tile_replace];
+
+            sws_freeContext( rung->sws_ctx);
+            pthread_mutex_destroy( &rung->mutex);
+            pthread_cond_destroy( &rung->cond);
+            free( rung->filename);
+            free( rung->x264_preset);
+        }
+        free( outputSettings->renditions);
+        for( tile_replace=0; tile_replace<outputSettings->sinks_count; tile_replace++) {
+        Sink *sink = &outputSettings->sinks[ tile_replace];
+
+            pthread_mutex_destroy( &sink->mutex);
+            pthread_cond_destroy( &sink->cond);
+            free( sink->url);
+            free( sink->format);
+        }
+        free( outputSettings->sinks);
         if( outputSettings->tiles) {
             for( tile_replace=0; tile_replace<outputSettings->tiles_count; tile_replace++) {
+                glyph_label_free( &outputSettings->tiles[ tile_replace]->caption);
+                glyph_label_free( &outputSettings->tiles[ tile_replace]->diagnostics);
+                free( outputSettings->tiles[ tile_replace]->named);
+                free( outputSettings->tiles[ tile_replace]->visible);
+                av_freep( &outputSettings->tiles[ tile_replace]->slate_data[0]);
                 free( outputSettings->tiles[ tile_replace]);
             }
             free( outputSettings->tiles);
             free( outputSettings->tile_map);
         }
+        free( outputSettings->draw_order);
         if( inputs) {
             for( tile_replace=0; tile_replace<inputs_count; tile_replace++) {
                 free( inputs[ tile_replace]->name);
@@ -2108,6 +5817,8 @@ xmlNode *root_element = NULL;
         }
     }
 
+    worker_pool_destroy( scale_pool);
+    glyph_atlas_free();
     avformat_network_deinit();
 
     return ret < 0;
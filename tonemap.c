@@ -0,0 +1,105 @@
+#include <math.h>
+#include <pthread.h>
+
+#include <libavutil/pixfmt.h>
+
+#include "tonemap.h"
+
+#define TONEMAP_SDR_WHITE       100.0       // nits the SDR picture is graded for
+#define TONEMAP_HDR_PEAK        1000.0      // brightest HDR nits kept apart from white
+
+static const char *curveNames[] = { "SDR", "PQ", "HLG" };
+
+// 3 spare bytes for the gathers
+static uint8_t tables[TONEMAP_CURVES][2][TONEMAP_LUT_SIZE+3];
+static pthread_once_t built = PTHREAD_ONCE_INIT;
+
+int tonemap_curve( int color_trc)
+{
+    if( color_trc==AVCOL_TRC_SMPTE2084)
+        return TONEMAP_PQ;
+    if( color_trc==AVCOL_TRC_ARIB_STD_B67)
+        return TONEMAP_HLG;
+
+    return TONEMAP_SDR;
+}
+
+const char *tonemap_name( int curve)
+{
+    if( curve<0 || curve>=TONEMAP_CURVES)
+        return "?";
+
+    return curveNames[curve];
+}
+
+/* SMPTE ST 2084 signal (0-1) to nits */
+static double localPQ( double e)
+{
+const double m1 = 2610.0/16384;
+const double m2 = 2523.0/4096*128;
+const double c1 = 3424.0/4096;
+const double c2 = 2413.0/4096*32;
+const double c3 = 2392.0/4096*32;
+double p = pow( e, 1/m2);
+
+    return 10000*pow( fmax( p-c1, 0)/(c2-(c3*p)), 1/m1);
+}
+
+/* ARIB STD-B67 signal (0-1) to display nits, inverse OETF then the OOTF for a 1000 nit display */
+static double localHLG( double e)
+{
+const double a = 0.17883277;
+const double b = 1-(4*a);
+const double c = 0.5-(a*log( 4*a));
+double scene = e<=0.5 ? (e*e)/3 : (exp( (e-c)/a)+b)/12;
+
+    return TONEMAP_HDR_PEAK*pow( scene, 1.2);
+}
+
+/* Extended Reinhard, SDR white stays at 1 and the HDR peak lands on 1 */
+static double localToneMap( double nits)
+{
+double x = nits/TONEMAP_SDR_WHITE;
+double w = TONEMAP_HDR_PEAK/TONEMAP_SDR_WHITE;
+
+    return fmin( x*(1+(x/(w*w)))/(1+x), 1);
+}
+
+static void localBuild( void)
+{
+int curve, v;
+
+    for( curve=0; curve<TONEMAP_CURVES; curve++) {
+    uint8_t *luma   = tables[curve][0];
+    uint8_t *chroma = tables[curve][1];
+
+        for( v=0; v<TONEMAP_LUT_SIZE; v++) {
+        // limited range, 64-940 luma and 64-960 chroma at 10 bits
+        double e = fmin( fmax( (v-64)/876.0, 0), 1);
+        double y;
+
+            switch( curve) {
+                case TONEMAP_PQ:
+                    y = pow( localToneMap( localPQ( e)), 1/2.4);
+                    break;
+                case TONEMAP_HLG:
+                    y = pow( localToneMap( localHLG( e)), 1/2.4);
+                    break;
+                default:
+                    y = e;
+                    break;
+            }
+            luma[v]   = (uint8_t)lrint( 16+(219*y));
+            chroma[v] = (uint8_t)lrint( fmin( fmax( 128+((v-512)/4.0), 16), 240));
+        }
+    }
+}
+
+const uint8_t *tonemap_lut( int curve, int chroma)
+{
+    pthread_once( &built, localBuild);
+    if( curve<0 || curve>=TONEMAP_CURVES)
+        curve = TONEMAP_SDR;
+
+    return tables[curve][chroma ? 1 : 0];
+}
@@ -0,0 +1,28 @@
+// Lookup tables taking 10 bit (and deeper) video down to 8 bit SDR
+#ifndef TONEMAP_H
+#define TONEMAP_H
+
+#include <stdint.h>
+
+enum {
+    TONEMAP_SDR,                // BT.709/BT.2020 gamma, only the bits are dropped
+    TONEMAP_PQ,                 // SMPTE ST 2084 (HDR10)
+    TONEMAP_HLG,                // ARIB STD-B67 hybrid log-gamma
+    TONEMAP_CURVES
+};
+
+// Entries in a table, indexed by the top 10 bits of a 16 bit sample
+#define TONEMAP_LUT_BITS        10
+#define TONEMAP_LUT_SIZE        (1<<TONEMAP_LUT_BITS)
+
+int         tonemap_curve( int color_trc);
+const char *tonemap_name( int curve);
+
+/*
+ * Limited range 8 bit code for every 10 bit code, luma through the curve
+ * and the tone map, chroma only rescaled. The tables are built on first use
+ * and padded so that 32 bit gathers can read past the last entry.
+ */
+const uint8_t *tonemap_lut( int curve, int chroma);
+
+#endif
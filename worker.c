@@ -0,0 +1,158 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <unistd.h>
+
+#include "worker.h"
+
+int worker_cpu_count( void)
+{
+long cpus = sysconf( _SC_NPROCESSORS_ONLN);
+
+    return cpus>0 ? (int)cpus : 1;
+}
+
+/*
+ * Hand out job numbers until there are none left, used by both the pool
+ * threads and the caller of worker_pool_run().
+ */
+static void localRunJobs( WorkerPool *pool)
+{
+    while( pool->next<pool->jobs) {
+    int job = pool->next++;
+
+        pthread_mutex_unlock( &pool->mutex);
+        pool->fn( pool->ctx, job);
+        pthread_mutex_lock( &pool->mutex);
+        if( !--pool->pending) {
+            pthread_cond_signal( &pool->done);
+        }
+    }
+}
+
+static void *localWorker( void *_pool)
+{
+WorkerPool *pool = _pool;
+int generation = 0;
+
+    pthread_mutex_lock( &pool->mutex);
+    while( !pool->quit) {
+        if( pool->generation==generation) {
+            pthread_cond_wait( &pool->start, &pool->mutex);
+            continue;
+        }
+        generation = pool->generation;
+        localRunJobs( pool);
+    }
+    pthread_mutex_unlock( &pool->mutex);
+
+    return NULL;
+}
+
+/*
+ * threads is the number of extra threads, the caller of worker_pool_run()
+ * always works as well so 0 gives a pool that runs everything inline.
+ */
+WorkerPool *worker_pool_create( int threads)
+{
+WorkerPool *pool = calloc( 1, sizeof( WorkerPool));
+int t;
+
+    if( !pool)
+        return NULL;
+
+    pthread_mutex_init( &pool->run_mutex, NULL);
+    pthread_mutex_init( &pool->mutex, NULL);
+    pthread_cond_init( &pool->start, NULL);
+    pthread_cond_init( &pool->done, NULL);
+    if( threads>0) {
+        pool->thread = calloc( threads, sizeof( pthread_t));
+    }
+    for( t=0; pool->thread && t<threads; t++) {
+        if( pthread_create( &pool->thread[t], NULL, localWorker, pool)) {
+            printf( "Could not create worker thread %d\n", t);
+            break;
+        }
+        pool->threads++;
+    }
+
+    return pool;
+}
+
+// The caller holds run_mutex
+static void localRunPool( WorkerPool *pool, int jobs, workerJob fn, void *ctx)
+{
+    pthread_mutex_lock( &pool->mutex);
+    pool->fn      = fn;
+    pool->ctx     = ctx;
+    pool->jobs    = jobs;
+    pool->next    = 0;
+    pool->pending = jobs;
+    pool->generation++;
+    pthread_cond_broadcast( &pool->start);
+
+    localRunJobs( pool);
+    while( pool->pending) {
+        pthread_cond_wait( &pool->done, &pool->mutex);
+    }
+    pthread_mutex_unlock( &pool->mutex);
+}
+
+void worker_pool_run( WorkerPool *pool, int jobs, workerJob fn, void *ctx)
+{
+int j;
+
+    if( !pool || !pool->threads || jobs<2) {
+        for( j=0; j<jobs; j++) {
+            fn( ctx, j);
+        }
+        return;
+    }
+
+    pthread_mutex_lock( &pool->run_mutex);
+    localRunPool( pool, jobs, fn, ctx);
+    pthread_mutex_unlock( &pool->run_mutex);
+}
+
+/*
+ * For callers that each have their own work, like the inputs scaling their
+ * tiles: one that finds the pool taken does its jobs itself instead of
+ * queueing behind the other. Returns 1 when the pool ran them.
+ */
+int worker_pool_try_run( WorkerPool *pool, int jobs, workerJob fn, void *ctx)
+{
+int j;
+
+    if( pool && pool->threads && jobs>1 && !pthread_mutex_trylock( &pool->run_mutex)) {
+        localRunPool( pool, jobs, fn, ctx);
+        pthread_mutex_unlock( &pool->run_mutex);
+        return 1;
+    }
+    for( j=0; j<jobs; j++) {
+        fn( ctx, j);
+    }
+
+    return 0;
+}
+
+void worker_pool_destroy( WorkerPool *pool)
+{
+int t;
+
+    if( !pool)
+        return;
+
+    pthread_mutex_lock( &pool->mutex);
+    pool->quit = 1;
+    pthread_cond_broadcast( &pool->start);
+    pthread_mutex_unlock( &pool->mutex);
+    for( t=0; t<pool->threads; t++) {
+        pthread_join( pool->thread[t], NULL);
+    }
+
+    pthread_cond_destroy( &pool->done);
+    pthread_cond_destroy( &pool->start);
+    pthread_mutex_destroy( &pool->mutex);
+    pthread_mutex_destroy( &pool->run_mutex);
+    free( pool->thread);
+    free( pool);
+}
@@ -0,0 +1,34 @@
+// Small pool of threads that split one job into numbered pieces
+#ifndef WORKER_H
+#define WORKER_H
+
+#include <pthread.h>
+
+typedef void (*workerJob)( void *ctx, int job);
+
+typedef struct _WorkerPool {
+    int              threads;
+    pthread_t       *thread;
+
+    pthread_mutex_t  run_mutex;         // one caller at a time
+    pthread_mutex_t  mutex;
+    pthread_cond_t   start;
+    pthread_cond_t   done;
+
+    workerJob        fn;
+    void            *ctx;
+    int              jobs;
+    int              next;
+    int              pending;
+    int              generation;
+    int              quit;
+} WorkerPool;
+
+int         worker_cpu_count( void);
+WorkerPool *worker_pool_create( int threads);
+void        worker_pool_run( WorkerPool *pool, int jobs, workerJob fn, void *ctx);
+// As worker_pool_run(), but runs every job on the caller while the pool is busy with another caller
+int         worker_pool_try_run( WorkerPool *pool, int jobs, workerJob fn, void *ctx);
+void        worker_pool_destroy( WorkerPool *pool);
+
+#endif